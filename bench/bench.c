@@ -0,0 +1,365 @@
+#include "exprlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Benchmarks for parsing, single evaluation and batch throughput.
+ *
+ * Every result is one JSON object per line on stdout:
+ *
+ *   {"bench":"eval","case":"depth_8","engine":"tree","metric":"ns_per_op",
+ *    "value":123.4}
+ *
+ * so runs can be diffed or loaded into a spreadsheet. Each figure is the best
+ * of BENCH_SAMPLES samples of at least BENCH_SAMPLE_NS each. An optional
+ * argument only runs the benchmarks whose name contains it.
+ */
+
+#define BENCH_SAMPLES 5
+#define BENCH_SAMPLE_NS 20000000.0
+#define BENCH_ROWS ((size_t)1 << 20)
+#define BENCH_MAX_DEPTH 12
+
+static double g_x = 1.25, g_y = 0.75, g_z = 2.5, g_t = 0.1;
+static ExprLibVariable g_vars[] = {
+    {"x", &g_x}, {"y", &g_y}, {"z", &g_z}, {"t", &g_t}};
+static ExprContext g_ctx = {g_vars, 4};
+
+static volatile double g_sink;
+
+static const char *const g_corpus[] = {
+    "x^2 + 2*x*y + y^2",
+    "sqrt(x*x + y*y + z*z)",
+    "sin(t) * cos(2*t) + 0.5 * sin(3*t)",
+    "exp(-x^2 / (2 * y^2)) / (y * sqrt(2 * pi))",
+    "max(x, y, z) - min(x, y, z)",
+    "(x - y) / (x + y + 1e-9)",
+    "ln(1 + exp(x)) - ln(1 + exp(-y))",
+    "atan(y / x) * 180 / pi",
+    "1.5 * x^3 - 2.25 * x^2 + 0.75 * x - 3.125",
+    "floor(x * 100 + 0.5) / 100",
+    "nCr(10, 3) * x^3 * (1 - x)^7",
+    "abs(sin(x) - cos(y)) + tan(z / 4)",
+    "(x + y) * (x - y) * (z + t) * (z - t)",
+    "e^(t * ln(x)) + cbrt(z)",
+    "pow(x, 2.5) + pow(y, 0.5) - pow(z, 1.5)",
+    "-(x - 3.14159) * -(y + 2.71828) / -(z - 1.41421)",
+};
+#define BENCH_CORPUS (sizeof(g_corpus) / sizeof(*g_corpus))
+
+static const char *const g_arith_mix =
+    "x*y + x/(y + 1) - (x + y)*(x - y) + x*x*y - y/(x + 2) + 3*x - 0.5*y";
+static const char *const g_call_mix =
+    "sin(x) + cos(y) + sqrt(x*x + y*y) + exp(-x) + ln(y + 1) + atan(x/y)";
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* A body runs its operation iters times and returns a value to sink. */
+typedef double (*BenchBody)(void *state, size_t iters);
+
+/* Best time per iteration, in ns. */
+static double bench_time(BenchBody body, void *state) {
+    size_t iters = 1;
+    for (;;) {
+        double start = now_ns();
+        g_sink = body(state, iters);
+        double elapsed = now_ns() - start;
+        if (elapsed >= BENCH_SAMPLE_NS / 10 || iters >= ((size_t)1 << 40)) {
+            iters = (size_t)(iters * (BENCH_SAMPLE_NS / (elapsed + 1))) + 1;
+            break;
+        }
+        iters *= 10;
+    }
+    double best = 0;
+    for (int i = 0; i < BENCH_SAMPLES; ++i) {
+        double start = now_ns();
+        g_sink = body(state, iters);
+        double per = (now_ns() - start) / (double)iters;
+        if (i == 0 || per < best)
+            best = per;
+    }
+    return best;
+}
+
+static void report(const char *bench, const char *name, const char *engine,
+                   const char *metric, double value) {
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"engine\":\"%s\","
+           "\"metric\":\"%s\",\"value\":%.6g}\n",
+           bench, name, engine, metric, value);
+    fflush(stdout);
+}
+
+static void fail(const char *what, const char *expression) {
+    fprintf(stderr, "bench: %s failed for \"%s\": %s\n", what, expression,
+            EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR]);
+    exit(1);
+}
+
+/* Parsing */
+
+static double parse_heap(void *state, size_t iters) {
+    (void)state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        ExprNode *ast =
+            exprlib_parse((string)g_corpus[i % BENCH_CORPUS], &g_ctx);
+        acc += ast != NULL;
+        exprlib_free(ast);
+    }
+    return acc;
+}
+
+static double parse_arena(void *state, size_t iters) {
+    ExprArena *arena = state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        acc += exprlib_parse_arena((string)g_corpus[i % BENCH_CORPUS], &g_ctx,
+                                   arena) != NULL;
+        exprlib_arena_reset(arena);
+    }
+    return acc;
+}
+
+static double parse_compile(void *state, size_t iters) {
+    (void)state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        ExprNode *ast =
+            exprlib_parse((string)g_corpus[i % BENCH_CORPUS], &g_ctx);
+        ExprCompiled *program = exprlib_compile(ast, &g_ctx);
+        acc += program != NULL;
+        exprlib_free_compiled(program);
+        exprlib_free(ast);
+    }
+    return acc;
+}
+
+static void bench_parse(void) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < BENCH_CORPUS; ++i) {
+        ExprNode *ast = exprlib_parse((string)g_corpus[i], &g_ctx);
+        if (!ast)
+            fail("parse", g_corpus[i]);
+        exprlib_free(ast);
+        bytes += strlen(g_corpus[i]);
+    }
+    double avg_len = (double)bytes / BENCH_CORPUS;
+
+    double ns = bench_time(parse_heap, NULL);
+    report("parse", "corpus", "heap", "ns_per_op", ns);
+    report("parse", "corpus", "heap", "mb_per_sec", avg_len / ns * 1e3);
+
+    ExprArena *arena = exprlib_arena_create(0);
+    ns = bench_time(parse_arena, arena);
+    exprlib_arena_destroy(arena);
+    report("parse", "corpus", "arena", "ns_per_op", ns);
+    report("parse", "corpus", "arena", "mb_per_sec", avg_len / ns * 1e3);
+
+    ns = bench_time(parse_compile, NULL);
+    report("parse", "corpus", "compile", "ns_per_op", ns);
+}
+
+/* Single evaluation */
+
+typedef struct {
+    ExprNode *ast;
+    ExprCompiled *program;
+    ExprFlat *flat;
+    ExprJitFn jit;
+} BenchExpr;
+
+/* The inputs move every iteration so nothing can be hoisted out. */
+static double eval_tree(void *state, size_t iters) {
+    const BenchExpr *e = state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        g_x = 1.25 + (double)(i & 7) * 0.125;
+        acc += exprlib_evaluate(e->ast, &g_ctx);
+    }
+    return acc;
+}
+
+static double eval_compiled(void *state, size_t iters) {
+    const BenchExpr *e = state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        g_x = 1.25 + (double)(i & 7) * 0.125;
+        acc += exprlib_run(e->program, &g_ctx);
+    }
+    return acc;
+}
+
+static double eval_flat(void *state, size_t iters) {
+    const BenchExpr *e = state;
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        g_x = 1.25 + (double)(i & 7) * 0.125;
+        acc += exprlib_flat_evaluate(e->flat, &g_ctx);
+    }
+    return acc;
+}
+
+static double eval_jit(void *state, size_t iters) {
+    const BenchExpr *e = state;
+    double vars[4] = {g_x, g_y, g_z, g_t};
+    double acc = 0;
+    for (size_t i = 0; i < iters; ++i) {
+        vars[0] = 1.25 + (double)(i & 7) * 0.125;
+        acc += e->jit(vars);
+    }
+    return acc;
+}
+
+static void bench_expression(const char *bench, const char *name,
+                             const char *expression) {
+    BenchExpr e = {0};
+    e.ast = exprlib_parse((string)expression, &g_ctx);
+    if (!e.ast)
+        fail("parse", expression);
+    e.program = exprlib_compile(e.ast, &g_ctx);
+    e.flat = exprlib_flat_create(e.ast);
+    if (!e.program || !e.flat)
+        fail("compile", expression);
+    ExprJit *jit = exprlib_jit_compile(e.program);
+    e.jit = exprlib_jit_function(jit);
+
+    report(bench, name, "tree", "ns_per_op", bench_time(eval_tree, &e));
+    report(bench, name, "compiled", "ns_per_op",
+           bench_time(eval_compiled, &e));
+    report(bench, name, "flat", "ns_per_op", bench_time(eval_flat, &e));
+    if (e.jit)
+        report(bench, name, "jit", "ns_per_op", bench_time(eval_jit, &e));
+
+    exprlib_jit_free(jit);
+    exprlib_flat_free(e.flat);
+    exprlib_free_compiled(e.program);
+    exprlib_free(e.ast);
+}
+
+/* A full binary tree of the given depth over x, y and small numbers. */
+static void append_tree(char **p, int depth, unsigned *leaf) {
+    if (depth == 0) {
+        static const char *const leaves[] = {"x", "y", "1.5", "z", "0.25"};
+        *p += sprintf(*p, "%s", leaves[(*leaf)++ % 5]);
+        return;
+    }
+    *(*p)++ = '(';
+    append_tree(p, depth - 1, leaf);
+    *(*p)++ = "+-*+"[depth % 4];
+    append_tree(p, depth - 1, leaf);
+    *(*p)++ = ')';
+}
+
+static void bench_eval(void) {
+    char *buf = malloc(((size_t)8 << BENCH_MAX_DEPTH) + 16);
+    if (!buf)
+        exit(1);
+    for (int depth = 2; depth <= BENCH_MAX_DEPTH; depth += 2) {
+        char *p = buf;
+        unsigned leaf = 0;
+        append_tree(&p, depth, &leaf);
+        *p = '\0';
+        char name[32];
+        snprintf(name, sizeof(name), "depth_%d", depth);
+        bench_expression("eval", name, buf);
+    }
+    free(buf);
+}
+
+static void bench_mix(void) {
+    bench_expression("mix", "arithmetic", g_arith_mix);
+    bench_expression("mix", "calls", g_call_mix);
+}
+
+/* Batch and parallel throughput */
+
+typedef struct {
+    ExprCompiled *program;
+    const double *const *columns;
+    double *out;
+    ExprThreadPool *pool;
+} BenchBatch;
+
+static double batch_serial(void *state, size_t iters) {
+    BenchBatch *b = state;
+    for (size_t i = 0; i < iters; ++i) {
+        if (!exprlib_run_batch(b->program, &g_ctx, b->columns, BENCH_ROWS,
+                               b->out))
+            fail("batch", "");
+    }
+    return b->out[BENCH_ROWS - 1];
+}
+
+static double batch_parallel(void *state, size_t iters) {
+    BenchBatch *b = state;
+    for (size_t i = 0; i < iters; ++i) {
+        if (!exprlib_run_batch_parallel(b->program, &g_ctx, b->columns,
+                                        BENCH_ROWS, b->out, b->pool))
+            fail("batch parallel", "");
+    }
+    return b->out[BENCH_ROWS - 1];
+}
+
+static void bench_batch(void) {
+    double *x = malloc(sizeof(double) * BENCH_ROWS);
+    double *y = malloc(sizeof(double) * BENCH_ROWS);
+    double *out = malloc(sizeof(double) * BENCH_ROWS);
+    if (!x || !y || !out)
+        exit(1);
+    for (size_t i = 0; i < BENCH_ROWS; ++i) {
+        x[i] = 0.5 + (double)(i % 1000) * 1e-3;
+        y[i] = 1.5 - (double)(i % 777) * 1e-3;
+    }
+    const double *columns[] = {x, y, NULL, NULL};
+    ExprThreadPool *pool = exprlib_pool_create(0);
+
+    const struct {
+        const char *name;
+        const char *expression;
+    } cases[] = {{"arithmetic", g_arith_mix}, {"calls", g_call_mix}};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+        ExprNode *ast = exprlib_parse((string)cases[i].expression, &g_ctx);
+        ExprCompiled *program = ast ? exprlib_compile(ast, &g_ctx) : NULL;
+        if (!program)
+            fail("compile", cases[i].expression);
+        BenchBatch b = {program, columns, out, pool};
+        report("batch", cases[i].name, "serial", "rows_per_sec",
+               BENCH_ROWS / bench_time(batch_serial, &b) * 1e9);
+        if (pool)
+            report("batch", cases[i].name, "parallel", "rows_per_sec",
+                   BENCH_ROWS / bench_time(batch_parallel, &b) * 1e9);
+        exprlib_free_compiled(program);
+        exprlib_free(ast);
+    }
+
+    exprlib_pool_destroy(pool);
+    free(out);
+    free(y);
+    free(x);
+}
+
+int main(int argc, char **argv) {
+    const struct {
+        const char *name;
+        void (*run)(void);
+    } benches[] = {{"parse", bench_parse},
+                   {"eval", bench_eval},
+                   {"mix", bench_mix},
+                   {"batch", bench_batch}};
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    exprlib_init();
+    printf("{\"bench\":\"meta\",\"cpus\":%ld,\"rows\":%zu,\"samples\":%d}\n",
+           sysconf(_SC_NPROCESSORS_ONLN), BENCH_ROWS, BENCH_SAMPLES);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); ++i) {
+        if (strstr(benches[i].name, filter))
+            benches[i].run();
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #define __EXPRLIB_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
@@ -40,7 +41,27 @@ static const char *EXPRLIB_ERROR_MESSAGES[] = {"Success",
                                                "Duplicate Function",
                                                "Unknown Error"};
 
-extern ExprLibError EXPRLIB_ERROR;
+/* Each thread sees its own EXPRLIB_ERROR, so parsing and evaluation on
+ * different threads never race on (or share a cache line for) the status. */
+#if defined(__cplusplus)
+#define EXPRLIB_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define EXPRLIB_THREAD_LOCAL __declspec(thread)
+#else
+#define EXPRLIB_THREAD_LOCAL _Thread_local
+#endif
+
+extern EXPRLIB_THREAD_LOCAL ExprLibError EXPRLIB_ERROR;
+
+/* Symbols: every name the library stores (in nodes and in the registry) is
+ * interned once in a global table and identified by a nonzero ExprSymbol, so
+ * two names are equal exactly when their symbols are. Interned strings are
+ * immutable and live until the process exits; never modify or free them. */
+typedef uint32_t ExprSymbol;
+#define EXPR_SYMBOL_NONE 0u
+
+ExprSymbol exprlib_intern(const char *name);
+const char *exprlib_symbol_name(ExprSymbol symbol); /* NULL if unknown */
 
 typedef struct {
     string name;
@@ -48,7 +69,8 @@ typedef struct {
 } ExprLibVariable;
 
 typedef struct {
-    string name;
+    string name; /* interned */
+    ExprSymbol symbol;
     double value;
 } ExprLibConstant;
 
@@ -65,39 +87,74 @@ typedef enum {
 } ExprNodeType;
 
 typedef double (*ExprLibFnPtr)(const double *args, int argc);
+/* Batch kernel: out[i] = f(args[0][i], ..., args[argc-1][i]) for i < n.
+ * out may alias args[0]. */
+typedef void (*ExprLibVecFnPtr)(const double *const *args, int argc, size_t n,
+                                double *out);
+
+/* Function flags */
+#define EXPRLIB_FN_PURE 0x1u    /* result depends only on the arguments */
+#define EXPRLIB_FN_MEMOIZE 0x2u /* cache results per thread, implies PURE */
+
 typedef struct ExprNode ExprNode;
+typedef struct ExprCompiled ExprCompiled;
+typedef struct ExprArena ExprArena;
+typedef struct ExprThreadPool ExprThreadPool;
+typedef struct ExprJit ExprJit;
+typedef struct ExprCache ExprCache;
+typedef struct ExprBundle ExprBundle;
+typedef struct ExprLive ExprLive;
+typedef struct ExprProgram ExprProgram;
+typedef struct ExprFlat ExprFlat;
+typedef struct ExprProfile ExprProfile;
 
 typedef struct {
-    string name;
+    string name;            /* interned, see ExprSymbol */
+    ExprLibFnPtr fn;        /* bound at parse time */
+    ExprLibVecFnPtr vec_fn; /* optional batch kernel, may be NULL */
+    unsigned fn_flags;      /* EXPRLIB_FN_* of the bound function */
+    int arity;              /* declared arity, -1 = variadic */
     ExprNode **args;
     int argc;
+    ExprSymbol symbol; /* of name */
 } ExprNodeFunctionCall;
 
+typedef struct {
+    string name; /* interned, see ExprSymbol */
+    ExprSymbol symbol;
+    int index; /* slot in ExprContext.variables, resolved at parse time */
+} ExprNodeVariable;
+
 typedef struct {
     char op;
     struct ExprNode *left;
     struct ExprNode *right;
 } ExprNodeOperator;
 
+#define EXPR_NODE_FLAG_ARENA 0x1u /* node memory is owned by an ExprArena */
+
 struct ExprNode {
     ExprNodeType type;
+    unsigned flags;
     union {
         double number;
-        string variable_name;
+        ExprNodeVariable variable;
         ExprNodeOperator op_node;
         ExprNodeFunctionCall fn_call;
     } data;
 };
 
-/* AST construction */
+/* AST construction. Names are interned, the caller keeps its own copy. */
 ExprNode *create_number_node(double value);
-ExprNode *create_variable_node(const string name);
+ExprNode *create_variable_node(const string name, int index);
 ExprNode *create_operator_node(char op, ExprNode *left, ExprNode *right);
-ExprNode *create_function_node(const string name, ExprNode **args, int argc);
+ExprNode *create_function_node(const string name, ExprLibFnPtr fn, int arity,
+                               ExprNode **args, int argc);
 
 /* Parsing helpers */
 double parse_number(const char **expr_ptr, bool *found);
 bool is_defined_variable(const string name, const ExprContext *context);
+int find_variable(const string name, const ExprContext *context);
 ExprNode *parse_unary(const char **expr_ptr, const ExprContext *context);
 ExprNode *parse_binary_rhs(int expr_prec, ExprNode *lhs, const char **expr_ptr,
                            const ExprContext *context);
@@ -110,9 +167,248 @@ void print_expr_tree(const ExprNode *node, int indent);
 ExprNode *exprlib_parse(const string expression, const ExprContext *context);
 double exprlib_evaluate(const ExprNode *expr, const ExprContext *context);
 bool exprlib_register_function(const char *name, int arity, ExprLibFnPtr fn);
+bool exprlib_register_vector_function(const char *name, int arity,
+                                      ExprLibFnPtr scalar_fn,
+                                      ExprLibVecFnPtr vector_fn);
+/* flags: EXPRLIB_FN_*. Functions registered without EXPRLIB_FN_PURE are never
+ * folded by exprlib_optimize nor shared by the compiler. With
+ * EXPRLIB_FN_MEMOIZE, calls look their arguments up in a small per-thread
+ * cache first; meant for expensive functions called with few distinct
+ * arguments. Calls that set EXPRLIB_ERROR are not cached. */
+bool exprlib_register_function_ex(const char *name, int arity,
+                                  ExprLibFnPtr scalar_fn,
+                                  ExprLibVecFnPtr vector_fn, unsigned flags);
+bool exprlib_register_constant(const char *name, double value);
 void exprlib_clear_functions(void);
 void exprlib_init(void);
 
+/* Arena allocation: every node and argument array of the expressions
+ * parsed into an arena lives in its blocks and is released by
+ * exprlib_arena_reset/exprlib_arena_destroy. exprlib_free ignores arena
+ * nodes. A block_size of 0 selects the default. */
+ExprArena *exprlib_arena_create(size_t block_size);
+void *exprlib_arena_alloc(ExprArena *arena, size_t size);
+void exprlib_arena_reset(ExprArena *arena);
+void exprlib_arena_destroy(ExprArena *arena);
+ExprNode *exprlib_parse_arena(const string expression,
+                              const ExprContext *context, ExprArena *arena);
+
+/* Why a parse failed: the error code, the bytes of the expression it refers
+ * to (offset and length; length 0 at the end of the input) and a short
+ * message. The library itself never prints. */
+#define EXPRLIB_DIAGNOSTIC_MESSAGE 96
+typedef struct {
+    ExprLibError code;
+    size_t offset;
+    size_t length;
+    char message[EXPRLIB_DIAGNOSTIC_MESSAGE];
+} ExprLibDiagnostic;
+
+/* exprlib_parse or, with an arena, exprlib_parse_arena. diag may be NULL;
+ * otherwise it is filled in on every call (code EXPRLIB_SUCCESS on success).
+ * The message is only formatted when diag is given. */
+ExprNode *exprlib_parse_ex(const string expression, const ExprContext *context,
+                           ExprArena *arena, ExprLibDiagnostic *diag);
+
+/* Rewrite the tree in place: fold constant operators and pure calls, gather
+ * constants of + and * chains, drop identities (x*1, x+0, x^1, -(-x), ...).
+ * May change results in the last bits; see README. */
+bool exprlib_optimize(ExprNode *expr);
+
+/* Ahead-of-time code: write `double fn_name(const double *vars)` computing
+ * expr as standalone C. vars[i] stands for variable index i of the context the
+ * tree was parsed with. Built-ins map to libm; other functions are called by
+ * name with the ExprLibFnPtr signature. The generated code reports no errors:
+ * division by zero follows IEEE 754 and invalid factorial, nCr or nPr
+ * arguments give NaN. */
+bool exprlib_emit_c(const ExprNode *expr, FILE *out, const char *fn_name);
+
+/* Bytecode compilation: lower an AST once, run it many times. The program
+ * keeps variable indices into the context it was compiled against, so it must
+ * be run with a context that has the same variable layout. */
+ExprCompiled *exprlib_compile(const ExprNode *expr, const ExprContext *context);
+/* Compile flags */
+#define EXPRLIB_COMPILE_EXACT_POW 0x1u /* always call pow for x^c, pow(x, c) */
+ExprCompiled *exprlib_compile_ex(const ExprNode *expr,
+                                 const ExprContext *context, unsigned flags);
+double exprlib_run(const ExprCompiled *program, const ExprContext *context);
+/* Programs are reference counted: exprlib_free_compiled drops a reference and
+ * frees the program with the last one. */
+ExprCompiled *exprlib_retain_compiled(ExprCompiled *program);
+void exprlib_free_compiled(ExprCompiled *program);
+void print_compiled_expr(const ExprCompiled *program);
+
+/* Batch evaluation over n rows. columns[i] holds n values for
+ * context->variables[i]; a NULL column (or a NULL columns array) uses the
+ * variable's current *value for every row. Returns false and sets
+ * EXPRLIB_ERROR if any row fails. */
+bool exprlib_run_batch(const ExprCompiled *program, const ExprContext *context,
+                       const double *const *columns, size_t n, double *out);
+bool exprlib_evaluate_batch(const ExprNode *expr, const ExprContext *context,
+                            const double *const *columns, size_t n,
+                            double *out);
+
+/* Parallel batch evaluation. A pool of `threads` threads (<= 0 means one per
+ * online CPU) counts the calling thread, which always takes part in the work.
+ * Rows are handed out in chunks of whole blocks from a shared cursor; on
+ * failure the remaining chunks are skipped and the contents of out are
+ * unspecified. A NULL pool evaluates on the calling thread only. A pool runs
+ * one batch at a time; concurrent callers are queued. */
+ExprThreadPool *exprlib_pool_create(int threads);
+void exprlib_pool_destroy(ExprThreadPool *pool);
+bool exprlib_run_batch_parallel(const ExprCompiled *program,
+                                const ExprContext *context,
+                                const double *const *columns, size_t n,
+                                double *out, ExprThreadPool *pool);
+bool exprlib_evaluate_batch_parallel(const ExprNode *expr,
+                                     const ExprContext *context,
+                                     const double *const *columns, size_t n,
+                                     double *out, ExprThreadPool *pool);
+
+/* Flat trees: a compact, read-only copy of a tree in one allocation, with
+ * nodes in an array addressed by index and every name stored once. Meant for
+ * holding many formulas resident: a flat tree is a fraction of the size of
+ * its ExprNode tree and is evaluated in one linear pass, with the same
+ * results and errors as exprlib_evaluate. exprlib_flat_parse parses straight
+ * into one, without keeping the ExprNode tree. exprlib_flat_expand builds an
+ * ordinary heap tree again, e.g. to optimize or compile it. */
+ExprFlat *exprlib_flat_create(const ExprNode *expr);
+ExprFlat *exprlib_flat_parse(const string expression,
+                             const ExprContext *context,
+                             ExprLibDiagnostic *diag);
+double exprlib_flat_evaluate(const ExprFlat *flat, const ExprContext *context);
+ExprNode *exprlib_flat_expand(const ExprFlat *flat);
+size_t exprlib_flat_size(const ExprFlat *flat); /* bytes */
+void exprlib_flat_free(ExprFlat *flat);
+void print_flat_expr(const ExprFlat *flat);
+
+/* Multi-output programs: compile count trees against one context into a
+ * single program. Subexpressions shared by any of the trees are computed once
+ * per evaluation, as within one compiled tree. exprlib_program_run writes
+ * output i to out[i]; exprlib_program_run_batch writes n rows of output i to
+ * outs[i], reading columns as exprlib_run_batch does, and
+ * exprlib_program_run_batch_parallel does the same on a pool. They stop at
+ * the first error and return false, with the outputs partly written. */
+ExprProgram *exprlib_program_compile(const ExprNode *const *exprs, int count,
+                                     const ExprContext *context,
+                                     unsigned flags);
+int exprlib_program_outputs(const ExprProgram *program);
+bool exprlib_program_run(const ExprProgram *program,
+                         const ExprContext *context, double *out);
+bool exprlib_program_run_batch(const ExprProgram *program,
+                               const ExprContext *context,
+                               const double *const *columns, size_t n,
+                               double *const *outs);
+bool exprlib_program_run_batch_parallel(const ExprProgram *program,
+                                        const ExprContext *context,
+                                        const double *const *columns,
+                                        size_t n, double *const *outs,
+                                        ExprThreadPool *pool);
+void exprlib_program_free(ExprProgram *program);
+
+/* Profiling, for a library built with EXPRLIB_PROFILE (otherwise
+ * exprlib_profile_create fails and nothing is recorded). While a profile is
+ * attached to a thread, exprlib_evaluate on that thread counts the visits of
+ * every node and the time each takes, children included, and the bytecode VM
+ * (exprlib_run, exprlib_program_run) counts every instruction it runs. Both
+ * count the calls of every function and the time spent in them. The VM
+ * counts the calls the program makes: a shared common subexpression is
+ * called once, and a call compiled to arithmetic (pow(x, 2), min(x)) not at
+ * all. Batch, flat, live and JIT evaluation are not profiled. Counters are
+ * keyed by address, so read them while the trees and programs are still
+ * alive. A profile must not be attached to two threads at once. Functions
+ * are reported in no particular order; exprlib_profile_functions returns how
+ * many there are and fills at most max of them. */
+typedef struct {
+    unsigned long long count;
+    unsigned long long ns; /* always 0 for instructions */
+} ExprProfileCounter;
+
+typedef struct {
+    const char *name; /* NULL if no longer registered */
+    unsigned long long calls;
+    unsigned long long ns;
+} ExprProfileFunction;
+
+ExprProfile *exprlib_profile_create(void);
+void exprlib_profile_reset(ExprProfile *profile);
+void exprlib_profile_free(ExprProfile *profile);
+/* attaches to the calling thread (NULL detaches), returns the previous one */
+ExprProfile *exprlib_profile_attach(ExprProfile *profile);
+ExprProfileCounter exprlib_profile_node(const ExprProfile *profile,
+                                        const ExprNode *node);
+ExprProfileCounter exprlib_profile_instruction(const ExprProfile *profile,
+                                               const ExprCompiled *program,
+                                               int index);
+size_t exprlib_profile_functions(const ExprProfile *profile,
+                                 ExprProfileFunction *out, size_t max);
+/* print_expr_tree and print_compiled_expr, annotated with the counters */
+void print_expr_profile(const ExprNode *node, const ExprProfile *profile,
+                        int indent);
+void print_compiled_profile(const ExprCompiled *program,
+                            const ExprProfile *profile);
+
+/* Parse cache: a bounded LRU map from (expression, names of the context's
+ * variables in order) to a compiled program, safe to share between threads.
+ * exprlib_cache_get returns a new reference to the cached program, parsing
+ * and compiling it on a miss; release it with exprlib_free_compiled. Entries
+ * built before a function or constant was registered are recompiled. Failed
+ * parses are not cached. A capacity of 0 selects the default. */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t entries;
+} ExprCacheStats;
+
+ExprCache *exprlib_cache_create(size_t capacity);
+void exprlib_cache_destroy(ExprCache *cache);
+ExprCompiled *exprlib_cache_get(ExprCache *cache, const char *expression,
+                                const ExprContext *context);
+void exprlib_cache_stats(ExprCache *cache, ExprCacheStats *stats);
+
+/* Live expressions: incremental re-evaluation. exprlib_live_create flattens
+ * the tree and caches the value of every node; the tree may be freed
+ * afterwards, the context must stay valid. After changing some variables,
+ * mark each one dirty by its index in the context; the next
+ * exprlib_live_evaluate recomputes only the nodes between those variables and
+ * the root, plus calls to functions not marked EXPRLIB_FN_PURE. The first
+ * evaluation computes everything. A live expression is not thread-safe. */
+ExprLive *exprlib_live_create(const ExprNode *expr, const ExprContext *context);
+bool exprlib_live_mark_dirty(ExprLive *live, int var_index);
+double exprlib_live_evaluate(ExprLive *live);
+void exprlib_live_free(ExprLive *live);
+
+/* Serialization. exprlib_save appends a program to out as a versioned,
+ * position-independent blob; files of many blobs are plain concatenations.
+ * Functions are stored by name and must be registered (with the same arity)
+ * when loading. exprlib_load validates the blob at data (8-byte aligned) and
+ * returns a program that reads its code and constants in place, so data must
+ * outlive it; *used receives the blob's size. exprlib_bundle_open maps a whole
+ * file read-only and loads every blob in it; the programs belong to the
+ * bundle and stay valid until exprlib_bundle_close. */
+bool exprlib_save(const ExprCompiled *program, FILE *out);
+ExprCompiled *exprlib_load(const void *data, size_t size, size_t *used);
+ExprBundle *exprlib_bundle_open(const char *path);
+size_t exprlib_bundle_count(const ExprBundle *bundle);
+const ExprCompiled *exprlib_bundle_get(const ExprBundle *bundle, size_t index);
+void exprlib_bundle_close(ExprBundle *bundle);
+
+/* Native code. exprlib_jit_compile translates a compiled program into machine
+ * code for the host (x86-64 Linux for now). The function takes the variable
+ * values in context order: vars[i] stands for *context->variables[i].value of
+ * the context the program was compiled against. It fails like exprlib_run:
+ * EXPRLIB_ERROR is set and 0.0 returned. Programs that contain a division or
+ * a function call reset EXPRLIB_ERROR on entry; others cannot fail and leave
+ * it alone. Where no native code can be generated, exprlib_jit_function
+ * returns NULL and exprlib_jit_run runs the program on the interpreter. The
+ * program must outlive the ExprJit. */
+typedef double (*ExprJitFn)(const double *vars);
+ExprJit *exprlib_jit_compile(const ExprCompiled *program);
+ExprJitFn exprlib_jit_function(const ExprJit *jit);
+double exprlib_jit_run(const ExprJit *jit, const double *vars);
+void exprlib_jit_free(ExprJit *jit);
+
 #ifdef __cplusplus
 }
 #endif
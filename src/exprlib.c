@@ -6,148 +6,835 @@
 
 #include "exprlib.h"
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-ExprLibError EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+EXPRLIB_THREAD_LOCAL ExprLibError EXPRLIB_ERROR = EXPRLIB_SUCCESS;
 
 typedef struct {
-    string name;
+    string name; /* interned */
+    ExprSymbol symbol;
     int arity; // -1 = variadic
     ExprLibFnPtr fn;
+    ExprLibVecFnPtr vec_fn; /* optional kernel for batch evaluation */
+    unsigned flags;         /* EXPRLIB_FN_* */
 } ExprLibFunction;
 
-static ExprLibFunction *g_functions = NULL;
-static int g_function_count = 0;
+/* Symbols
+ *
+ * Names are interned in a global hash table of immutable entries, each
+ * holding the string and its ExprSymbol. Symbols are handed out densely from
+ * 1, and g_symbol_chunks maps them back to entries: chunk k holds the next
+ * 2^(k + EXPRLIB_SYMBOL_CHUNK_BITS) of them, so chunks never move once
+ * allocated. Entries are carved out of large blocks and never freed.
+ *
+ * Lookups don't lock. The table is published through an atomic pointer and
+ * its slots are filled with release stores, so a reader sees either nothing
+ * or a complete entry. Insertions take g_symbol_lock and look again before
+ * adding. Growing publishes a copy twice the size; the old table stays
+ * allocated for readers still probing it, which at most doubles the memory
+ * of the current one. A reader that misses a name inserted meanwhile just
+ * goes on to the locked path. The parser only interns names it has
+ * resolved, so bad input doesn't grow the table.
+ */
 
-static ExprLibConstant *g_constants = NULL;
-static int g_constant_count = 0;
+#define EXPRLIB_SYMBOL_CHUNK_BITS 8
+#define EXPRLIB_SYMBOL_CHUNKS 25 /* enough for every 32-bit symbol */
+#define EXPRLIB_SYMBOL_BLOCK 16384
 
-bool exprlib_register_constant(const char *name, double value) {
-    g_constants =
-        realloc(g_constants, (g_constant_count + 1) * sizeof(ExprLibConstant));
-    if (!g_constants) {
+typedef struct {
+    uint32_t hash;
+    ExprSymbol symbol;
+    size_t len;
+    char name[];
+} ExprSymbolEntry;
+
+typedef _Atomic(ExprSymbolEntry *) ExprSymbolSlot;
+
+typedef struct ExprSymbolTable {
+    struct ExprSymbolTable *retired; /* the table this one replaced */
+    size_t mask;
+    ExprSymbolSlot slots[];
+} ExprSymbolTable;
+
+static _Atomic(ExprSymbolTable *) g_symbols;
+static _Atomic(ExprSymbolSlot *) g_symbol_chunks[EXPRLIB_SYMBOL_CHUNKS];
+static pthread_mutex_t g_symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guarded by g_symbol_lock */
+static uint32_t g_symbol_count;
+static char *g_symbol_block;
+static size_t g_symbol_block_left;
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Spreads dense symbols over a power-of-two table. */
+static size_t symbol_hash(ExprSymbol symbol) {
+    return (size_t)(symbol * 2654435761u);
+}
+
+/* The entry for name in t, or NULL with *slot at the empty slot for it. */
+static ExprSymbolEntry *symbol_probe(ExprSymbolTable *t, const char *name,
+                                     size_t len, uint32_t hash, size_t *slot) {
+    size_t i = hash & t->mask;
+    for (;; i = (i + 1) & t->mask) {
+        ExprSymbolEntry *e =
+            atomic_load_explicit(&t->slots[i], memory_order_acquire);
+        if (!e)
+            break;
+        if (e->hash == hash && e->len == len &&
+            memcmp(e->name, name, len) == 0)
+            return e;
+    }
+    if (slot)
+        *slot = i;
+    return NULL;
+}
+
+/* Looks name up without interning it. */
+static ExprSymbol symbol_find(const char *name, size_t len) {
+    ExprSymbolTable *t = atomic_load_explicit(&g_symbols, memory_order_acquire);
+    if (!t)
+        return EXPR_SYMBOL_NONE;
+    ExprSymbolEntry *e = symbol_probe(t, name, len, hash_name(name, len), NULL);
+    return e ? e->symbol : EXPR_SYMBOL_NONE;
+}
+
+static ExprSymbolSlot *symbol_chunk(ExprSymbol symbol, size_t *offset,
+                                    int *chunk) {
+    size_t i = (size_t)symbol - 1 + ((size_t)1 << EXPRLIB_SYMBOL_CHUNK_BITS);
+    int bit = 63 - __builtin_clzll((unsigned long long)i);
+    *chunk = bit - EXPRLIB_SYMBOL_CHUNK_BITS;
+    *offset = i - ((size_t)1 << bit);
+    return atomic_load_explicit(&g_symbol_chunks[*chunk],
+                                memory_order_acquire);
+}
+
+static const char *symbol_name(ExprSymbol symbol) {
+    if (symbol == EXPR_SYMBOL_NONE)
+        return NULL;
+    size_t offset;
+    int chunk;
+    ExprSymbolSlot *entries = symbol_chunk(symbol, &offset, &chunk);
+    ExprSymbolEntry *e =
+        entries ? atomic_load_explicit(&entries[offset], memory_order_acquire)
+                : NULL;
+    return e ? e->name : NULL;
+}
+
+/* Called with g_symbol_lock held. */
+static void *symbol_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (size > g_symbol_block_left) {
+        if (size > EXPRLIB_SYMBOL_BLOCK / 4)
+            return malloc(size);
+        char *block = malloc(EXPRLIB_SYMBOL_BLOCK);
+        if (!block)
+            return NULL;
+        g_symbol_block = block;
+        g_symbol_block_left = EXPRLIB_SYMBOL_BLOCK;
+    }
+    void *p = g_symbol_block;
+    g_symbol_block += size;
+    g_symbol_block_left -= size;
+    return p;
+}
+
+/* Called with g_symbol_lock held. */
+static ExprSymbolTable *symbol_table_grow(ExprSymbolTable *old) {
+    size_t capacity = old ? (old->mask + 1) * 2 : 256;
+    ExprSymbolTable *t =
+        calloc(1, sizeof(*t) + sizeof(t->slots[0]) * capacity);
+    if (!t)
+        return NULL;
+    t->retired = old;
+    t->mask = capacity - 1;
+    for (size_t i = 0; old && i <= old->mask; ++i) {
+        ExprSymbolEntry *e =
+            atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+        if (!e)
+            continue;
+        size_t j = e->hash & t->mask;
+        while (atomic_load_explicit(&t->slots[j], memory_order_relaxed))
+            j = (j + 1) & t->mask;
+        atomic_store_explicit(&t->slots[j], e, memory_order_relaxed);
+    }
+    atomic_store_explicit(&g_symbols, t, memory_order_release);
+    return t;
+}
+
+/* Returns name's symbol, adding it if needed; EXPR_SYMBOL_NONE on failure. */
+static ExprSymbol symbol_intern(const char *name, size_t len) {
+    ExprSymbol symbol = symbol_find(name, len);
+    if (symbol != EXPR_SYMBOL_NONE)
+        return symbol;
+
+    pthread_mutex_lock(&g_symbol_lock);
+    uint32_t hash = hash_name(name, len);
+    ExprSymbolTable *t = atomic_load_explicit(&g_symbols, memory_order_relaxed);
+    size_t slot = 0;
+    ExprSymbolEntry *e = t ? symbol_probe(t, name, len, hash, &slot) : NULL;
+    if (e) {
+        symbol = e->symbol;
+        goto out;
+    }
+    if (g_symbol_count == UINT32_MAX - 1) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        goto out;
+    }
+    if (!t || ((size_t)g_symbol_count + 1) * 2 > t->mask + 1) {
+        t = symbol_table_grow(t);
+        if (!t) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            goto out;
+        }
+        symbol_probe(t, name, len, hash, &slot);
+    }
+
+    ExprSymbol next = g_symbol_count + 1;
+    size_t offset;
+    int chunk;
+    ExprSymbolSlot *entries = symbol_chunk(next, &offset, &chunk);
+    if (!entries) {
+        size_t count = (size_t)1 << (chunk + EXPRLIB_SYMBOL_CHUNK_BITS);
+        entries = calloc(count, sizeof(*entries));
+        if (!entries) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            goto out;
+        }
+        atomic_store_explicit(&g_symbol_chunks[chunk], entries,
+                              memory_order_release);
+    }
+    e = symbol_alloc(sizeof(*e) + len + 1);
+    if (!e) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        goto out;
+    }
+    e->hash = hash;
+    e->symbol = next;
+    e->len = len;
+    memcpy(e->name, name, len);
+    e->name[len] = '\0';
+    atomic_store_explicit(&entries[offset], e, memory_order_release);
+    atomic_store_explicit(&t->slots[slot], e, memory_order_release);
+    g_symbol_count = next;
+    symbol = next;
+
+out:
+    pthread_mutex_unlock(&g_symbol_lock);
+    return symbol;
+}
+
+ExprSymbol exprlib_intern(const char *name) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!name) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return EXPR_SYMBOL_NONE;
+    }
+    return symbol_intern(name, strlen(name));
+}
+
+const char *exprlib_symbol_name(ExprSymbol symbol) {
+    return symbol_name(symbol);
+}
+
+/* Function and constant registry
+ *
+ * Both tables use open addressing with linear probing over a power-of-two
+ * number of slots, keyed by the symbol of the name, so a lookup compares
+ * integers only. A NULL name marks an empty slot; entries are never removed
+ * individually, only the whole table is cleared, so no tombstones are needed.
+ * The load factor is kept at or below 1/2.
+ *
+ * Readers never lock. The tables live in an immutable ExprLibRegistry
+ * snapshot published through an atomic pointer. Every change is made under
+ * g_registry_lock on a private copy of the affected table, then the copy is
+ * swapped in. The unchanged table is shared with the previous snapshot, and
+ * the names belong to the symbol table rather than to any snapshot.
+ *
+ * Reclamation is a two-counter grace period. A reader counts itself in
+ * g_registry_readers[epoch & 1] for the duration of a lookup or parse. After
+ * swapping snapshots, the writer bumps the epoch and waits for the previous
+ * epoch's counter to drain before freeing the old snapshot.
+ */
+
+#define EXPRLIB_TABLE_MIN_CAPACITY 64
+
+typedef struct {
+    ExprLibFunction *slots;
+    size_t capacity;
+    size_t count;
+} ExprLibFunctionTable;
+
+typedef struct {
+    ExprLibConstant *slots;
+    size_t capacity;
+    size_t count;
+} ExprLibConstantTable;
+
+typedef struct {
+    ExprLibFunctionTable functions;
+    ExprLibConstantTable constants;
+} ExprLibRegistry;
+
+/* readers see this until the first exprlib_init() */
+static ExprLibRegistry g_empty_registry;
+
+static _Atomic(ExprLibRegistry *) g_registry = &g_empty_registry;
+static atomic_ulong g_registry_epoch;
+static atomic_ulong g_registry_version; /* bumped by every publish */
+static atomic_ulong g_registry_readers[2];
+static pthread_mutex_t g_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const ExprLibRegistry *registry_read_begin(unsigned long *epoch) {
+    for (;;) {
+        unsigned long e = atomic_load(&g_registry_epoch);
+        atomic_fetch_add(&g_registry_readers[e & 1], 1);
+        /* a writer that flipped the epoch meanwhile may not wait for us */
+        if (atomic_load(&g_registry_epoch) == e) {
+            *epoch = e;
+            return atomic_load(&g_registry);
+        }
+        atomic_fetch_sub(&g_registry_readers[e & 1], 1);
+    }
+}
+
+static void registry_read_end(unsigned long epoch) {
+    atomic_fetch_sub_explicit(&g_registry_readers[epoch & 1], 1,
+                              memory_order_release);
+}
+
+/* Swap in next and free whatever of the old snapshot it doesn't share.
+ * Called with g_registry_lock held. */
+static void registry_publish(ExprLibRegistry *next) {
+    ExprLibRegistry *old = atomic_exchange(&g_registry, next);
+    atomic_fetch_add(&g_registry_version, 1);
+
+    unsigned long e = atomic_fetch_add(&g_registry_epoch, 1);
+    while (atomic_load(&g_registry_readers[e & 1]) != 0)
+        sched_yield();
+
+    if (old->functions.slots != next->functions.slots)
+        free(old->functions.slots);
+    if (old->constants.slots != next->constants.slots)
+        free(old->constants.slots);
+    if (old != &g_empty_registry)
+        free(old);
+}
+
+static size_t table_capacity_for(size_t count) {
+    size_t cap = EXPRLIB_TABLE_MIN_CAPACITY;
+    while (cap < count * 2)
+        cap *= 2;
+    return cap;
+}
+
+static ExprLibFunction *function_slot(ExprLibFunction *slots, size_t capacity,
+                                      ExprSymbol symbol) {
+    size_t mask = capacity - 1;
+    size_t i = symbol_hash(symbol) & mask;
+    while (slots[i].name && slots[i].symbol != symbol)
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
+static ExprLibConstant *constant_slot(ExprLibConstant *slots, size_t capacity,
+                                      ExprSymbol symbol) {
+    size_t mask = capacity - 1;
+    size_t i = symbol_hash(symbol) & mask;
+    while (slots[i].name && slots[i].symbol != symbol)
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
+/* Rehash src into a fresh table dst with room for count entries. */
+static bool function_table_copy(ExprLibFunctionTable *dst,
+                                const ExprLibFunctionTable *src,
+                                size_t count) {
+    size_t capacity = table_capacity_for(count);
+    ExprLibFunction *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    for (size_t i = 0; i < src->capacity; ++i) {
+        if (src->slots[i].name)
+            *function_slot(slots, capacity, src->slots[i].symbol) =
+                src->slots[i];
+    }
+    dst->slots = slots;
+    dst->capacity = capacity;
+    dst->count = src->count;
+    return true;
+}
+
+static bool constant_table_copy(ExprLibConstantTable *dst,
+                                const ExprLibConstantTable *src,
+                                size_t count) {
+    size_t capacity = table_capacity_for(count);
+    ExprLibConstant *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    for (size_t i = 0; i < src->capacity; ++i) {
+        if (src->slots[i].name)
+            *constant_slot(slots, capacity, src->slots[i].symbol) =
+                src->slots[i];
+    }
+    dst->slots = slots;
+    dst->capacity = capacity;
+    dst->count = src->count;
+    return true;
+}
+
+/* Grow a table that no reader can see yet. */
+static bool function_table_reserve(ExprLibFunctionTable *t, size_t count) {
+    if (count * 2 <= t->capacity)
+        return true;
+    ExprLibFunctionTable grown;
+    if (!function_table_copy(&grown, t, count))
+        return false;
+    free(t->slots);
+    *t = grown;
+    return true;
+}
+
+static bool constant_table_reserve(ExprLibConstantTable *t, size_t count) {
+    if (count * 2 <= t->capacity)
+        return true;
+    ExprLibConstantTable grown;
+    if (!constant_table_copy(&grown, t, count))
+        return false;
+    free(t->slots);
+    *t = grown;
+    return true;
+}
+
+static const ExprLibFunction *lookup_function(const ExprLibRegistry *r,
+                                              ExprSymbol symbol) {
+    if (!r->functions.count || symbol == EXPR_SYMBOL_NONE)
+        return NULL;
+    const ExprLibFunction *slot =
+        function_slot(r->functions.slots, r->functions.capacity, symbol);
+    return slot->name ? slot : NULL;
+}
+
+static const ExprLibConstant *lookup_constant(const ExprLibRegistry *r,
+                                              ExprSymbol symbol) {
+    if (!r->constants.count || symbol == EXPR_SYMBOL_NONE)
+        return NULL;
+    const ExprLibConstant *slot =
+        constant_slot(r->constants.slots, r->constants.capacity, symbol);
+    return slot->name ? slot : NULL;
+}
+
+/* Insert into a registry that is not published yet. */
+static bool registry_add_function(ExprLibRegistry *r, const char *name,
+                                  int arity, ExprLibFnPtr scalar_fn,
+                                  ExprLibVecFnPtr vector_fn, unsigned flags) {
+    if (!name || !*name || !scalar_fn) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+
+    if (arity < -1) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+
+    ExprSymbol symbol = symbol_intern(name, strlen(name));
+    if (symbol == EXPR_SYMBOL_NONE)
+        return false;
+
+    /* reject duplicates */
+    if (lookup_function(r, symbol)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_DUPLICATE_FUNCTION;
+        return false;
+    }
+
+    /* grow registry */
+    if (!function_table_reserve(&r->functions, r->functions.count + 1))
+        return false;
+
+    ExprLibFunction *slot =
+        function_slot(r->functions.slots, r->functions.capacity, symbol);
+    slot->name = (string)symbol_name(symbol);
+    slot->symbol = symbol;
+    slot->arity = arity;
+    slot->fn = scalar_fn;
+    slot->vec_fn = vector_fn;
+    slot->flags = flags & EXPRLIB_FN_MEMOIZE ? flags | EXPRLIB_FN_PURE : flags;
+    r->functions.count++;
+
+    return true;
+}
+
+/* Registering an existing constant name updates its value. */
+static bool registry_add_constant(ExprLibRegistry *r, const char *name,
+                                  double value) {
+    if (!name || !*name) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+
+    ExprSymbol symbol = symbol_intern(name, strlen(name));
+    if (symbol == EXPR_SYMBOL_NONE ||
+        !constant_table_reserve(&r->constants, r->constants.count + 1))
+        return false;
+
+    ExprLibConstant *slot =
+        constant_slot(r->constants.slots, r->constants.capacity, symbol);
+    if (!slot->name) {
+        slot->name = (string)symbol_name(symbol);
+        slot->symbol = symbol;
+        r->constants.count++;
+    }
+    slot->value = value;
+    return true;
+}
+
+bool exprlib_register_function_ex(const char *name, int arity,
+                                  ExprLibFnPtr scalar_fn,
+                                  ExprLibVecFnPtr vector_fn, unsigned flags) {
+    pthread_mutex_lock(&g_registry_lock);
+    const ExprLibRegistry *cur = atomic_load(&g_registry);
+
+    ExprLibRegistry *next = malloc(sizeof(*next));
+    if (!next) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        pthread_mutex_unlock(&g_registry_lock);
+        return false;
+    }
+    next->constants = cur->constants;
+    if (!function_table_copy(&next->functions, &cur->functions,
+                             cur->functions.count + 1)) {
+        free(next);
+        pthread_mutex_unlock(&g_registry_lock);
+        return false;
+    }
+
+    if (!registry_add_function(next, name, arity, scalar_fn, vector_fn,
+                               flags)) {
+        free(next->functions.slots);
+        free(next);
+        pthread_mutex_unlock(&g_registry_lock);
         return false;
     }
-    string name_copy = strdup(name);
-    if (!name_copy) {
+
+    registry_publish(next);
+    pthread_mutex_unlock(&g_registry_lock);
+    return true;
+}
+
+bool exprlib_register_vector_function(const char *name, int arity,
+                                      ExprLibFnPtr scalar_fn,
+                                      ExprLibVecFnPtr vector_fn) {
+    return exprlib_register_function_ex(name, arity, scalar_fn, vector_fn, 0);
+}
+
+bool exprlib_register_function(const char *name, int arity, ExprLibFnPtr fn) {
+    return exprlib_register_function_ex(name, arity, fn, NULL, 0);
+}
+
+bool exprlib_register_constant(const char *name, double value) {
+    pthread_mutex_lock(&g_registry_lock);
+    const ExprLibRegistry *cur = atomic_load(&g_registry);
+
+    ExprLibRegistry *next = malloc(sizeof(*next));
+    if (!next) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        pthread_mutex_unlock(&g_registry_lock);
+        return false;
+    }
+    next->functions = cur->functions;
+    if (!constant_table_copy(&next->constants, &cur->constants,
+                             cur->constants.count + 1)) {
+        free(next);
+        pthread_mutex_unlock(&g_registry_lock);
+        return false;
+    }
+
+    if (!registry_add_constant(next, name, value)) {
+        free(next->constants.slots);
+        free(next);
+        pthread_mutex_unlock(&g_registry_lock);
         return false;
     }
-    g_constants[g_constant_count].name = name_copy;
-    g_constants[g_constant_count].value = value;
-    g_constant_count++;
+
+    registry_publish(next);
+    pthread_mutex_unlock(&g_registry_lock);
     return true;
 }
 
+void exprlib_clear_functions(void) {
+    pthread_mutex_lock(&g_registry_lock);
+    const ExprLibRegistry *cur = atomic_load(&g_registry);
+
+    ExprLibRegistry *next = malloc(sizeof(*next));
+    if (!next) {
+        /* keep the current snapshot rather than leave readers without one */
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        pthread_mutex_unlock(&g_registry_lock);
+        return;
+    }
+    next->functions = (ExprLibFunctionTable){NULL, 0, 0};
+    next->constants = cur->constants;
+
+    registry_publish(next);
+    pthread_mutex_unlock(&g_registry_lock);
+}
+
+/* Memoized calls
+ *
+ * Functions registered with EXPRLIB_FN_MEMOIZE are called through memo_call.
+ * Each thread keeps a cache of EXPRLIB_MEMO_SLOTS results, keyed on the
+ * function and the bits of its arguments, so a hit costs a hash and a compare
+ * and no lock. The cache is two-way set associative with the most recent
+ * entry of a set first: a new entry pushes out the older one, which keeps the
+ * size fixed while two colliding keys can still alternate. Calls with more
+ * than EXPRLIB_MEMO_ARGS arguments, and calls that fail, are not cached. The
+ * cache is allocated on a thread's first memoized call and freed when the
+ * thread exits.
+ */
+
+#define EXPRLIB_MEMO_SLOTS 256 /* power of two */
+#define EXPRLIB_MEMO_ARGS 4
+
+typedef struct {
+    ExprLibFnPtr fn; /* NULL while empty */
+    int argc;
+    double args[EXPRLIB_MEMO_ARGS];
+    double value;
+} ExprMemoSlot;
+
+static EXPRLIB_THREAD_LOCAL ExprMemoSlot *g_memo;
+static pthread_key_t g_memo_key;
+static pthread_once_t g_memo_once = PTHREAD_ONCE_INIT;
+static bool g_memo_keyed;
+
+static uint64_t cse_mix(uint64_t h, uint64_t v);
+
+static void memo_key_create(void) {
+    g_memo_keyed = pthread_key_create(&g_memo_key, free) == 0;
+}
+
+static ExprMemoSlot *memo_table(void) {
+    if (g_memo)
+        return g_memo;
+    pthread_once(&g_memo_once, memo_key_create);
+    if (!g_memo_keyed)
+        return NULL;
+    g_memo = calloc(EXPRLIB_MEMO_SLOTS, sizeof(*g_memo));
+    if (g_memo && pthread_setspecific(g_memo_key, g_memo) != 0) {
+        free(g_memo);
+        g_memo = NULL;
+    }
+    return g_memo;
+}
+
+/* fn(args, argc) through the calling thread's cache; without one (out of
+ * memory, too many arguments) it is simply called. */
+static double memo_call(const double *args, int argc, ExprLibFnPtr fn) {
+    ExprMemoSlot *table = argc <= EXPRLIB_MEMO_ARGS ? memo_table() : NULL;
+    if (!table)
+        return fn(args, argc);
+
+    uint64_t h = cse_mix(0, (uint64_t)(uintptr_t)fn);
+    for (int i = 0; i < argc; ++i) {
+        uint64_t bits;
+        memcpy(&bits, &args[i], sizeof(bits));
+        h = cse_mix(h, bits);
+    }
+    /* small integers differ only in the top bits of a double, which
+     * cse_mix barely spreads: finish with a murmur-style avalanche */
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    ExprMemoSlot *set = &table[h & (EXPRLIB_MEMO_SLOTS - 2)];
+    size_t size = sizeof(double) * (size_t)argc;
+    for (int way = 0; way < 2; ++way) {
+        ExprMemoSlot *slot = &set[way];
+        if (slot->fn == fn && slot->argc == argc &&
+            memcmp(slot->args, args, size) == 0) {
+            double value = slot->value;
+            if (way) {
+                ExprMemoSlot hit = set[1];
+                set[1] = set[0];
+                set[0] = hit;
+            }
+            return value;
+        }
+    }
+
+    double value = fn(args, argc);
+    if (EXPRLIB_ERROR == EXPRLIB_SUCCESS) {
+        set[1] = set[0];
+        set[0].fn = fn;
+        set[0].argc = argc;
+        memcpy(set[0].args, args, size);
+        set[0].value = value;
+    }
+    return value;
+}
+
+/* A call of a bound function, memoized if it was registered so. */
+static inline double call_function(ExprLibFnPtr fn, unsigned flags,
+                                   const double *args, int argc) {
+    return flags & EXPRLIB_FN_MEMOIZE ? memo_call(args, argc, fn)
+                                      : fn(args, argc);
+}
+
 /* Trigonometric */
 static double fn_sin(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return sin(a[0]);
 }
 static double fn_cos(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return cos(a[0]);
 }
 static double fn_tan(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return tan(a[0]);
 }
 static double fn_cot(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return 1.0 / tan(a[0]);
 }
 static double fn_sec(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return 1.0 / cos(a[0]);
 }
 static double fn_cosec(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return 1.0 / sin(a[0]);
 }
 
 /* Inverse trigonometric */
 static double fn_asin(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return asin(a[0]);
 }
 static double fn_acos(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return acos(a[0]);
 }
 static double fn_atan(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return atan(a[0]);
 }
 
 /* Powers and roots */
 static double fn_pow(const double *a, int n) {
     assert(n == 2);
+    (void)n;
     return pow(a[0], a[1]);
 }
 static double fn_sqrt(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return sqrt(a[0]);
 }
 static double fn_cbrt(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return cbrt(a[0]);
 }
 
 /* Logarithms */
 static double fn_log(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return log(a[0]);
 } /* natural log */
 static double fn_log10(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return log10(a[0]);
 }
 
 /* Exponential */
 static double fn_exp(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return exp(a[0]);
 }
 
 /* Absolute & sign */
 static double fn_abs(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return fabs(a[0]);
 }
 
 /* Rounding */
 static double fn_floor(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return floor(a[0]);
 }
 static double fn_ceil(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return ceil(a[0]);
 }
 static double fn_round(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return round(a[0]);
 }
 
 // Conversion
 static double fn_deg2rad(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return a[0] * (M_PI / 180.0);
 }
 static double fn_rad2deg(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     return a[0] * (180.0 / M_PI);
 }
 
 // Min, Max
 static double fn_min(const double *a, int n) {
-    assert(n >= 1);
+    if (n < 1) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return 0.0;
+    }
     double min_val = a[0];
     for (int i = 1; i < n; ++i) {
         if (a[i] < min_val) {
@@ -157,7 +844,10 @@ static double fn_min(const double *a, int n) {
     return min_val;
 }
 static double fn_max(const double *a, int n) {
-    assert(n >= 1);
+    if (n < 1) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return 0.0;
+    }
     double max_val = a[0];
     for (int i = 1; i < n; ++i) {
         if (a[i] > max_val) {
@@ -167,166 +857,506 @@ static double fn_max(const double *a, int n) {
     return max_val;
 }
 
+/* Factorials, nCr and nPr
+ *
+ * n! overflows a double past 170, so every finite factorial is in a table,
+ * filled once by exprlib_init with a running product, so entries are exactly
+ * what a multiply loop gives. Arguments are truncated to integers.
+ */
+
+#define EXPRLIB_FACTORIAL_MAX 170
+
+static double g_factorials[EXPRLIB_FACTORIAL_MAX + 1];
+static pthread_once_t g_factorials_once = PTHREAD_ONCE_INIT;
+
+static void factorials_fill(void) {
+    g_factorials[0] = 1.0;
+    for (int i = 1; i <= EXPRLIB_FACTORIAL_MAX; ++i)
+        g_factorials[i] = g_factorials[i - 1] * i;
+}
+
+/* x! for x >= 0 */
+static double factorial_of(double x) {
+    if (x < EXPRLIB_FACTORIAL_MAX + 1)
+        return g_factorials[(int)x];
+    return isnan(x) ? x : INFINITY;
+}
+
 static double factorial(const double *a, int n) {
     assert(n == 1);
+    (void)n;
     if (a[0] < 0) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
         return 0.0;
     }
-    double result = 1.0;
-    for (int i = 1; i <= (int)a[0]; i++) {
-        result *= i;
-    }
-    return result;
+    return factorial_of(a[0]);
 }
 
-// nCr and nPr
 static double nCr(const double *a, int n) {
     assert(n == 2);
+    (void)n;
     if (a[0] < 0 || a[1] < 0 || a[1] > a[0]) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
         return 0.0;
     }
-    return factorial((double[]){a[0]}, 1) /
-           (factorial((double[]){a[1]}, 1) *
-            factorial((double[]){a[0] - a[1]}, 1));
+    return factorial_of(a[0]) /
+           (factorial_of(a[1]) * factorial_of(a[0] - a[1]));
 }
 
 static double nPr(const double *a, int n) {
     assert(n == 2);
+    (void)n;
     if (a[0] < 0 || a[1] < 0 || a[1] > a[0]) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
         return 0.0;
     }
-    return factorial((double[]){a[0]}, 1) /
-           factorial((double[]){a[0] - a[1]}, 1);
+    return factorial_of(a[0]) / factorial_of(a[0] - a[1]);
 }
 
-static void exprlib_register_builtins(void) {
-    /* Trigonometric */
-    exprlib_register_function("sin", 1, fn_sin);
-    exprlib_register_function("cos", 1, fn_cos);
-    exprlib_register_function("tan", 1, fn_tan);
-    exprlib_register_function("cot", 1, fn_cot);
-    exprlib_register_function("sec", 1, fn_sec);
-    exprlib_register_function("cosec", 1, fn_cosec);
-
-    /* Inverse trigonometric */
-    exprlib_register_function("asin", 1, fn_asin);
-    exprlib_register_function("acos", 1, fn_acos);
-    exprlib_register_function("atan", 1, fn_atan);
+/* SIMD kernels for batch evaluation
+ *
+ * The kernels are written once with GCC vector extensions over 8 doubles.
+ * On x86-64 Linux each kernel is built as AVX-512, AVX2 and baseline SSE2
+ * clones and the best one is picked at load time (target_clones/ifunc); on
+ * AArch64 the same code lowers to NEON. Lanes outside a kernel's fast range
+ * (NaN, infinities, huge or denormal arguments) are handed to libm, so the
+ * results match the scalar built-ins to within a couple of ulps.
+ * Build with -DEXPRLIB_NO_SIMD to use plain libm loops instead.
+ */
 
-    /* Powers and roots */
-    exprlib_register_function("pow", 2, fn_pow);
-    exprlib_register_function("sqrt", 1, fn_sqrt);
-    exprlib_register_function("cbrt", 1, fn_cbrt);
+#if defined(__GNUC__) && !defined(EXPRLIB_NO_SIMD)
+#define EXPRLIB_SIMD 1
+#else
+#define EXPRLIB_SIMD 0
+#endif
 
-    /* Logarithms */
-    exprlib_register_function("ln", 1, fn_log); /* ln */
-    exprlib_register_function("log10", 1, fn_log10);
+/* ifunc resolvers run before ThreadSanitizer is initialised and crash it */
+#if defined(__SANITIZE_THREAD__)
+#define EXPRLIB_NO_TARGET_CLONES
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define EXPRLIB_NO_TARGET_CLONES
+#endif
+#endif
 
-    /* Exponential */
-    exprlib_register_function("exp", 1, fn_exp);
+#if EXPRLIB_SIMD && defined(__x86_64__) && defined(__linux__) &&               \
+    defined(__has_attribute) && !defined(EXPRLIB_NO_TARGET_CLONES)
+#if __has_attribute(target_clones)
+#define EXPRLIB_TARGET_CLONES                                                  \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef EXPRLIB_TARGET_CLONES
+#define EXPRLIB_TARGET_CLONES
+#endif
 
-    /* Absolute & rounding */
-    exprlib_register_function("abs", 1, fn_abs);
-    exprlib_register_function("floor", 1, fn_floor);
-    exprlib_register_function("ceil", 1, fn_ceil);
-    exprlib_register_function("round", 1, fn_round);
+#if EXPRLIB_SIMD
 
-    /* Conversion */
-    exprlib_register_function("deg2rad", 1, fn_deg2rad);
-    exprlib_register_function("rad2deg", 1, fn_rad2deg);
+#define EXPRLIB_VEC_LANES 8
+#define EXPRLIB_VEC_INLINE static inline __attribute__((always_inline))
 
-    /* Min, Max */
-    exprlib_register_function("min", -1, fn_min);
-    exprlib_register_function("max", -1, fn_max);
+typedef double ExprVecD
+    __attribute__((vector_size(EXPRLIB_VEC_LANES * sizeof(double))));
+typedef int64_t ExprVecI
+    __attribute__((vector_size(EXPRLIB_VEC_LANES * sizeof(int64_t))));
 
-    /* Factorial */
-    exprlib_register_function("factorial", 1, factorial);
+/* 1.5 * 2^52: adding it rounds a double to an integer held in the low bits
+ * of the mantissa; subtracting its bit pattern recovers that integer. */
+#define EXPRLIB_VEC_MAGIC 0x1.8p52
+#define EXPRLIB_VEC_MAGIC_BITS 0x4338000000000000LL
 
-    /* nCr and nPr */
-    exprlib_register_function("nCr", 2, nCr);
-    exprlib_register_function("nPr", 2, nPr);
+/* Vectors are passed by pointer so that no vector crosses a call boundary
+ * with a target-dependent ABI. */
+EXPRLIB_VEC_INLINE bool vec_any(const ExprVecI *mask) {
+    int64_t acc = 0;
+    for (int i = 0; i < EXPRLIB_VEC_LANES; ++i)
+        acc |= (*mask)[i];
+    return acc != 0;
+}
 
-    /* Constants */
-    exprlib_register_constant("pi", M_PI); /* π */
-    exprlib_register_constant("e", M_E);   /* Euler's number */
+/* lane-wise mask ? a : b on the bit patterns */
+#define VEC_SELECT(mask, a, b) (((mask) & (a)) | (~(mask) & (b)))
 
-    /* Common derived constants */
-    exprlib_register_constant("tau", 2.0 * M_PI); /* 2π */
-    exprlib_register_constant("phi",
-                              (1.0 + sqrt(5.0)) / 2.0); /* Golden ratio */
+EXPRLIB_VEC_INLINE void vec_exp(ExprVecD *out, const ExprVecD *in) {
+    ExprVecD x = *in;
+    ExprVecD t = x * 0x1.71547652b82fep+0 + EXPRLIB_VEC_MAGIC; /* x/ln2 */
+    ExprVecD k = t - EXPRLIB_VEC_MAGIC;
+    ExprVecI ki = (ExprVecI)t - EXPRLIB_VEC_MAGIC_BITS;
 
-    /* Square roots */
-    exprlib_register_constant("sqrt2", M_SQRT2);   /* √2 */
-    exprlib_register_constant("sqrt3", sqrt(3.0)); /* √3 */
-    exprlib_register_constant("sqrt5", sqrt(5.0)); /* √5 */
+    /* r = x - k*ln2, |r| <= ln2/2 */
+    ExprVecD r = x - k * 0x1.62e42feep-1;
+    r = r - k * 0x1.a39ef35793c76p-33;
 
-    /* Logarithmic constants */
-    exprlib_register_constant("ln2", M_LN2);       /* ln(2) */
-    exprlib_register_constant("ln10", M_LN10);     /* ln(10) */
-    exprlib_register_constant("log2e", M_LOG2E);   /* log2(e) */
-    exprlib_register_constant("log10e", M_LOG10E); /* log10(e) */
+    ExprVecD p = r * (1.0 / 6227020800.0) + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
 
-    /* Inverse pi multiples (used in physics/math derivations) */
-    exprlib_register_constant("invpi", 1.0 / M_PI);          /* 1/π */
-    exprlib_register_constant("inv2pi", 1.0 / (2.0 * M_PI)); /* 1/(2π) */
+    *out = p * (ExprVecD)((ki + 1023) << 52);
 }
 
-bool exprlib_register_function(const char *name, int arity, ExprLibFnPtr fn) {
-    if (!name || !*name || !fn) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
-        return false;
-    }
+EXPRLIB_VEC_INLINE void vec_log(ExprVecD *out, const ExprVecD *in) {
+    ExprVecI bits = (ExprVecI)*in;
+    ExprVecI e = (bits >> 52) - 1023;
+    ExprVecD m =
+        (ExprVecD)((bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
 
-    if (arity < -1) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
-        return false;
-    }
+    /* keep m in [sqrt(2)/2, sqrt(2)) */
+    ExprVecI big = m > 0x1.6a09e667f3bcdp+0;
+    m = (ExprVecD)((ExprVecI)m - (big & (1LL << 52)));
+    e = e - big;
 
-    /* reject duplicates */
-    for (int i = 0; i < g_function_count; ++i) {
-        if (strcmp(g_functions[i].name, name) == 0) {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_DUPLICATE_FUNCTION;
-            return false;
-        }
-    }
+    /* log(1+f) = f - s*(f - R), s = f/(2+f), R = 2s^2/3 + 2s^4/5 + ... */
+    ExprVecD f = m - 1.0;
+    ExprVecD s = f / (2.0 + f);
+    ExprVecD z = s * s;
+    ExprVecD R = z * (2.0 / 25.0) + 2.0 / 23.0;
+    R = R * z + 2.0 / 21.0;
+    R = R * z + 2.0 / 19.0;
+    R = R * z + 2.0 / 17.0;
+    R = R * z + 2.0 / 15.0;
+    R = R * z + 2.0 / 13.0;
+    R = R * z + 2.0 / 11.0;
+    R = R * z + 2.0 / 9.0;
+    R = R * z + 2.0 / 7.0;
+    R = R * z + 2.0 / 5.0;
+    R = R * z + 2.0 / 3.0;
+    R = R * z;
+    ExprVecD log_m = f - s * (f - R);
 
-    /* duplicate name */
-    char *name_copy = strdup(name);
-    if (!name_copy) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-        return false;
-    }
+    ExprVecD dk = (ExprVecD)(e + EXPRLIB_VEC_MAGIC_BITS) - EXPRLIB_VEC_MAGIC;
+    *out = dk * 0x1.62e42feep-1 + (log_m + dk * 0x1.a39ef35793c76p-33);
+}
 
-    /* grow registry */
-    ExprLibFunction *new_table =
-        realloc(g_functions, sizeof(ExprLibFunction) * (g_function_count + 1));
-    if (!new_table) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-        free(name_copy);
-        return false;
-    }
+/* sin(x + quadrant * pi/2) for |x| <= 1e5 */
+EXPRLIB_VEC_INLINE void vec_sin_quadrant(ExprVecD *out, const ExprVecD *in,
+                                         int64_t quadrant) {
+    ExprVecD x = *in;
+    ExprVecD t = x * 0x1.45f306dc9c883p-1 + EXPRLIB_VEC_MAGIC; /* x*2/pi */
+    ExprVecD k = t - EXPRLIB_VEC_MAGIC;
+    ExprVecI q = (ExprVecI)t - EXPRLIB_VEC_MAGIC_BITS;
+    q += quadrant;
 
-    g_functions = new_table;
+    /* Cody-Waite reduction with pi/2 split into three 33-bit parts, whose
+     * products with k are exact, and a double for the rest: near a multiple
+     * of pi/2, r keeps its low bits */
+    ExprVecD r = x - k * 0x1.921fb544p+0;
+    r = r - k * 0x1.0b4611a6p-34;
+    r = r - k * 0x1.3198a2ep-69;
+    r = r - k * 0x1.b839a252049c1p-104;
+    ExprVecD z = r * r;
 
-    g_functions[g_function_count].name = name_copy;
-    g_functions[g_function_count].arity = arity;
-    g_functions[g_function_count].fn = fn;
+    ExprVecD ps = z * (-1.0 / 121645100408832000.0) + 1.0 / 355687428096000.0;
+    ps = ps * z - 1.0 / 1307674368000.0;
+    ps = ps * z + 1.0 / 6227020800.0;
+    ps = ps * z - 1.0 / 39916800.0;
+    ps = ps * z + 1.0 / 362880.0;
+    ps = ps * z - 1.0 / 5040.0;
+    ps = ps * z + 1.0 / 120.0;
+    ps = ps * z - 1.0 / 6.0;
+    ExprVecD sin_r = r + r * z * ps;
+    /* r is x for x = +-0, but the sum above would turn -0 into +0 */
+    ExprVecI zero = r == 0.0;
+    sin_r = (ExprVecD)VEC_SELECT(zero, (ExprVecI)r, (ExprVecI)sin_r);
 
-    g_function_count++;
+    ExprVecD pc = z * (1.0 / 6402373705728000.0) - 1.0 / 20922789888000.0;
+    pc = pc * z + 1.0 / 87178291200.0;
+    pc = pc * z - 1.0 / 479001600.0;
+    pc = pc * z + 1.0 / 3628800.0;
+    pc = pc * z - 1.0 / 40320.0;
+    pc = pc * z + 1.0 / 720.0;
+    pc = pc * z - 1.0 / 24.0;
+    ExprVecD cos_r = (1.0 - 0.5 * z) + z * z * pc * -1.0;
 
-    return true;
+    ExprVecI use_cos = -(q & 1);
+    ExprVecI res = VEC_SELECT(use_cos, (ExprVecI)cos_r, (ExprVecI)sin_r);
+    *out = (ExprVecD)(res ^ ((q & 2) << 62));
 }
 
-const ExprLibFunction *find_function(const char *name) {
-    for (int i = 0; i < g_function_count; ++i) {
-        if (strcmp(g_functions[i].name, name) == 0)
-            return &g_functions[i];
-    }
-    return NULL;
-}
+/* |x| rounded to an integer by f(|x|) for |x| < 2^52, sign restored after */
+typedef enum { VEC_FLOOR, VEC_CEIL, VEC_ROUND } ExprVecRounding;
+
+EXPRLIB_VEC_INLINE void vec_round_mode(ExprVecD *out, const ExprVecD *in,
+                                       ExprVecRounding mode) {
+    const int64_t sign_bit = INT64_MIN;
+    const int64_t one = 0x3ff0000000000000LL; /* 1.0 */
+    ExprVecI bits = (ExprVecI)*in;
+    ExprVecI neg = (bits & sign_bit) != 0;
+    ExprVecD ax = (ExprVecD)(bits & ~sign_bit);
+
+    ExprVecD n = (ax + 0x1p52) - 0x1p52; /* nearest, ties to even */
+    ExprVecD fl = n - (ExprVecD)((n > ax) & one);
+    ExprVecD ce = n + (ExprVecD)((n < ax) & one);
+
+    ExprVecI res;
+    switch (mode) {
+    case VEC_FLOOR:
+        res = VEC_SELECT(neg, (ExprVecI)ce, (ExprVecI)fl);
+        break;
+    case VEC_CEIL:
+        res = VEC_SELECT(neg, (ExprVecI)fl, (ExprVecI)ce);
+        break;
+    default: /* half away from zero */
+        res = (ExprVecI)(fl + (ExprVecD)(((ax - fl) >= 0.5) & one));
+        break;
+    }
+
+    /* |x| >= 2^52 (or NaN) is already integral */
+    ExprVecI small = ax < 0x1p52;
+    ExprVecI mag = VEC_SELECT(small, res, bits & ~sign_bit);
+    *out = (ExprVecD)(mag | (bits & sign_bit));
+}
+
+EXPRLIB_VEC_INLINE void vec_load(ExprVecD *v, const double *p) {
+    memcpy(v, p, sizeof(*v));
+}
+
+EXPRLIB_VEC_INLINE void vec_store(double *p, const ExprVecD *v) {
+    memcpy(p, v, sizeof(*v));
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_exp(const double *const *args, int argc, size_t n,
+                    double *out) {
+    (void)argc;
+    const double *a = args[0];
+    size_t i = 0;
+    for (; i + EXPRLIB_VEC_LANES <= n; i += EXPRLIB_VEC_LANES) {
+        ExprVecD x, r;
+        vec_load(&x, a + i);
+        ExprVecI bad = ~((x >= -708.0) & (x <= 709.0));
+        if (vec_any(&bad)) {
+            for (int j = 0; j < EXPRLIB_VEC_LANES; ++j)
+                out[i + j] = exp(a[i + j]);
+            continue;
+        }
+        vec_exp(&r, &x);
+        vec_store(out + i, &r);
+    }
+    for (; i < n; ++i)
+        out[i] = exp(a[i]);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_log(const double *const *args, int argc, size_t n,
+                    double *out) {
+    (void)argc;
+    const double *a = args[0];
+    size_t i = 0;
+    for (; i + EXPRLIB_VEC_LANES <= n; i += EXPRLIB_VEC_LANES) {
+        ExprVecD x, r;
+        vec_load(&x, a + i);
+        ExprVecI bad = ~((x >= 0x1p-1022) & (x <= 0x1.fffffffffffffp+1023));
+        if (vec_any(&bad)) {
+            for (int j = 0; j < EXPRLIB_VEC_LANES; ++j)
+                out[i + j] = log(a[i + j]);
+            continue;
+        }
+        vec_log(&r, &x);
+        vec_store(out + i, &r);
+    }
+    for (; i < n; ++i)
+        out[i] = log(a[i]);
+}
+
+EXPRLIB_VEC_INLINE void vec_sincos_map(const double *a, size_t n, double *out,
+                                       int64_t quadrant,
+                                       double (*scalar)(double)) {
+    size_t i = 0;
+    for (; i + EXPRLIB_VEC_LANES <= n; i += EXPRLIB_VEC_LANES) {
+        ExprVecD x, r;
+        vec_load(&x, a + i);
+        ExprVecI bad = ~((x >= -1e5) & (x <= 1e5));
+        if (vec_any(&bad)) {
+            for (int j = 0; j < EXPRLIB_VEC_LANES; ++j)
+                out[i + j] = scalar(a[i + j]);
+            continue;
+        }
+        vec_sin_quadrant(&r, &x, quadrant);
+        vec_store(out + i, &r);
+    }
+    for (; i < n; ++i)
+        out[i] = scalar(a[i]);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_sin(const double *const *args, int argc, size_t n,
+                    double *out) {
+    (void)argc;
+    vec_sincos_map(args[0], n, out, 0, sin);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_cos(const double *const *args, int argc, size_t n,
+                    double *out) {
+    (void)argc;
+    vec_sincos_map(args[0], n, out, 1, cos);
+}
+
+EXPRLIB_VEC_INLINE void vec_round_map(const double *a, size_t n, double *out,
+                                      ExprVecRounding mode,
+                                      double (*scalar)(double)) {
+    size_t i = 0;
+    for (; i + EXPRLIB_VEC_LANES <= n; i += EXPRLIB_VEC_LANES) {
+        ExprVecD x, r;
+        vec_load(&x, a + i);
+        vec_round_mode(&r, &x, mode);
+        vec_store(out + i, &r);
+    }
+    for (; i < n; ++i)
+        out[i] = scalar(a[i]);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_floor(const double *const *args, int argc, size_t n,
+                      double *out) {
+    (void)argc;
+    vec_round_map(args[0], n, out, VEC_FLOOR, floor);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_ceil(const double *const *args, int argc, size_t n,
+                     double *out) {
+    (void)argc;
+    vec_round_map(args[0], n, out, VEC_CEIL, ceil);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_round(const double *const *args, int argc, size_t n,
+                      double *out) {
+    (void)argc;
+    vec_round_map(args[0], n, out, VEC_ROUND, round);
+}
+
+EXPRLIB_TARGET_CLONES
+static void vfn_abs(const double *const *args, int argc, size_t n,
+                    double *out) {
+    (void)argc;
+    const double *a = args[0];
+    size_t i = 0;
+    for (; i + EXPRLIB_VEC_LANES <= n; i += EXPRLIB_VEC_LANES) {
+        ExprVecD x;
+        vec_load(&x, a + i);
+        x = (ExprVecD)((ExprVecI)x & INT64_MAX);
+        vec_store(out + i, &x);
+    }
+    for (; i < n; ++i)
+        out[i] = fabs(a[i]);
+}
+
+#endif /* EXPRLIB_SIMD */
+
+#if EXPRLIB_SIMD
+#define VFN_SIN vfn_sin
+#define VFN_COS vfn_cos
+#define VFN_LOG vfn_log
+#define VFN_EXP vfn_exp
+#define VFN_ABS vfn_abs
+#define VFN_FLOOR vfn_floor
+#define VFN_CEIL vfn_ceil
+#define VFN_ROUND vfn_round
+#else
+#define VFN_SIN NULL
+#define VFN_COS NULL
+#define VFN_LOG NULL
+#define VFN_EXP NULL
+#define VFN_ABS NULL
+#define VFN_FLOOR NULL
+#define VFN_CEIL NULL
+#define VFN_ROUND NULL
+#endif
+
+static void vfn_sqrt(const double *const *args, int argc, size_t n,
+                     double *out) {
+    (void)argc;
+    const double *a = args[0];
+    for (size_t i = 0; i < n; ++i)
+        out[i] = sqrt(a[i]);
+}
+
+/* Every built-in is pure, so the optimizer may fold calls on constants. */
+static void exprlib_register_builtins(ExprLibRegistry *r) {
+    const unsigned pure = EXPRLIB_FN_PURE;
+
+    /* Trigonometric */
+    registry_add_function(r, "sin", 1, fn_sin, VFN_SIN, pure);
+    registry_add_function(r, "cos", 1, fn_cos, VFN_COS, pure);
+    registry_add_function(r, "tan", 1, fn_tan, NULL, pure);
+    registry_add_function(r, "cot", 1, fn_cot, NULL, pure);
+    registry_add_function(r, "sec", 1, fn_sec, NULL, pure);
+    registry_add_function(r, "cosec", 1, fn_cosec, NULL, pure);
+
+    /* Inverse trigonometric */
+    registry_add_function(r, "asin", 1, fn_asin, NULL, pure);
+    registry_add_function(r, "acos", 1, fn_acos, NULL, pure);
+    registry_add_function(r, "atan", 1, fn_atan, NULL, pure);
+
+    /* Powers and roots */
+    registry_add_function(r, "pow", 2, fn_pow, NULL, pure);
+    registry_add_function(r, "sqrt", 1, fn_sqrt, vfn_sqrt, pure);
+    registry_add_function(r, "cbrt", 1, fn_cbrt, NULL, pure);
+
+    /* Logarithms */
+    registry_add_function(r, "ln", 1, fn_log, VFN_LOG, pure); /* ln */
+    registry_add_function(r, "log10", 1, fn_log10, NULL, pure);
+
+    /* Exponential */
+    registry_add_function(r, "exp", 1, fn_exp, VFN_EXP, pure);
+
+    /* Absolute & rounding */
+    registry_add_function(r, "abs", 1, fn_abs, VFN_ABS, pure);
+    registry_add_function(r, "floor", 1, fn_floor, VFN_FLOOR, pure);
+    registry_add_function(r, "ceil", 1, fn_ceil, VFN_CEIL, pure);
+    registry_add_function(r, "round", 1, fn_round, VFN_ROUND, pure);
+
+    /* Conversion */
+    registry_add_function(r, "deg2rad", 1, fn_deg2rad, NULL, pure);
+    registry_add_function(r, "rad2deg", 1, fn_rad2deg, NULL, pure);
+
+    /* Min, Max */
+    registry_add_function(r, "min", -1, fn_min, NULL, pure);
+    registry_add_function(r, "max", -1, fn_max, NULL, pure);
+
+    /* Factorial */
+    registry_add_function(r, "factorial", 1, factorial, NULL, pure);
+
+    /* nCr and nPr */
+    registry_add_function(r, "nCr", 2, nCr, NULL, pure);
+    registry_add_function(r, "nPr", 2, nPr, NULL, pure);
+
+    /* Constants */
+    registry_add_constant(r, "pi", M_PI); /* π */
+    registry_add_constant(r, "e", M_E);   /* Euler's number */
+
+    /* Common derived constants */
+    registry_add_constant(r, "tau", 2.0 * M_PI); /* 2π */
+    registry_add_constant(r, "phi",
+                              (1.0 + sqrt(5.0)) / 2.0); /* Golden ratio */
+
+    /* Square roots */
+    registry_add_constant(r, "sqrt2", M_SQRT2);   /* √2 */
+    registry_add_constant(r, "sqrt3", sqrt(3.0)); /* √3 */
+    registry_add_constant(r, "sqrt5", sqrt(5.0)); /* √5 */
+
+    /* Logarithmic constants */
+    registry_add_constant(r, "ln2", M_LN2);       /* ln(2) */
+    registry_add_constant(r, "ln10", M_LN10);     /* ln(10) */
+    registry_add_constant(r, "log2e", M_LOG2E);   /* log2(e) */
+    registry_add_constant(r, "log10e", M_LOG10E); /* log10(e) */
+
+    /* Inverse pi multiples (used in physics/math derivations) */
+    registry_add_constant(r, "invpi", 1.0 / M_PI);          /* 1/π */
+    registry_add_constant(r, "inv2pi", 1.0 / (2.0 * M_PI)); /* 1/(2π) */
+}
 
 static int get_precedence(char op) {
     switch (op) {
@@ -343,24 +1373,152 @@ static int get_precedence(char op) {
     }
 }
 
-static bool is_right_associative(char op) { return op == '^'; }
-
 static void print_indent(int indent) {
     for (int i = 0; i < indent; ++i)
         putchar(' ');
 }
 
-void exprlib_free(ExprNode *node) {
-    if (!node)
+/* Arena allocator
+ *
+ * Memory is handed out from a chain of blocks by bumping an offset. Blocks
+ * grow geometrically, and exprlib_arena_reset coalesces the chain into one
+ * block big enough for everything allocated since the last reset, so a
+ * reused arena keeps each parsed expression in a single contiguous block.
+ */
+
+#define EXPRLIB_ARENA_DEFAULT_BLOCK 4096
+#define EXPRLIB_ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct ExprArenaBlock {
+    struct ExprArenaBlock *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+} ExprArenaBlock;
+
+struct ExprArena {
+    ExprArenaBlock *head; /* block currently allocated from */
+    size_t block_size;
+    size_t total; /* bytes of all blocks in the chain */
+};
+
+static ExprArenaBlock *arena_block_new(size_t size) {
+    ExprArenaBlock *block = malloc(sizeof(ExprArenaBlock) + size);
+    if (!block)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+ExprArena *exprlib_arena_create(size_t block_size) {
+    ExprArena *arena = malloc(sizeof(*arena));
+    if (!arena) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    arena->block_size = block_size ? block_size : EXPRLIB_ARENA_DEFAULT_BLOCK;
+    arena->head = arena_block_new(arena->block_size);
+    if (!arena->head) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        free(arena);
+        return NULL;
+    }
+    arena->total = arena->block_size;
+    return arena;
+}
+
+void *exprlib_arena_alloc(ExprArena *arena, size_t size) {
+    size = (size + EXPRLIB_ARENA_ALIGN - 1) & ~(EXPRLIB_ARENA_ALIGN - 1);
+    ExprArenaBlock *block = arena->head;
+    if (block->size - block->used < size) {
+        size_t new_size = block->size * 2;
+        while (new_size < size)
+            new_size *= 2;
+        block = arena_block_new(new_size);
+        if (!block)
+            return NULL;
+        block->next = arena->head;
+        arena->head = block;
+        arena->total += new_size;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void exprlib_arena_reset(ExprArena *arena) {
+    if (!arena)
+        return;
+    if (arena->head->next) {
+        ExprArenaBlock *merged = arena_block_new(arena->total);
+        if (merged) {
+            ExprArenaBlock *block = arena->head;
+            while (block) {
+                ExprArenaBlock *next = block->next;
+                free(block);
+                block = next;
+            }
+            arena->head = merged;
+        }
+    }
+    arena->head->used = 0;
+}
+
+void exprlib_arena_destroy(ExprArena *arena) {
+    if (!arena)
+        return;
+    ExprArenaBlock *block = arena->head;
+    while (block) {
+        ExprArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+/* Work stacks
+ *
+ * Walks over a whole tree (parsing, evaluation, freeing) keep their state on
+ * explicit stacks rather than the C stack, so a 50k-term sum or deeply nested
+ * parentheses are bounded by memory, not by the thread's stack size. A stack
+ * starts in a small buffer of its owner and moves to the heap when it
+ * outgrows it.
+ */
+
+#define EXPRLIB_STACK_INLINE 64
+
+static bool stack_grow(void **items, void *inline_items, int *capacity,
+                       size_t elem_size) {
+    int new_cap = *capacity * 2;
+    void *tmp = *items == inline_items ? malloc(elem_size * new_cap)
+                                       : realloc(*items, elem_size * new_cap);
+    if (!tmp) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    if (*items == inline_items)
+        memcpy(tmp, inline_items, elem_size * *capacity);
+    *items = tmp;
+    *capacity = new_cap;
+    return true;
+}
+
+static void stack_release(void *items, void *inline_items) {
+    if (items != inline_items)
+        free(items);
+}
+
+/* Free what a heap node owns, but not the node itself. */
+static void node_free_contents(ExprNode *node) {
+    if (node->flags & EXPR_NODE_FLAG_ARENA)
         return;
 
     switch (node->type) {
     case EXPR_NODE_NUMBER:
-        /* nothing extra to free */
-        break;
-
     case EXPR_NODE_VARIABLE:
-        free(node->data.variable_name);
+        /* nothing extra to free, names belong to the symbol table */
         break;
 
     case EXPR_NODE_OPERATOR:
@@ -372,81 +1530,265 @@ void exprlib_free(ExprNode *node) {
             exprlib_free(node->data.fn_call.args[i]);
         }
         free(node->data.fn_call.args);
-        free(node->data.fn_call.name);
         break;
     }
+}
 
-    free(node);
+/* Pending subtrees wait on a work stack. Should it fail to grow, the subtree
+ * is freed by a nested call instead, which only costs depth, not memory. */
+static void node_free_push(ExprNode ***stack, ExprNode **inline_stack,
+                           int *top, int *cap, ExprNode *child) {
+    if (!child || (child->flags & EXPR_NODE_FLAG_ARENA))
+        return;
+    if (*top == *cap) {
+        ExprLibError status = EXPRLIB_ERROR; /* freeing never reports */
+        bool grown =
+            stack_grow((void **)stack, inline_stack, cap, sizeof(**stack));
+        EXPRLIB_ERROR = status;
+        if (!grown) {
+            exprlib_free(child);
+            return;
+        }
+    }
+    (*stack)[(*top)++] = child;
 }
 
-double parse_number(const char **expr_ptr, bool *found) {
-    *found = false;
-    while (**expr_ptr == ' ') {
-        (*expr_ptr)++;
+void exprlib_free(ExprNode *node) {
+    /* arena nodes are released all at once by the arena */
+    if (!node || (node->flags & EXPR_NODE_FLAG_ARENA))
+        return;
+
+    ExprNode *inline_stack[EXPRLIB_STACK_INLINE];
+    ExprNode **stack = inline_stack;
+    int cap = EXPRLIB_STACK_INLINE;
+    int top = 0;
+    stack[top++] = node;
+    while (top > 0) {
+        ExprNode *n = stack[--top];
+        switch (n->type) {
+        case EXPR_NODE_NUMBER:
+        case EXPR_NODE_VARIABLE:
+            break;
+        case EXPR_NODE_OPERATOR:
+            node_free_push(&stack, inline_stack, &top, &cap,
+                           n->data.op_node.right);
+            node_free_push(&stack, inline_stack, &top, &cap,
+                           n->data.op_node.left);
+            break;
+        case EXPR_NODE_FUNCTION_CALL:
+            for (int i = n->data.fn_call.argc - 1; i >= 0; i--)
+                node_free_push(&stack, inline_stack, &top, &cap,
+                               n->data.fn_call.args[i]);
+            free(n->data.fn_call.args);
+            break;
+        }
+        free(n);
     }
-    double value = 0.0;
-    while (**expr_ptr >= '0' && **expr_ptr <= '9') {
-        *found = true;
-        value = value * 10 + (**expr_ptr - '0');
-        (*expr_ptr)++;
+    stack_release(stack, inline_stack);
+}
+
+/* Number literals
+ *
+ * A literal is digits with an optional fraction and an optional exponent:
+ * `12`, `0.5`, `.5`, `6.02e23`, `1e-9`. The scanner gathers a literal of up
+ * to 19 digits into an integer mantissa and a power of ten. When both
+ * are exact doubles a single multiply or divide rounds correctly (Clinger's
+ * fast path), which covers nearly every literal written in a formula. The
+ * rest go to strtod with the digits respelled without a decimal point, so the
+ * result is still correctly rounded and doesn't depend on the locale.
+ */
+
+#define EXPRLIB_NUMBER_DIGITS 19 /* decimal digits that always fit in u64 */
+#define EXPRLIB_NUMBER_EXACT 768 /* digits that can decide the rounding */
+#define EXPRLIB_NUMBER_EXP_MAX 100000
+
+static const double g_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool is_name_char(char c) {
+    return is_name_start(c) || is_digit(c) || c == '_';
+}
+
+/* Reads the exponent after 'e'/'E' at s. Returns its length, 0 if s doesn't
+ * hold one (then the 'e' is a separate token). */
+static size_t scan_exponent(const char *s, long *exp10) {
+    size_t i = 1;
+    bool negative = s[i] == '-';
+    if (s[i] == '+' || s[i] == '-')
+        i++;
+    if (!is_digit(s[i]))
+        return 0;
+    long value = 0;
+    for (; is_digit(s[i]); ++i) {
+        if (value < EXPRLIB_NUMBER_EXP_MAX)
+            value = value * 10 + (s[i] - '0');
     }
-    if (**expr_ptr == '.') {
-        (*expr_ptr)++;
-        double frac = 0.1;
-        while (**expr_ptr >= '0' && **expr_ptr <= '9') {
-            value += (**expr_ptr - '0') * frac;
-            frac *= 0.1;
-            (*expr_ptr)++;
+    *exp10 = negative ? -value : value;
+    return i;
+}
+
+/* Slow path for the valid literal at s: keeps the first EXPRLIB_NUMBER_EXACT
+ * significant digits and folds the rest into one sticky digit, since past
+ * that point they can only break a tie. */
+static double number_slow(const char *s) {
+    char buf[EXPRLIB_NUMBER_EXACT + 32];
+    size_t n = 0;
+    long exp10 = 0;
+    bool sticky = false, fraction = false;
+    for (; is_digit(*s) || *s == '.'; ++s) {
+        if (*s == '.') {
+            fraction = true;
+            continue;
+        }
+        if (fraction)
+            exp10--;
+        if (n == 0 && *s == '0')
+            continue;
+        if (n < EXPRLIB_NUMBER_EXACT) {
+            buf[n++] = *s;
+        } else {
+            sticky |= *s != '0';
+            exp10++;
         }
     }
-    return value;
+    if (n == 0)
+        return 0.0;
+    if (sticky) {
+        buf[n++] = '1';
+        exp10--;
+    }
+    long exponent = 0;
+    if (*s == 'e' || *s == 'E')
+        scan_exponent(s, &exponent);
+    snprintf(buf + n, sizeof(buf) - n, "e%ld", exp10 + exponent);
+    return strtod(buf, NULL);
 }
 
-bool is_defined_variable(const string name, const ExprContext *context) {
-    for (int i = 0; i < g_constant_count; i++) {
-        if (strcmp(g_constants[i].name, name) == 0) {
-            return true;
-        }
+/* Scans the literal at s. Returns its length, 0 if s doesn't start one. */
+static size_t scan_number(const char *s, double *value) {
+    const char *c = s;
+    uint64_t mantissa = 0; /* wraps past 19 digits, then unused */
+    for (; is_digit(*c); ++c)
+        mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+    size_t digits = (size_t)(c - s);
+    long exp10 = 0;
+    if (*c == '.' && (digits > 0 || is_digit(c[1]))) {
+        const char *fraction = ++c;
+        for (; is_digit(*c); ++c)
+            mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+        exp10 = -(long)(c - fraction);
+        digits += (size_t)(c - fraction);
+    }
+    if (digits == 0)
+        return 0;
+    if (*c == 'e' || *c == 'E') {
+        long exponent = 0;
+        size_t len = scan_exponent(c, &exponent);
+        exp10 += exponent;
+        c += len;
+    }
+
+    const uint64_t max_exact = 1ull << 53;
+    bool exact = digits <= EXPRLIB_NUMBER_DIGITS && mantissa <= max_exact;
+    if (exact && exp10 >= -22 && exp10 <= 22) {
+        *value = exp10 < 0 ? (double)mantissa / g_pow10[-exp10]
+                           : (double)mantissa * g_pow10[exp10];
+    } else if (exact && exp10 > 22 && exp10 <= 22 + 15 &&
+               mantissa <= max_exact / (uint64_t)g_pow10[exp10 - 22]) {
+        /* 12e30: move the excess power into the still exact mantissa */
+        *value = (double)(mantissa * (uint64_t)g_pow10[exp10 - 22]) * 1e22;
+    } else {
+        *value = number_slow(s);
     }
+    return (size_t)(c - s);
+}
+
+double parse_number(const char **expr_ptr, bool *found) {
+    while (is_space(**expr_ptr))
+        (*expr_ptr)++;
+    double value = 0.0;
+    size_t len = scan_number(*expr_ptr, &value);
+    *found = len > 0;
+    *expr_ptr += len;
+    return value;
+}
+
+static int find_variable_n(const ExprContext *context, const char *name,
+                           size_t len) {
+    if (!context)
+        return -1;
     for (int i = 0; i < context->var_count; i++) {
-        if (strcmp(context->variables[i].name, name) == 0) {
-            return true;
-        }
+        const char *v = context->variables[i].name;
+        if (strncmp(v, name, len) == 0 && v[len] == '\0')
+            return i;
     }
-    return false;
+    return -1;
 }
 
-ExprNode *create_number_node(double value) {
-    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
-    ExprNode *node = (ExprNode *)malloc(sizeof(ExprNode));
+int find_variable(const string name, const ExprContext *context) {
+    return find_variable_n(context, name, strlen(name));
+}
+
+bool is_defined_variable(const string name, const ExprContext *context) {
+    unsigned long epoch;
+    const ExprLibRegistry *r = registry_read_begin(&epoch);
+    bool is_constant =
+        lookup_constant(r, symbol_find(name, strlen(name))) != NULL;
+    registry_read_end(epoch);
+    return is_constant || find_variable(name, context) >= 0;
+}
+
+/* AST nodes come either from the heap (arena == NULL) or from an arena. Arena
+ * nodes are tagged so exprlib_free leaves them alone. */
+static ExprNode *node_alloc(ExprArena *arena) {
+    ExprNode *node = arena ? exprlib_arena_alloc(arena, sizeof(ExprNode))
+                           : malloc(sizeof(ExprNode));
     if (!node) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
         return NULL;
     }
+    node->flags = arena ? EXPR_NODE_FLAG_ARENA : 0;
+    return node;
+}
+
+static ExprNode *new_number_node(ExprArena *arena, double value) {
+    ExprNode *node = node_alloc(arena);
+    if (!node)
+        return NULL;
     node->type = EXPR_NODE_NUMBER;
     node->data.number = value;
     return node;
 }
 
-ExprNode *create_variable_node(const string name) {
-    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
-    ExprNode *node = (ExprNode *)malloc(sizeof(ExprNode));
-    if (!node) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+static ExprNode *new_variable_node(ExprArena *arena, ExprSymbol symbol,
+                                   int index) {
+    ExprNode *node = node_alloc(arena);
+    if (!node)
         return NULL;
-    }
     node->type = EXPR_NODE_VARIABLE;
-    node->data.variable_name = strdup(name);
+    node->data.variable.name = (string)symbol_name(symbol);
+    node->data.variable.symbol = symbol;
+    node->data.variable.index = index;
     return node;
 }
 
-ExprNode *create_operator_node(char op, ExprNode *left, ExprNode *right) {
-    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
-    ExprNode *node = (ExprNode *)malloc(sizeof(ExprNode));
-    if (!node) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+static ExprNode *new_operator_node(ExprArena *arena, char op, ExprNode *left,
+                                   ExprNode *right) {
+    ExprNode *node = node_alloc(arena);
+    if (!node)
         return NULL;
-    }
     node->type = EXPR_NODE_OPERATOR;
     node->data.op_node.op = op;
     node->data.op_node.left = left;
@@ -454,304 +1796,907 @@ ExprNode *create_operator_node(char op, ExprNode *left, ExprNode *right) {
     return node;
 }
 
-ExprNode *create_function_node(const string name, ExprNode **args, int argc) {
-    ExprNode *n = malloc(sizeof(*n));
-    if (!n) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-        return NULL;
-    }
-
-    char *dup = strdup(name);
-    if (!dup) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-        free(n);
+static ExprNode *new_function_node(ExprArena *arena, ExprSymbol symbol,
+                                   ExprLibFnPtr fn, ExprLibVecFnPtr vec_fn,
+                                   unsigned fn_flags, int arity,
+                                   ExprNode **args, int argc) {
+    ExprNode *n = node_alloc(arena);
+    if (!n)
         return NULL;
-    }
 
     n->type = EXPR_NODE_FUNCTION_CALL;
-    n->data.fn_call.name = dup;
+    n->data.fn_call.name = (string)symbol_name(symbol);
+    n->data.fn_call.symbol = symbol;
+    n->data.fn_call.fn = fn;
+    n->data.fn_call.vec_fn = vec_fn;
+    n->data.fn_call.fn_flags = fn_flags;
+    n->data.fn_call.arity = arity;
     n->data.fn_call.args = args; /* ownership transferred */
     n->data.fn_call.argc = argc;
 
     return n;
 }
 
-ExprNode *parse_unary(const char **expr_ptr, const ExprContext *context) {
-    while (**expr_ptr == ' ')
-        (*expr_ptr)++;
+ExprNode *create_number_node(double value) {
+    return new_number_node(NULL, value);
+}
 
-    /* unary minus */
-    if (**expr_ptr == '-') {
-        (*expr_ptr)++;
-        ExprNode *operand = parse_unary(expr_ptr, context);
-        if (!operand || EXPRLIB_ERROR != EXPRLIB_SUCCESS)
-            return NULL;
-        ExprNode *zero = create_number_node(0.0);
-        if (!zero || EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
-            exprlib_free(operand);
-            return NULL;
-        }
-        ExprNode *node = create_operator_node('-', zero, operand);
-        if (!node || EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
-            exprlib_free(zero);
-            exprlib_free(operand);
-            return NULL;
-        }
-        return node;
+/* Looks up or adds the name of a hand-built node. */
+static ExprSymbol node_symbol(const char *name) {
+    if (!name) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return EXPR_SYMBOL_NONE;
     }
+    return symbol_intern(name, strlen(name));
+}
 
-    /* parenthesized expression */
-    if (**expr_ptr == '(') {
-        (*expr_ptr)++;
+ExprNode *create_variable_node(const string name, int index) {
+    ExprSymbol symbol = node_symbol(name);
+    if (symbol == EXPR_SYMBOL_NONE)
+        return NULL;
+    return new_variable_node(NULL, symbol, index);
+}
 
-        ExprNode *node = parse_internal(expr_ptr, context);
+ExprNode *create_operator_node(char op, ExprNode *left, ExprNode *right) {
+    return new_operator_node(NULL, op, left, right);
+}
 
-        if (!node || EXPRLIB_ERROR != EXPRLIB_SUCCESS)
-            return NULL;
+ExprNode *create_function_node(const string name, ExprLibFnPtr fn, int arity,
+                               ExprNode **args, int argc) {
+    ExprSymbol symbol = node_symbol(name);
+    if (symbol == EXPR_SYMBOL_NONE)
+        return NULL;
+    return new_function_node(NULL, symbol, fn, NULL, 0, arity, args, argc);
+}
 
-        if (**expr_ptr != ')') {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
-            printf("SYNTAX ERROR: %s\n", *expr_ptr);
-            printf("            : ^ Closing Paren Expected\n");
-            exprlib_free(node);
-            return NULL;
-        }
+/* Tokens are views into the source string; nothing is copied while lexing.
+ * The parser keeps exactly one token of lookahead. */
+typedef enum {
+    EXPR_TOKEN_END,
+    EXPR_TOKEN_NUMBER,
+    EXPR_TOKEN_NAME,
+    EXPR_TOKEN_OPERATOR, /* + - * / ^ */
+    EXPR_TOKEN_LPAREN,
+    EXPR_TOKEN_RPAREN,
+    EXPR_TOKEN_COMMA,
+    EXPR_TOKEN_INVALID,
+} ExprTokenKind;
 
-        (*expr_ptr)++;
-        return node;
-    }
+typedef struct {
+    ExprTokenKind kind;
+    char op;       /* EXPR_TOKEN_OPERATOR */
+    size_t offset; /* into the source */
+    size_t length;
+    double number; /* EXPR_TOKEN_NUMBER */
+} ExprToken;
 
-    /* number */
-    bool found_number = false;
-    double number = parse_number(expr_ptr, &found_number);
-    if (found_number)
-        return create_number_node(number);
+/* Parser state. The registry snapshot is pinned by a read section for the
+ * whole parse. */
+typedef struct {
+    const ExprContext *context;
+    ExprArena *arena; /* NULL = heap-allocated nodes */
+    const ExprLibRegistry *registry;
+    const char *src;
+    size_t pos;    /* where scanning for the next token resumes */
+    ExprToken tok; /* current, not yet consumed token */
+    ExprLibDiagnostic *diag; /* NULL = only EXPRLIB_ERROR is set */
+} ExprParser;
 
-    /* variable */
-    if ((**expr_ptr >= 'a' && **expr_ptr <= 'z') ||
-        (**expr_ptr >= 'A' && **expr_ptr <= 'Z')) {
-        const char *start = *expr_ptr;
-        while ((**expr_ptr >= 'a' && **expr_ptr <= 'z') ||
-               (**expr_ptr >= 'A' && **expr_ptr <= 'Z') ||
-               (**expr_ptr >= '0' && **expr_ptr <= '9') ||
-               (**expr_ptr == '_')) {
-            (*expr_ptr)++;
-        }
+static void parser_next(ExprParser *p) {
+    const char *s = p->src;
+    size_t i = p->pos;
+    while (is_space(s[i]))
+        i++;
 
-        size_t len = *expr_ptr - start;
-        char *name = malloc(len + 1);
-        if (!name) {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-            return NULL;
+    ExprToken *t = &p->tok;
+    size_t len = 1;
+    t->offset = i;
+    switch (s[i]) {
+    case '\0':
+        t->kind = EXPR_TOKEN_END;
+        len = 0;
+        break;
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '^':
+        t->kind = EXPR_TOKEN_OPERATOR;
+        t->op = s[i];
+        break;
+    case '(':
+        t->kind = EXPR_TOKEN_LPAREN;
+        break;
+    case ')':
+        t->kind = EXPR_TOKEN_RPAREN;
+        break;
+    case ',':
+        t->kind = EXPR_TOKEN_COMMA;
+        break;
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case '.':
+        if ((len = scan_number(s + i, &t->number)) > 0) {
+            t->kind = EXPR_TOKEN_NUMBER;
+        } else {
+            len = 1; /* a lone '.' */
+            t->kind = EXPR_TOKEN_INVALID;
         }
-        snprintf(name, len + 1, "%.*s", (int)len, start);
-
-        /* skip whitespace to check for '(' (function call) */
-        const char *look = *expr_ptr;
-        while (*look == ' ')
-            look++;
-
-        if (*look == '(') {
-            /* function call */
-            /* advance expr_ptr to '(' */
-            *expr_ptr = look;
-            (*expr_ptr)++; /* consume '(' */
-
-            ExprNode **args = NULL;
-            int argc = 0;
-
-            /* empty arg list */
-            while (**expr_ptr == ' ')
-                (*expr_ptr)++;
-
-            if (**expr_ptr != ')') {
-                for (;;) {
-                    ExprNode *arg = parse_internal(expr_ptr, context);
-                    if (!arg || EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
-                        /* cleanup */
-                        for (int i = 0; i < argc; ++i)
-                            exprlib_free(args[i]);
-                        free(args);
-                        free(name);
-                        return NULL;
-                    }
-
-                    ExprNode **tmp =
-                        realloc(args, sizeof(ExprNode *) * (argc + 1));
-                    if (!tmp) {
-                        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
-                        exprlib_free(arg);
-                        for (int i = 0; i < argc; ++i)
-                            exprlib_free(args[i]);
-                        free(args);
-                        free(name);
-                        return NULL;
-                    }
-                    args = tmp;
-                    args[argc++] = arg;
-
-                    while (**expr_ptr == ' ')
-                        (*expr_ptr)++;
-
-                    if (**expr_ptr == ',') {
-                        (*expr_ptr)++; /* consume ',' */
-                        while (**expr_ptr == ' ')
-                            (*expr_ptr)++;
-                        continue;
-                    } else if (**expr_ptr == ')') {
-                        break;
-                    } else {
-                        /* syntax error */
-                        EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
-                        printf("SYNTAX ERROR: %s\n", *expr_ptr);
-                        printf("            : ^ ',' or ')' Expected\n");
-                        for (int i = 0; i < argc; ++i)
-                            exprlib_free(args[i]);
-                        free(args);
-                        free(name);
-                        return NULL;
-                    }
-                }
-            }
+        break;
+    default:
+        if (is_name_start(s[i])) {
+            while (is_name_char(s[i + len]))
+                len++;
+            t->kind = EXPR_TOKEN_NAME;
+        } else {
+            t->kind = EXPR_TOKEN_INVALID;
+        }
+        break;
+    }
+    t->length = len;
+    p->pos = i + len;
+}
 
-            /* consume ')' */
-            if (**expr_ptr != ')') {
-                /* shouldn't happen but defensive */
-                EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
-                printf("SYNTAX ERROR: %s\n", *expr_ptr);
-                printf("            : ^ Closing Paren Expected\n");
-                for (int i = 0; i < argc; ++i)
-                    exprlib_free(args[i]);
-                free(args);
-                free(name);
-                return NULL;
-            }
-            (*expr_ptr)++; /* consume ')' */
+static void parser_init(ExprParser *p, const char *src) {
+    p->src = src;
+    p->pos = 0;
+    parser_next(p);
+}
 
-            ExprNode *fn_node = create_function_node(name, args, argc);
-            free(name);
+/* The unparsed rest of the input. */
+static const char *parser_rest(const ExprParser *p) {
+    return p->src + p->tok.offset;
+}
 
-            if (!fn_node) {
-                for (int i = 0; i < argc; ++i)
-                    exprlib_free(args[i]);
-                free(args);
-                return NULL;
-            }
+/* Records an error at the source bytes [offset, offset + length). The
+ * message is only formatted when the caller asked for a diagnostic, and the
+ * first error of a parse is the one kept. */
+static void parser_error(ExprParser *p, ExprLibError code, size_t offset,
+                         size_t length, const char *fmt, ...) {
+    EXPRLIB_ERROR = code;
+    ExprLibDiagnostic *d = p->diag;
+    if (!d || d->code != EXPRLIB_SUCCESS)
+        return;
+    d->code = code;
+    d->offset = offset;
+    d->length = length;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(d->message, sizeof(d->message), fmt, ap);
+    va_end(ap);
+}
 
-            return fn_node;
-        }
+/* Errors raised below the parser (allocation, folding) only set
+ * EXPRLIB_ERROR; they are pinned to the current token here. */
+static void parser_error_status(ExprParser *p) {
+    if (p->diag && p->diag->code == EXPRLIB_SUCCESS &&
+        EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+        parser_error(p, EXPRLIB_ERROR, p->tok.offset, p->tok.length, "%s",
+                     EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR]);
+}
 
-        /* not a function call -> variable */
-        if (!is_defined_variable(name, context)) {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
-            printf("UNDEFINED VARIABLE ERROR: '%s'\n", name);
-            free(name);
-            return NULL;
-        }
+/* The current token, quoted for a message. */
+static int parser_token_width(const ExprParser *p) {
+    return p->tok.length > 32 ? 32 : (int)p->tok.length;
+}
+
+/* Operator-precedence parsing
+ *
+ * The parser is a shunting-yard loop over the token stream. Finished operands
+ * wait on one stack; binary operators, unary minus, '(' and open calls wait
+ * on another. A binary operator first reduces the waiting operators that bind
+ * at least as tightly, so every operator groups to the left, '^' included:
+ * 2^3^2 is (2^3)^2. ')' and ',' reduce back to their group, and every
+ * finished operand applies the unary minus in front of it. Reducing two
+ * numbers folds them, so the tree matches what evaluation would compute.
+ * Nothing recurses, so parse time and memory are linear in the input
+ * whatever its shape.
+ */
+
+typedef enum {
+    EXPR_PARSE_BINARY,
+    EXPR_PARSE_NEGATE,
+    EXPR_PARSE_PAREN,
+    EXPR_PARSE_CALL,
+} ExprParseFrameKind;
+
+typedef struct {
+    ExprParseFrameKind kind;
+    char op;                   /* EXPR_PARSE_BINARY */
+    int prec;                  /* EXPR_PARSE_BINARY */
+    int base;                  /* EXPR_PARSE_CALL: operands before the args */
+    const ExprLibFunction *fn; /* EXPR_PARSE_CALL */
+    size_t offset;             /* the operator or function name */
+    size_t length;
+} ExprParseFrame;
+
+typedef struct {
+    ExprNode **operands;
+    int operand_count;
+    int operand_cap;
+    ExprParseFrame *frames;
+    int frame_count;
+    int frame_cap;
+    int groups; /* open '(' and calls among the frames */
+    ExprNode *inline_operands[EXPRLIB_STACK_INLINE];
+    ExprParseFrame inline_frames[EXPRLIB_STACK_INLINE];
+} ExprParseStacks;
 
-        ExprNode *node = create_variable_node(name);
-        free(name);
-        return node;
+static bool parse_push_operand(ExprParseStacks *s, ExprNode *node) {
+    if (!node)
+        return false;
+    if (s->operand_count == s->operand_cap &&
+        !stack_grow((void **)&s->operands, s->inline_operands,
+                    &s->operand_cap, sizeof(*s->operands))) {
+        exprlib_free(node);
+        return false;
     }
+    s->operands[s->operand_count++] = node;
+    return true;
+}
+
+static bool parse_push_frame(ExprParseStacks *s, ExprParseFrame frame) {
+    if (s->frame_count == s->frame_cap &&
+        !stack_grow((void **)&s->frames, s->inline_frames, &s->frame_cap,
+                    sizeof(*s->frames)))
+        return false;
+    s->frames[s->frame_count++] = frame;
+    if (frame.kind == EXPR_PARSE_PAREN || frame.kind == EXPR_PARSE_CALL)
+        s->groups++;
+    return true;
+}
+
+static ExprParseFrame *parse_top_frame(ExprParseStacks *s) {
+    return s->frame_count ? &s->frames[s->frame_count - 1] : NULL;
+}
 
-    EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
-    printf("SYNTAX ERROR: %s\n", *expr_ptr);
-    printf("            : ^ Unexpected Token\n");
+static const ExprParseFrame *parse_open_group(const ExprParseStacks *s) {
+    for (int i = s->frame_count - 1; i >= 0; --i) {
+        if (s->frames[i].kind == EXPR_PARSE_PAREN ||
+            s->frames[i].kind == EXPR_PARSE_CALL)
+            return &s->frames[i];
+    }
     return NULL;
 }
 
-ExprNode *parse_binary_rhs(int expr_prec, ExprNode *lhs, const char **expr_ptr,
-                           const ExprContext *context) {
-    while (1) {
-        while (**expr_ptr == ' ')
-            (*expr_ptr)++;
+/* Combines the two top operands with op. Operands stay on the stack until the
+ * result exists, so a failure leaves them for the caller to free. */
+static bool parse_reduce_binary(ExprParser *p, ExprParseStacks *s,
+                                const ExprParseFrame *frame) {
+    char op = frame->op;
+    ExprNode *lhs = s->operands[s->operand_count - 2];
+    ExprNode *rhs = s->operands[s->operand_count - 1];
+    if (lhs->type == EXPR_NODE_NUMBER && rhs->type == EXPR_NODE_NUMBER) {
+        double left_val = lhs->data.number;
+        double right_val = rhs->data.number;
+        double result;
 
-        char op = **expr_ptr;
-        int tok_prec = get_precedence(op);
+        switch (op) {
+        case '+':
+            result = left_val + right_val;
+            break;
+        case '-':
+            result = left_val - right_val;
+            break;
+        case '*':
+            result = left_val * right_val;
+            break;
+        case '/':
+            if (right_val == 0.0) {
+                parser_error(p, EXPRLIB_ERROR_DIVISION_BY_ZERO, frame->offset,
+                             frame->length, "division by zero");
+                return false;
+            }
+            result = left_val / right_val;
+            break;
+        case '^':
+            result = pow(left_val, right_val);
+            break;
+        default:
+            EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+            return false;
+        }
 
-        if (tok_prec < expr_prec)
-            return lhs;
+        /* fold into the existing lhs node instead of reallocating */
+        lhs->data.number = result;
+        exprlib_free(rhs);
+        s->operand_count--;
+        return true;
+    }
 
-        (*expr_ptr)++;
+    ExprNode *node = new_operator_node(p->arena, op, lhs, rhs);
+    if (!node)
+        return false;
+    s->operand_count--;
+    s->operands[s->operand_count - 1] = node;
+    return true;
+}
 
-        ExprNode *rhs = parse_unary(expr_ptr, context);
-        if (!rhs) {
-            exprlib_free(lhs);
-            return NULL;
+/* Pops binary operators down to the innermost open group. */
+static bool parse_reduce_group(ExprParser *p, ExprParseStacks *s) {
+    ExprParseFrame *top;
+    while ((top = parse_top_frame(s)) && top->kind == EXPR_PARSE_BINARY) {
+        if (!parse_reduce_binary(p, s, top))
+            return false;
+        s->frame_count--;
+    }
+    return true;
+}
+
+/* A finished operand takes the unary minus signs written in front of it. */
+static bool parse_finish_operand(ExprParser *p, ExprParseStacks *s) {
+    ExprParseFrame *top;
+    while ((top = parse_top_frame(s)) && top->kind == EXPR_PARSE_NEGATE) {
+        ExprNode *operand = s->operands[s->operand_count - 1];
+        /* fold like 0 - c so that the sign of zero matches evaluation */
+        if (operand->type == EXPR_NODE_NUMBER) {
+            operand->data.number = 0.0 - operand->data.number;
+        } else {
+            ExprNode *zero = new_number_node(p->arena, 0.0);
+            if (!zero)
+                return false;
+            ExprNode *node = new_operator_node(p->arena, '-', zero, operand);
+            if (!node) {
+                exprlib_free(zero);
+                return false;
+            }
+            s->operands[s->operand_count - 1] = node;
         }
+        s->frame_count--;
+    }
+    return true;
+}
 
-        while (**expr_ptr == ' ')
-            (*expr_ptr)++;
+/* Turns the arguments above the call frame on top into one call node. */
+static bool parse_finish_call(ExprParser *p, ExprParseStacks *s) {
+    ExprParseFrame call = s->frames[--s->frame_count];
+    s->groups--;
+    const ExprLibFunction *fn = call.fn;
+    int argc = s->operand_count - call.base;
+    if (fn->arity != -1 && fn->arity != argc) {
+        parser_error(p, EXPRLIB_ERROR_SYNTAX, call.offset, call.length,
+                     "%s expects %d argument%s, got %d", fn->name, fn->arity,
+                     fn->arity == 1 ? "" : "s", argc);
+        return false;
+    }
 
-        int next_prec = get_precedence(**expr_ptr);
-        if (tok_prec < next_prec ||
-            (tok_prec == next_prec && is_right_associative(op))) {
-            rhs = parse_binary_rhs(tok_prec + 1, rhs, expr_ptr, context);
-            if (!rhs) {
-                exprlib_free(lhs);
-                return NULL;
-            }
+    ExprNode **args = NULL;
+    if (argc > 0) {
+        size_t size = sizeof(ExprNode *) * argc;
+        args = p->arena ? exprlib_arena_alloc(p->arena, size) : malloc(size);
+        if (!args) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            return false;
         }
+        memcpy(args, s->operands + call.base, size);
+    }
+    ExprNode *node =
+        new_function_node(p->arena, fn->symbol, fn->fn, fn->vec_fn, fn->flags,
+                          fn->arity, args, argc);
+    if (!node) {
+        if (!p->arena)
+            free(args);
+        return false;
+    }
+    s->operand_count = call.base;
+    return parse_push_operand(s, node);
+}
 
-        if (lhs->type == EXPR_NODE_NUMBER && rhs->type == EXPR_NODE_NUMBER) {
-            double left_val = lhs->data.number;
-            double right_val = rhs->data.number;
-            double result;
+/* Names are looked up straight from the source text, without copying. A
+ * name the symbol table has never seen can't be a function or a constant, and
+ * only a variable that makes it into the tree gets interned. Returns false on
+ * error, with *operand set when the name was a whole operand rather than the
+ * start of a call. */
+static bool parse_name(ExprParser *p, ExprParseStacks *s, bool *operand) {
+    const char *name = p->src + p->tok.offset;
+    size_t len = p->tok.length;
+    ExprSymbol symbol = symbol_find(name, len);
+    parser_next(p);
 
-            switch (op) {
-            case '+':
-                result = left_val + right_val;
-                break;
-            case '-':
-                result = left_val - right_val;
-                break;
-            case '*':
-                result = left_val * right_val;
-                break;
-            case '/':
-                if (right_val == 0.0) {
-                    EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
-                    exprlib_free(lhs);
-                    exprlib_free(rhs);
-                    return NULL;
-                }
-                result = left_val / right_val;
+    if (p->tok.kind == EXPR_TOKEN_LPAREN) {
+        /* function call, bound to the registry entry once here */
+        const ExprLibFunction *fn = lookup_function(p->registry, symbol);
+        if (!fn) {
+            parser_error(p, EXPRLIB_ERROR_FUNCTION_NOT_FOUND,
+                         (size_t)(name - p->src), len,
+                         "unknown function '%.*s'", (int)len, name);
+            return false;
+        }
+        parser_next(p); /* consume '(' */
+        ExprParseFrame call = {.kind = EXPR_PARSE_CALL,
+                               .base = s->operand_count,
+                               .fn = fn,
+                               .offset = (size_t)(name - p->src),
+                               .length = len};
+        if (!parse_push_frame(s, call))
+            return false;
+        *operand = false;
+        if (p->tok.kind != EXPR_TOKEN_RPAREN)
+            return true;
+        /* empty arg list */
+        parser_next(p);
+        *operand = true;
+        return parse_finish_call(p, s);
+    }
+
+    /* not a function call -> constant (folded inline) or variable */
+    *operand = true;
+    const ExprLibConstant *constant = lookup_constant(p->registry, symbol);
+    if (constant)
+        return parse_push_operand(s,
+                                  new_number_node(p->arena, constant->value));
+
+    int index = find_variable_n(p->context, name, len);
+    if (index < 0) {
+        parser_error(p, EXPRLIB_ERROR_UNDEFINED_VARIABLE,
+                     (size_t)(name - p->src), len, "undefined variable '%.*s'",
+                     (int)len, name);
+        return false;
+    }
+    if (symbol == EXPR_SYMBOL_NONE)
+        symbol = symbol_intern(name, len);
+    if (symbol == EXPR_SYMBOL_NONE)
+        return false;
+    return parse_push_operand(s, new_variable_node(p->arena, symbol, index));
+}
+
+/* Parses from the current token. With lhs, parsing continues after that
+ * operand. Outside of parentheses, a binary operator below min_prec ends the
+ * expression, as does any token that can't continue it; the token is left
+ * unconsumed. */
+static ExprNode *parser_run(ExprParser *p, ExprNode *lhs, int min_prec) {
+    ExprParseStacks s;
+    s.operands = s.inline_operands;
+    s.operand_count = 0;
+    s.operand_cap = EXPRLIB_STACK_INLINE;
+    s.frames = s.inline_frames;
+    s.frame_count = 0;
+    s.frame_cap = EXPRLIB_STACK_INLINE;
+    s.groups = 0;
+
+    ExprNode *result = NULL;
+    bool want_operand = true;
+    if (lhs) {
+        s.operands[s.operand_count++] = lhs;
+        want_operand = false;
+    }
+
+    for (;;) {
+        const ExprToken *t = &p->tok;
+
+        if (want_operand) {
+            bool operand = true;
+            switch (t->kind) {
+            case EXPR_TOKEN_OPERATOR:
+                if (t->op != '-')
+                    goto unexpected;
+                /* unary minus */
+                if (!parse_push_frame(
+                        &s, (ExprParseFrame){.kind = EXPR_PARSE_NEGATE}))
+                    goto fail;
+                parser_next(p);
+                continue;
+            case EXPR_TOKEN_LPAREN:
+                if (!parse_push_frame(
+                        &s, (ExprParseFrame){.kind = EXPR_PARSE_PAREN}))
+                    goto fail;
+                parser_next(p);
+                continue;
+            case EXPR_TOKEN_NUMBER: {
+                double number = t->number;
+                parser_next(p);
+                if (!parse_push_operand(&s, new_number_node(p->arena, number)))
+                    goto fail;
                 break;
-            case '^':
-                result = pow(left_val, right_val);
+            }
+            case EXPR_TOKEN_NAME:
+                if (!parse_name(p, &s, &operand))
+                    goto fail;
                 break;
             default:
-                EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
-                exprlib_free(lhs);
-                exprlib_free(rhs);
-                return NULL;
+            unexpected:
+                if (t->kind == EXPR_TOKEN_END)
+                    parser_error(p, EXPRLIB_ERROR_SYNTAX, t->offset, 0,
+                                 "unexpected end of expression");
+                else
+                    parser_error(p, EXPRLIB_ERROR_SYNTAX, t->offset,
+                                 t->length, "unexpected '%.*s'",
+                                 parser_token_width(p), parser_rest(p));
+                goto fail;
             }
+            if (!operand)
+                continue; /* now inside a call's arguments */
+            if (!parse_finish_operand(p, &s))
+                goto fail;
+            want_operand = false;
+            continue;
+        }
 
-            exprlib_free(lhs);
-            exprlib_free(rhs);
-            lhs = create_number_node(result);
-            if (!lhs || EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
-                return NULL;
+        if (t->kind == EXPR_TOKEN_OPERATOR) {
+            char op = t->op;
+            int prec = get_precedence(op);
+            if (s.groups == 0 && prec < min_prec)
+                break;
+            ExprParseFrame *top;
+            while ((top = parse_top_frame(&s)) &&
+                   top->kind == EXPR_PARSE_BINARY &&
+                   top->prec >= prec) {
+                if (!parse_reduce_binary(p, &s, top))
+                    goto fail;
+                s.frame_count--;
             }
+            ExprParseFrame binary = {.kind = EXPR_PARSE_BINARY,
+                                     .op = op,
+                                     .prec = prec,
+                                     .offset = t->offset,
+                                     .length = t->length};
+            if (!parse_push_frame(&s, binary))
+                goto fail;
+            parser_next(p);
+            want_operand = true;
             continue;
-        } else {
-            lhs = create_operator_node(op, lhs, rhs);
-            if (!lhs || EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
-                exprlib_free(rhs);
-                return NULL;
+        }
+
+        if (s.groups > 0 &&
+            (t->kind == EXPR_TOKEN_COMMA || t->kind == EXPR_TOKEN_RPAREN)) {
+            if (!parse_reduce_group(p, &s))
+                goto fail;
+            ExprParseFrame *group = parse_top_frame(&s);
+            if (group->kind == EXPR_PARSE_PAREN) {
+                if (t->kind == EXPR_TOKEN_COMMA)
+                    goto unclosed;
+                parser_next(p);
+                s.frame_count--;
+                s.groups--;
+            } else if (t->kind == EXPR_TOKEN_COMMA) {
+                parser_next(p);
+                want_operand = true;
+                continue;
+            } else {
+                parser_next(p);
+                if (!parse_finish_call(p, &s))
+                    goto fail;
             }
+            if (!parse_finish_operand(p, &s))
+                goto fail;
+            continue;
         }
+
+        /* nothing else continues an expression */
+        if (s.groups > 0)
+            goto unclosed;
+        break;
     }
+
+    if (!parse_reduce_group(p, &s))
+        goto fail;
+    result = s.operands[0];
+    s.operand_count = 0;
+    goto done;
+
+unclosed:
+    parser_error(p, EXPRLIB_ERROR_SYNTAX, p->tok.offset, p->tok.length,
+                 parse_open_group(&s)->kind == EXPR_PARSE_CALL
+                     ? "expected ',' or ')'"
+                     : "expected ')'");
+fail:
+    parser_error_status(p);
+    for (int i = 0; i < s.operand_count; ++i)
+        exprlib_free(s.operands[i]);
+done:
+    stack_release(s.operands, s.inline_operands);
+    stack_release(s.frames, s.inline_frames);
+    return result;
+}
+
+/* The pointer-based helpers parse a prefix of *expr_ptr and leave it at the
+ * first token they didn't consume. */
+ExprNode *parse_unary(const char **expr_ptr, const ExprContext *context) {
+    unsigned long epoch;
+    ExprParser p = {.context = context, .arena = NULL};
+    parser_init(&p, *expr_ptr);
+    p.registry = registry_read_begin(&epoch);
+    ExprNode *node = parser_run(&p, NULL, INT_MAX);
+    registry_read_end(epoch);
+    *expr_ptr = parser_rest(&p);
+    return node;
+}
+
+ExprNode *parse_binary_rhs(int expr_prec, ExprNode *lhs, const char **expr_ptr,
+                           const ExprContext *context) {
+    unsigned long epoch;
+    ExprParser p = {.context = context, .arena = NULL};
+    parser_init(&p, *expr_ptr);
+    p.registry = registry_read_begin(&epoch);
+    ExprNode *node = parser_run(&p, lhs, expr_prec);
+    registry_read_end(epoch);
+    *expr_ptr = parser_rest(&p);
+    return node;
 }
 
 ExprNode *parse_internal(const char **expr_ptr, const ExprContext *context) {
-    ExprNode *lhs = parse_unary(expr_ptr, context);
-    if (!lhs || EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+    unsigned long epoch;
+    ExprParser p = {.context = context, .arena = NULL};
+    parser_init(&p, *expr_ptr);
+    p.registry = registry_read_begin(&epoch);
+    ExprNode *node = parser_run(&p, NULL, 0);
+    registry_read_end(epoch);
+    *expr_ptr = parser_rest(&p);
+    return node;
+}
+
+/* Parses the whole string; anything left after the expression is an error. */
+static ExprNode *parse_source(const char *expression,
+                              const ExprContext *context, ExprArena *arena,
+                              ExprLibDiagnostic *diag) {
+    if (diag)
+        *diag = (ExprLibDiagnostic){.code = EXPRLIB_SUCCESS};
+    if (!expression) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        if (diag) {
+            diag->code = EXPRLIB_ERROR_NULL;
+            snprintf(diag->message, sizeof(diag->message), "%s",
+                     EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR_NULL]);
+        }
+        return NULL;
+    }
+    unsigned long epoch;
+    ExprParser p = {.context = context, .arena = arena, .diag = diag};
+    parser_init(&p, expression);
+    p.registry = registry_read_begin(&epoch);
+    ExprNode *node = parser_run(&p, NULL, 0);
+    registry_read_end(epoch);
+    if (node && p.tok.kind != EXPR_TOKEN_END) {
+        parser_error(&p, EXPRLIB_ERROR_SYNTAX, p.tok.offset, p.tok.length,
+                     "unexpected '%.*s' after the expression",
+                     parser_token_width(&p), parser_rest(&p));
+        exprlib_free(node);
         return NULL;
-    return parse_binary_rhs(0, lhs, expr_ptr, context);
+    }
+    return node;
 }
 
-void print_expr_tree(const ExprNode *node, int indent) {
+/* Profiling
+ *
+ * With EXPRLIB_PROFILE defined, exprlib_evaluate and the bytecode VM report
+ * to the profile attached to the calling thread, if any. Every tree node
+ * counts its visits and the time until its value is ready, children
+ * included. Every instruction counts how often it ran, and every call adds to
+ * its function's count and time. Counters sit in open-addressing tables
+ * keyed by the address of the node, instruction or function. Nodes are timed
+ * with a stack of start times in the profile, pushed as frames are entered
+ * and popped as they finish; should it fail to grow, the deeper nodes are
+ * only counted. Recording never touches EXPRLIB_ERROR, so a profiled
+ * evaluation fails exactly when an unprofiled one would. Without
+ * EXPRLIB_PROFILE the hooks test a constant and compile away.
+ */
+
+#ifdef EXPRLIB_PROFILE
+#define EXPRLIB_PROFILING 1
+#else
+#define EXPRLIB_PROFILING 0
+#endif
+
+typedef struct {
+    uintptr_t key;     /* 0 = empty */
+    ExprSymbol symbol; /* functions called from a tree */
+    unsigned long long count;
+    unsigned long long ns;
+} ExprProfileSlot;
+
+typedef struct {
+    ExprProfileSlot *slots;
+    size_t mask;
+    size_t count;
+} ExprProfileTable;
+
+struct ExprProfile {
+    ExprProfileTable sites; /* nodes and instructions */
+    ExprProfileTable functions;
+    uint64_t *starts;
+    int depth; /* frames entered; the first start_cap have a start time */
+    int start_cap;
+};
+
+static EXPRLIB_THREAD_LOCAL ExprProfile *g_profile;
+
+static uint64_t profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t profile_hash(uintptr_t key) {
+    return (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static const ExprProfileSlot *profile_find(const ExprProfileTable *t,
+                                           uintptr_t key) {
+    if (!t->slots)
+        return NULL;
+    size_t i = profile_hash(key) & t->mask;
+    while (t->slots[i].key && t->slots[i].key != key)
+        i = (i + 1) & t->mask;
+    return t->slots[i].key ? &t->slots[i] : NULL;
+}
+
+/* The slot for key, added if needed; NULL if the table can't grow. */
+static ExprProfileSlot *profile_slot(ExprProfileTable *t, uintptr_t key) {
+    size_t capacity = t->slots ? t->mask + 1 : 0;
+    if ((t->count + 1) * 2 > capacity) {
+        size_t next = capacity ? capacity * 2 : 64;
+        ExprProfileSlot *slots = calloc(next, sizeof(*slots));
+        if (!slots)
+            return NULL;
+        for (size_t i = 0; i < capacity; ++i) {
+            if (!t->slots[i].key)
+                continue;
+            size_t j = profile_hash(t->slots[i].key) & (next - 1);
+            while (slots[j].key)
+                j = (j + 1) & (next - 1);
+            slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->mask = next - 1;
+    }
+    size_t i = profile_hash(key) & t->mask;
+    while (t->slots[i].key && t->slots[i].key != key)
+        i = (i + 1) & t->mask;
+    if (!t->slots[i].key) {
+        t->slots[i].key = key;
+        t->count++;
+    }
+    return &t->slots[i];
+}
+
+static void profile_add(ExprProfileTable *t, uintptr_t key, ExprSymbol symbol,
+                        uint64_t ns) {
+    ExprProfileSlot *slot = profile_slot(t, key);
+    if (!slot)
+        return;
+    slot->count++;
+    slot->ns += ns;
+    if (symbol != EXPR_SYMBOL_NONE)
+        slot->symbol = symbol;
+}
+
+static void profile_enter(ExprProfile *p) {
+    if (p->depth == p->start_cap) {
+        int cap = p->start_cap ? p->start_cap * 2 : 64;
+        uint64_t *starts = realloc(p->starts, sizeof(*starts) * cap);
+        if (starts) {
+            p->starts = starts;
+            p->start_cap = cap;
+        }
+    }
+    if (p->depth < p->start_cap)
+        p->starts[p->depth] = profile_now();
+    p->depth++;
+}
+
+static void profile_leave(ExprProfile *p, const ExprNode *node) {
+    int i = --p->depth;
+    profile_add(&p->sites, (uintptr_t)node, EXPR_SYMBOL_NONE,
+                i < p->start_cap ? profile_now() - p->starts[i] : 0);
+}
+
+static void profile_call(ExprProfile *p, ExprLibFnPtr fn, ExprSymbol symbol,
+                         uint64_t start) {
+    profile_add(&p->functions, (uintptr_t)fn, symbol, profile_now() - start);
+}
+
+static void profile_clear(ExprProfileTable *t) {
+    if (t->slots)
+        memset(t->slots, 0, sizeof(*t->slots) * (t->mask + 1));
+    t->count = 0;
+}
+
+ExprProfile *exprlib_profile_create(void) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!EXPRLIB_PROFILING) {
+        /* the library was built without EXPRLIB_PROFILE */
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return NULL;
+    }
+    ExprProfile *profile = calloc(1, sizeof(*profile));
+    if (!profile)
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+    return profile;
+}
+
+void exprlib_profile_reset(ExprProfile *profile) {
+    if (!profile)
+        return;
+    profile_clear(&profile->sites);
+    profile_clear(&profile->functions);
+}
+
+void exprlib_profile_free(ExprProfile *profile) {
+    if (!profile)
+        return;
+    if (g_profile == profile)
+        g_profile = NULL;
+    free(profile->sites.slots);
+    free(profile->functions.slots);
+    free(profile->starts);
+    free(profile);
+}
+
+ExprProfile *exprlib_profile_attach(ExprProfile *profile) {
+    ExprProfile *previous = g_profile;
+    g_profile = profile;
+    return previous;
+}
+
+ExprProfileCounter exprlib_profile_node(const ExprProfile *profile,
+                                        const ExprNode *node) {
+    const ExprProfileSlot *slot =
+        profile ? profile_find(&profile->sites, (uintptr_t)node) : NULL;
+    return slot ? (ExprProfileCounter){slot->count, slot->ns}
+                : (ExprProfileCounter){0, 0};
+}
+
+/* Calls from bytecode only know the function, so look its name up. */
+static const char *profile_function_name(const ExprLibRegistry *r,
+                                         const ExprProfileSlot *slot) {
+    if (slot->symbol != EXPR_SYMBOL_NONE)
+        return symbol_name(slot->symbol);
+    for (size_t i = 0; i < r->functions.capacity; ++i) {
+        const ExprLibFunction *f = &r->functions.slots[i];
+        if (f->name && (uintptr_t)f->fn == slot->key)
+            return f->name;
+    }
+    return NULL;
+}
+
+size_t exprlib_profile_functions(const ExprProfile *profile,
+                                 ExprProfileFunction *out, size_t max) {
+    if (!profile)
+        return 0;
+    const ExprProfileTable *t = &profile->functions;
+    size_t n = 0;
+    unsigned long epoch;
+    const ExprLibRegistry *r = registry_read_begin(&epoch);
+    for (size_t i = 0; t->slots && i <= t->mask; ++i) {
+        const ExprProfileSlot *slot = &t->slots[i];
+        if (!slot->key)
+            continue;
+        if (n < max && out)
+            out[n] = (ExprProfileFunction){
+                .name = profile_function_name(r, slot),
+                .calls = slot->count,
+                .ns = slot->ns,
+            };
+        n++;
+    }
+    registry_read_end(epoch);
+    return n;
+}
+
+/* Ends a line of print_tree, with the node's cost when profiling. */
+static void print_cost(const ExprProfile *profile, const ExprNode *node,
+                       unsigned long long total) {
+    if (profile) {
+        ExprProfileCounter c = exprlib_profile_node(profile, node);
+        printf("  [%llu visits, %.3f us", c.count, c.ns / 1e3);
+        if (total)
+            printf(", %.1f%%", 100.0 * c.ns / total);
+        putchar(']');
+    }
+    putchar('\n');
+}
+
+static void print_tree(const ExprNode *node, int indent,
+                       const ExprProfile *profile, unsigned long long total) {
     if (!node) {
         print_indent(indent);
         printf("(null)\n");
@@ -762,133 +2707,4903 @@ void print_expr_tree(const ExprNode *node, int indent) {
 
     switch (node->type) {
     case EXPR_NODE_NUMBER:
-        printf("NUMBER: %g\n", node->data.number);
+        printf("NUMBER: %g", node->data.number);
+        print_cost(profile, node, total);
         break;
 
     case EXPR_NODE_VARIABLE:
-        printf("VARIABLE: %s\n", node->data.variable_name);
+        printf("VARIABLE: %s", node->data.variable.name);
+        print_cost(profile, node, total);
         break;
 
     case EXPR_NODE_OPERATOR:
-        printf("OPERATOR: '%c'\n", node->data.op_node.op);
+        printf("OPERATOR: '%c'", node->data.op_node.op);
+        print_cost(profile, node, total);
         print_indent(indent);
         printf("LHS:\n");
-        print_expr_tree(node->data.op_node.left, indent + 2);
+        print_tree(node->data.op_node.left, indent + 2, profile, total);
         print_indent(indent);
         printf("RHS:\n");
-        print_expr_tree(node->data.op_node.right, indent + 2);
+        print_tree(node->data.op_node.right, indent + 2, profile, total);
         break;
 
     case EXPR_NODE_FUNCTION_CALL:
-        printf("FUNCTION CALL: %s (argc=%d)\n", node->data.fn_call.name,
+        printf("FUNCTION CALL: %s (argc=%d)", node->data.fn_call.name,
                node->data.fn_call.argc);
+        print_cost(profile, node, total);
         for (int i = 0; i < node->data.fn_call.argc; i++) {
             print_indent(indent + 2);
             printf("ARG %d:\n", i);
-            print_expr_tree(node->data.fn_call.args[i], indent + 4);
+            print_tree(node->data.fn_call.args[i], indent + 4, profile,
+                       total);
         }
     }
 }
 
+void print_expr_tree(const ExprNode *node, int indent) {
+    print_tree(node, indent, NULL, 0);
+}
+
+void print_expr_profile(const ExprNode *node, const ExprProfile *profile,
+                        int indent) {
+    print_tree(node, indent, profile,
+               exprlib_profile_node(profile, node).ns);
+}
+
 ExprNode *exprlib_parse(const string expression, const ExprContext *context) {
     EXPRLIB_ERROR = EXPRLIB_SUCCESS;
-    const char *ptr = expression;
-    return parse_internal(&ptr, context);
+    return parse_source(expression, context, NULL, NULL);
 }
 
-double evaluate_node(const ExprNode *node, const ExprContext *context) {
-    if (!node) {
-        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
-        return 0.0;
+ExprNode *exprlib_parse_arena(const string expression,
+                              const ExprContext *context, ExprArena *arena) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!arena) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
     }
+    return parse_source(expression, context, arena, NULL);
+}
 
-    switch (node->type) {
-    case EXPR_NODE_NUMBER:
+ExprNode *exprlib_parse_ex(const string expression, const ExprContext *context,
+                           ExprArena *arena, ExprLibDiagnostic *diag) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    return parse_source(expression, context, arena, diag);
+}
+
+/* Evaluation walks the tree in post-order with an explicit stack of frames,
+ * each recording how many of its children are done. Results go on a value
+ * stack, so a call's arguments lie next to each other there and are passed
+ * to the function in place. The walk stops at the first error. */
+typedef struct {
+    const ExprNode *node;
+    int next; /* children evaluated so far */
+} ExprEvalFrame;
+
+/* The other passes over a tree (optimize, CSE, compile, emit C) walk it the
+ * same way, with these to step through a node's children in order. */
+static int node_child_count(const ExprNode *n) {
+    return n->type == EXPR_NODE_OPERATOR        ? 2
+           : n->type == EXPR_NODE_FUNCTION_CALL ? n->data.fn_call.argc
+                                                : 0;
+}
+
+static ExprNode *node_child(const ExprNode *n, int i) {
+    if (n->type == EXPR_NODE_OPERATOR)
+        return i ? n->data.op_node.right : n->data.op_node.left;
+    return n->data.fn_call.args[i];
+}
+
+static bool frame_push(ExprEvalFrame **frames, ExprEvalFrame *inline_frames,
+                       int *count, int *cap, const ExprNode *node) {
+    if (*count == *cap &&
+        !stack_grow((void **)frames, inline_frames, cap, sizeof(**frames)))
+        return false;
+    (*frames)[(*count)++] = (ExprEvalFrame){node, 0};
+    return true;
+}
+
+static double evaluate_leaf(const ExprNode *node, const ExprContext *context) {
+    if (node->type == EXPR_NODE_NUMBER)
         return node->data.number;
 
-    case EXPR_NODE_VARIABLE: {
-        for (int i = 0; i < g_constant_count; i++) {
-            if (strcmp(g_constants[i].name, node->data.variable_name) == 0) {
-                return g_constants[i].value;
-            }
-        }
-        for (int i = 0; i < context->var_count; i++) {
-            if (strcmp(context->variables[i].name, node->data.variable_name) ==
-                0) {
-                return *(context->variables[i].value);
-            }
-        }
+    int index = node->data.variable.index;
+    if (!context || index < 0 || index >= context->var_count) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
-        printf("UNDEFINED VARIABLE ERROR: '%s'\n", node->data.variable_name);
         return 0.0;
     }
+    return *context->variables[index].value;
+}
 
-    case EXPR_NODE_OPERATOR: {
-        double left_val = evaluate_node(node->data.op_node.left, context);
-        if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+static double evaluate_operator(char op, double left_val, double right_val) {
+    switch (op) {
+    case '+':
+        return left_val + right_val;
+    case '-':
+        return left_val - right_val;
+    case '*':
+        return left_val * right_val;
+    case '/':
+        if (right_val == 0.0) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
             return 0.0;
+        }
+        return left_val / right_val;
+    case '^':
+        return pow(left_val, right_val);
+    default:
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return 0.0;
+    }
+}
 
-        double right_val = evaluate_node(node->data.op_node.right, context);
-        if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+double evaluate_node(const ExprNode *node, const ExprContext *context) {
+    if (!node) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return 0.0;
+    }
+    ExprProfile *profile = EXPRLIB_PROFILING ? g_profile : NULL;
+    if (!profile &&
+        (node->type == EXPR_NODE_NUMBER || node->type == EXPR_NODE_VARIABLE))
+        return evaluate_leaf(node, context);
+    int profile_depth = profile ? profile->depth : 0;
+
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    double inline_values[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    double *values = inline_values;
+    int frame_cap = EXPRLIB_STACK_INLINE, value_cap = EXPRLIB_STACK_INLINE;
+    int frame_count = 0, value_count = 0;
+    double result = 0.0;
+
+    frames[frame_count++] = (ExprEvalFrame){node, 0};
+    if (profile)
+        profile_enter(profile);
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        const ExprNode *n = f->node;
+        const ExprNode *child = NULL;
+        bool descend = false;
+        double value = 0.0;
+
+        switch (n->type) {
+        case EXPR_NODE_NUMBER:
+        case EXPR_NODE_VARIABLE:
+            value = evaluate_leaf(n, context);
+            break;
+        case EXPR_NODE_OPERATOR:
+            if (f->next < 2) {
+                child = f->next++ ? n->data.op_node.right
+                                  : n->data.op_node.left;
+                descend = true;
+                break;
+            }
+            value_count -= 2;
+            value = evaluate_operator(n->data.op_node.op, values[value_count],
+                                      values[value_count + 1]);
+            break;
+        case EXPR_NODE_FUNCTION_CALL: {
+            /* name and arity were checked when the node was parsed */
+            int argc = n->data.fn_call.argc;
+            if (f->next < argc) {
+                child = n->data.fn_call.args[f->next++];
+                descend = true;
+                break;
+            }
+            value_count -= argc;
+            uint64_t start = profile ? profile_now() : 0;
+            value = call_function(n->data.fn_call.fn, n->data.fn_call.fn_flags,
+                                  values + value_count, argc);
+            if (profile)
+                profile_call(profile, n->data.fn_call.fn,
+                             n->data.fn_call.symbol, start);
+            break;
+        }
+        default:
+            EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+            goto done;
+        }
+
+        if (descend) {
+            if (!child) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+                goto done;
+            }
+            if (frame_count == frame_cap &&
+                !stack_grow((void **)&frames, inline_frames, &frame_cap,
+                            sizeof(*frames)))
+                goto done;
+            frames[frame_count++] = (ExprEvalFrame){child, 0};
+            if (profile)
+                profile_enter(profile);
+            continue;
+        }
+        if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+            goto done;
+        frame_count--;
+        if (profile)
+            profile_leave(profile, n);
+        if (value_count == value_cap &&
+            !stack_grow((void **)&values, inline_values, &value_cap,
+                        sizeof(*values)))
+            goto done;
+        values[value_count++] = value;
+    }
+    result = values[0];
+
+done:
+    if (profile)
+        profile->depth = profile_depth;
+    stack_release(frames, inline_frames);
+    stack_release(values, inline_values);
+    return EXPRLIB_ERROR == EXPRLIB_SUCCESS ? result : 0.0;
+}
+
+double exprlib_evaluate(const ExprNode *expr, const ExprContext *context) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    return evaluate_node(expr, context);
+}
+
+/* AST optimization
+ *
+ * exprlib_optimize rewrites a tree bottom-up, in place:
+ *  - operators on two numbers, and calls to pure functions (EXPRLIB_FN_PURE)
+ *    whose arguments are all numbers, are evaluated once;
+ *  - x - c becomes x + -c and constants move to the right of + and *, so the
+ *    constants of a + or * chain gather at its top and combine: x * 2 * 3 and
+ *    2 * x * 3 both become x * 6;
+ *  - x / c becomes x * (1/c) when c is a power of two (exact);
+ *  - x*1, x+0, x-0, x/1, x^1, x^0 and -(-x) disappear, and a variable squared
+ *    becomes x * x.
+ * Combining constants reassociates floating-point operations, so results may
+ * differ from the original tree in the last bits. Division by a constant zero
+ * is kept, and x^0 only folds when x cannot fail, so evaluation errors still
+ * surface when the tree is evaluated.
+ */
+
+static bool is_number(const ExprNode *n) {
+    return n->type == EXPR_NODE_NUMBER;
+}
+
+static bool is_number_value(const ExprNode *n, double value) {
+    return n->type == EXPR_NODE_NUMBER && n->data.number == value;
+}
+
+/* n is `A op c` with a constant c */
+static bool is_constant_chain(const ExprNode *n, char op) {
+    return n->type == EXPR_NODE_OPERATOR && n->data.op_node.op == op &&
+           is_number(n->data.op_node.right);
+}
+
+/* Whether a call can't set EXPRLIB_ERROR: true only for the built-ins that
+ * never do. min() and max() fail without arguments, factorial, nCr and nPr
+ * on negative ones, and nothing is known about registered functions. */
+static bool call_cannot_fail(ExprLibFnPtr fn, int argc) {
+    static const ExprLibFnPtr total[] = {
+        fn_sin,   fn_cos,     fn_tan,     fn_cot, fn_sec,   fn_cosec,
+        fn_asin,  fn_acos,    fn_atan,    fn_pow, fn_sqrt,  fn_cbrt,
+        fn_log,   fn_log10,   fn_exp,     fn_abs, fn_floor, fn_ceil,
+        fn_round, fn_deg2rad, fn_rad2deg};
+    if (fn == fn_min || fn == fn_max)
+        return argc > 0;
+    for (size_t i = 0; i < sizeof(total) / sizeof(total[0]); ++i) {
+        if (fn == total[i])
+            return true;
+    }
+    return false;
+}
+
+/* Evaluating expr could set EXPRLIB_ERROR (a division that is not by a
+ * nonzero constant, or a call that call_cannot_fail doesn't vouch for). Out
+ * of memory for the walk, it answers yes without reporting an error. */
+static bool may_fail(const ExprNode *expr) {
+    const ExprNode *inline_stack[EXPRLIB_STACK_INLINE];
+    const ExprNode **stack = inline_stack;
+    int cap = EXPRLIB_STACK_INLINE, top = 0;
+    bool fail = false;
+
+    stack[top++] = expr;
+    while (top > 0 && !fail) {
+        const ExprNode *n = stack[--top];
+        if (n->type == EXPR_NODE_OPERATOR && n->data.op_node.op == '/' &&
+            !(is_number(n->data.op_node.right) &&
+              n->data.op_node.right->data.number != 0.0))
+            fail = true;
+        if (n->type == EXPR_NODE_FUNCTION_CALL &&
+            !call_cannot_fail(n->data.fn_call.fn, n->data.fn_call.argc))
+            fail = true;
+        for (int i = 0; !fail && i < node_child_count(n); ++i) {
+            const ExprNode *child = node_child(n, i);
+            if (!child)
+                continue;
+            if (top == cap) {
+                ExprLibError status = EXPRLIB_ERROR;
+                fail = !stack_grow((void **)&stack, inline_stack, &cap,
+                                   sizeof(*stack));
+                EXPRLIB_ERROR = status;
+                if (fail)
+                    break;
+            }
+            stack[top++] = child;
+        }
+    }
+    stack_release(stack, inline_stack);
+    return fail;
+}
+
+static void node_free_shell(ExprNode *n) {
+    if (!(n->flags & EXPR_NODE_FLAG_ARENA))
+        free(n);
+}
+
+/* Turn n into a number node, freeing whatever it owned. */
+static void node_set_number(ExprNode *n, double value) {
+    node_free_contents(n);
+    n->type = EXPR_NODE_NUMBER;
+    n->data.number = value;
+}
+
+/* Replace n by its child `keep` and free the sibling `drop`. */
+static void node_hoist(ExprNode *n, ExprNode *keep, ExprNode *drop) {
+    unsigned flags = n->flags;
+    *n = *keep;
+    n->flags = flags;
+    node_free_shell(keep);
+    exprlib_free(drop);
+}
+
+/* Make the number node dst a second copy of the variable node var. */
+static void node_copy_variable(ExprNode *dst, const ExprNode *var) {
+    dst->type = EXPR_NODE_VARIABLE;
+    dst->data.variable = var->data.variable;
+}
+
+static double fold_operator(char op, double a, double b) {
+    switch (op) {
+    case '+':
+        return a + b;
+    case '-':
+        return a - b;
+    case '*':
+        return a * b;
+    case '/':
+        return a / b;
+    default:
+        return pow(a, b);
+    }
+}
+
+/* c is a power of two whose reciprocal is a normal number */
+static bool has_exact_reciprocal(double c) {
+    int exp;
+    double m = frexp(c, &exp);
+    return (m == 0.5 || m == -0.5) && isnormal(1.0 / c);
+}
+
+static bool optimize_operator(ExprNode *n) {
+    ExprNodeOperator *o = &n->data.op_node;
+
+    if (is_number(o->left) && is_number(o->right)) {
+        if (o->op == '/' && o->right->data.number == 0.0)
+            return true;
+        node_set_number(n, fold_operator(o->op, o->left->data.number,
+                                         o->right->data.number));
+        return true;
+    }
+
+    if (o->op == '-' && is_number(o->right)) {
+        o->op = '+';
+        o->right->data.number = -o->right->data.number;
+    } else if (o->op == '/' && is_number(o->right) &&
+               has_exact_reciprocal(o->right->data.number)) {
+        o->op = '*';
+        o->right->data.number = 1.0 / o->right->data.number;
+    }
+
+    if (o->op == '+' || o->op == '*') {
+        if (is_number(o->left)) {
+            ExprNode *tmp = o->left;
+            o->left = o->right;
+            o->right = tmp;
+        }
+
+        ExprNode *inner = NULL;
+        if (!is_number(o->right) && is_constant_chain(o->left, o->op)) {
+            /* (A op c) op B -> (A op B) op c */
+            inner = o->left;
+            ExprNode *c = inner->data.op_node.right;
+            inner->data.op_node.right = o->right;
+            o->right = c;
+        } else if (!is_number(o->right) &&
+                   is_constant_chain(o->right, o->op)) {
+            /* B op (A op c) -> (B op A) op c */
+            inner = o->right;
+            ExprNode *c = inner->data.op_node.right;
+            inner->data.op_node.right = inner->data.op_node.left;
+            inner->data.op_node.left = o->left;
+            o->left = inner;
+            o->right = c;
+        }
+        /* B may itself end in a constant that now has to bubble up */
+        if (inner && !optimize_operator(inner))
+            return false;
+
+        if (is_number(o->right) && is_constant_chain(o->left, o->op)) {
+            /* (A op c1) op c2 -> A op (c1 op c2) */
+            ExprNode *inner = o->left;
+            ExprNode *c1 = inner->data.op_node.right;
+            o->right->data.number =
+                fold_operator(o->op, c1->data.number, o->right->data.number);
+            o->left = inner->data.op_node.left;
+            node_free_shell(c1);
+            node_free_shell(inner);
+        }
+    }
+
+    ExprNode *l = o->left;
+    ExprNode *r = o->right;
+    switch (o->op) {
+    case '+':
+        if (is_number_value(r, 0.0))
+            node_hoist(n, l, r);
+        break;
+    case '*':
+    case '/':
+        if (is_number_value(r, 1.0))
+            node_hoist(n, l, r);
+        break;
+    case '^':
+        if (is_number_value(r, 1.0)) {
+            node_hoist(n, l, r);
+        } else if (is_number_value(r, 0.0) && !may_fail(l)) {
+            node_set_number(n, 1.0);
+        } else if (is_number_value(r, 2.0) && l->type == EXPR_NODE_VARIABLE) {
+            node_copy_variable(r, l);
+            o->op = '*';
+        }
+        break;
+    case '-':
+        /* unary minus is parsed as 0 - x, so -(-x) is 0 - (0 - x) */
+        if (is_number_value(l, 0.0) && r->type == EXPR_NODE_OPERATOR &&
+            r->data.op_node.op == '-' &&
+            is_number_value(r->data.op_node.left, 0.0)) {
+            ExprNode *x = r->data.op_node.right;
+            exprlib_free(r->data.op_node.left);
+            node_free_shell(r);
+            node_hoist(n, x, l);
+        }
+        break;
+    }
+    return true;
+}
+
+/* A call whose arguments are already optimized */
+static void optimize_call(ExprNode *n) {
+    int argc = n->data.fn_call.argc;
+    for (int i = 0; i < argc; ++i) {
+        if (!is_number(n->data.fn_call.args[i]))
+            return;
+    }
+    if (!(n->data.fn_call.fn_flags & EXPRLIB_FN_PURE))
+        return;
+
+    double *argv = alloca(sizeof(double) * (argc ? argc : 1));
+    for (int i = 0; i < argc; ++i)
+        argv[i] = n->data.fn_call.args[i]->data.number;
+    double value = n->data.fn_call.fn(argv, argc);
+    if (EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
+        /* leave the call for evaluation to report */
+        EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+        return;
+    }
+    node_set_number(n, value);
+}
+
+/* Post-order, so every node is rewritten after its children. */
+static bool optimize_node(ExprNode *expr) {
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    int frame_cap = EXPRLIB_STACK_INLINE, frame_count = 0;
+    bool ok = false;
+
+    frames[frame_count++] = (ExprEvalFrame){expr, 0};
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        ExprNode *n = (ExprNode *)f->node; /* the tree is ours to rewrite */
+        if (f->next < node_child_count(n)) {
+            ExprNode *child = node_child(n, f->next++);
+            if (!child) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+                goto out;
+            }
+            if (!frame_push(&frames, inline_frames, &frame_count, &frame_cap,
+                            child))
+                goto out;
+            continue;
+        }
+        frame_count--;
+        if (n->type == EXPR_NODE_OPERATOR && !optimize_operator(n))
+            goto out;
+        if (n->type == EXPR_NODE_FUNCTION_CALL)
+            optimize_call(n);
+    }
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    return ok;
+}
+
+bool exprlib_optimize(ExprNode *expr) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!expr) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    return optimize_node(expr);
+}
+
+/* Bytecode compilation
+ *
+ * The tree is lowered into a postfix instruction array that is executed by a
+ * small stack machine. Numbers go into the constant pool, variables keep the
+ * ExprContext.variables index resolved by the parser and function calls
+ * become indices into a table of the ExprLibFnPtr bound by the parser,
+ * except for the common built-ins, which have their own opcodes.
+ * exprlib_run therefore never touches a string.
+ */
+
+typedef enum {
+    EXPR_OP_CONST, /* push constants[arg] */
+    EXPR_OP_VAR,   /* push *variables[arg].value */
+    EXPR_OP_ADD,
+    EXPR_OP_SUB,
+    EXPR_OP_MUL,
+    EXPR_OP_DIV,
+    EXPR_OP_POW,
+    EXPR_OP_CALL,  /* pop argc values, push functions[arg](values, argc) */
+    EXPR_OP_STORE, /* temps[arg] = top of stack, without popping */
+    EXPR_OP_LOAD,  /* push temps[arg] */
+    EXPR_OP_DUP,   /* push a copy of the top of the stack */
+    EXPR_OP_RECIP, /* top = 1 / top, without the division-by-zero check */
+    EXPR_OP_SQRT,  /* top = pow(top, 0.5) */
+    EXPR_OP_CBRT,  /* top = pow(top, 1/3) */
+    EXPR_OP_ABS,   /* top = fabs(top) */
+    EXPR_OP_OUTPUT, /* pop into outputs[arg], multi-output programs only */
+    /* built-ins called directly, see compile_builtin */
+    EXPR_OP_SIN,   /* top = sin(top) */
+    EXPR_OP_COS,   /* top = cos(top) */
+    EXPR_OP_EXP,   /* top = exp(top) */
+    EXPR_OP_LN,    /* top = log(top) */
+    EXPR_OP_FSQRT, /* top = sqrt(top), unlike SQRT keeps sqrt(-0) = -0 */
+    EXPR_OP_FLOOR, /* top = floor(top) */
+    EXPR_OP_MIN,   /* pop b, top = b < top ? b : top */
+    EXPR_OP_MAX,   /* pop b, top = b > top ? b : top */
+    EXPR_OP_MEMO   /* as CALL, through the memo cache */
+} ExprOpcode;
+
+typedef struct {
+    uint16_t op;
+    uint16_t argc;
+    int32_t arg;
+} ExprInstr;
+
+struct ExprCompiled {
+    ExprInstr *code;
+    int code_len;
+    double *constants;
+    int const_count;
+    ExprLibFnPtr *functions;
+    ExprLibVecFnPtr *vec_functions; /* parallel to functions, may be NULL */
+    int function_count;
+    int max_stack;
+    int temp_count; /* shared subexpressions, see STORE/LOAD */
+    int var_count;  /* highest variable index used + 1 */
+    atomic_int refs;
+    bool borrowed; /* loaded: code, constants and tables aren't malloc'd */
+};
+
+/* Common subexpression elimination
+ *
+ * Before emitting code, the compiler hash-conses the tree. Each node gets a
+ * class, and structurally equal subtrees share one: same operator or pure
+ * function, same constant bits or variable index, and children in the same
+ * classes. This in effect turns the tree into a DAG.
+ *
+ * Nodes are numbered in pre-order and their subtree sizes recorded, so the
+ * emitter can find a node's class and skip a whole subtree. Uses are counted
+ * in emission order, without descending into an occurrence whose class has
+ * been seen before. A class used more than once is computed at its first
+ * occurrence and kept with STORE. Every later occurrence becomes a single
+ * LOAD of that temp, so every shared subexpression runs once per evaluation.
+ * Calls to functions registered without EXPRLIB_FN_PURE are never shared.
+ */
+
+typedef struct {
+    uint64_t hash;
+    const ExprNode *node; /* first node of the class */
+    int children;         /* offset of the children's classes in child_classes */
+    int uses;
+    int temp; /* -1 until the value has been stored */
+} ExprCseClass;
+
+typedef struct {
+    const ExprNode **nodes; /* pre-order */
+    int *node_class;
+    int *node_size; /* nodes in the subtree, including the node itself */
+    int node_count;
+    ExprCseClass *classes;
+    int class_count;
+    int *child_classes;
+    int child_count;
+    int *table; /* class ids, -1 = empty */
+    size_t table_mask;
+} ExprCse;
+
+/* Nodes in the tree, NULL children not counted; -1 if out of memory */
+static int count_nodes(const ExprNode *expr) {
+    const ExprNode *inline_stack[EXPRLIB_STACK_INLINE];
+    const ExprNode **stack = inline_stack;
+    int cap = EXPRLIB_STACK_INLINE, top = 0, count = 0;
+
+    if (expr)
+        stack[top++] = expr;
+    while (top > 0) {
+        const ExprNode *n = stack[--top];
+        count++;
+        for (int i = 0; i < node_child_count(n); ++i) {
+            const ExprNode *child = node_child(n, i);
+            if (!child)
+                continue;
+            if (top == cap && !stack_grow((void **)&stack, inline_stack, &cap,
+                                          sizeof(*stack))) {
+                count = -1;
+                goto out;
+            }
+            stack[top++] = child;
+        }
+    }
+
+out:
+    stack_release(stack, inline_stack);
+    return count;
+}
+
+static uint64_t cse_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h * 0xff51afd7ed558ccdull;
+}
+
+static bool cse_equal(const ExprCse *cse, const ExprCseClass *cls,
+                      const ExprNode *node, const int *children) {
+    const ExprNode *other = cls->node;
+    if (other->type != node->type)
+        return false;
+
+    int argc = 0;
+    switch (node->type) {
+    case EXPR_NODE_NUMBER:
+        return memcmp(&other->data.number, &node->data.number,
+                      sizeof(double)) == 0;
+    case EXPR_NODE_VARIABLE:
+        return other->data.variable.index == node->data.variable.index;
+    case EXPR_NODE_OPERATOR:
+        if (other->data.op_node.op != node->data.op_node.op)
+            return false;
+        argc = 2;
+        break;
+    case EXPR_NODE_FUNCTION_CALL:
+        if (other->data.fn_call.fn != node->data.fn_call.fn ||
+            other->data.fn_call.vec_fn != node->data.fn_call.vec_fn ||
+            other->data.fn_call.argc != node->data.fn_call.argc)
+            return false;
+        argc = node->data.fn_call.argc;
+        break;
+    }
+    return memcmp(cse->child_classes + cls->children, children,
+                  sizeof(int) * argc) == 0;
+}
+
+typedef struct {
+    const ExprNode *node;
+    int next;     /* children classified so far */
+    int ord;      /* pre-order number */
+    int children; /* offset of the children's classes in child_classes */
+} ExprCseFrame;
+
+/* Number node in pre-order and reserve room for its children's classes. */
+static bool cse_enter(ExprCse *cse, ExprCseFrame **frames,
+                      ExprCseFrame *inline_frames, int *count, int *cap,
+                      const ExprNode *node) {
+    if (!node) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    if (*count == *cap &&
+        !stack_grow((void **)frames, inline_frames, cap, sizeof(**frames)))
+        return false;
+    int ord = cse->node_count++;
+    cse->nodes[ord] = node;
+    (*frames)[(*count)++] =
+        (ExprCseFrame){node, 0, ord, cse->child_count};
+    cse->child_count += node_child_count(node);
+    return true;
+}
+
+/* The class of a node whose children are classified. */
+static int cse_class_of(ExprCse *cse, const ExprNode *node, int ord,
+                        int children) {
+    uint64_t hash = cse_mix(0, (uint64_t)node->type);
+    const int *child_ids = cse->child_classes + children;
+    bool shareable = true;
+
+    switch (node->type) {
+    case EXPR_NODE_NUMBER: {
+        uint64_t bits;
+        memcpy(&bits, &node->data.number, sizeof(bits));
+        hash = cse_mix(hash, bits);
+        break;
+    }
+    case EXPR_NODE_VARIABLE:
+        hash = cse_mix(hash, (uint64_t)node->data.variable.index);
+        break;
+    case EXPR_NODE_OPERATOR:
+        hash = cse_mix(hash, (uint64_t)(unsigned char)node->data.op_node.op);
+        hash = cse_mix(cse_mix(hash, (uint64_t)child_ids[0]),
+                       (uint64_t)child_ids[1]);
+        break;
+    case EXPR_NODE_FUNCTION_CALL:
+        for (int i = 0; i < node->data.fn_call.argc; ++i)
+            hash = cse_mix(hash, (uint64_t)child_ids[i]);
+        hash = cse_mix(hash, (uint64_t)(uintptr_t)node->data.fn_call.fn);
+        shareable = (node->data.fn_call.fn_flags & EXPRLIB_FN_PURE) != 0;
+        break;
+    }
+    cse->node_size[ord] = cse->node_count - ord;
+
+    size_t i = hash & cse->table_mask;
+    if (shareable) {
+        for (; cse->table[i] >= 0; i = (i + 1) & cse->table_mask) {
+            ExprCseClass *cls = &cse->classes[cse->table[i]];
+            if (cls->hash == hash && cse_equal(cse, cls, node, child_ids)) {
+                cse->node_class[ord] = cse->table[i];
+                return cse->table[i];
+            }
+        }
+    }
+
+    int id = cse->class_count++;
+    cse->classes[id] = (ExprCseClass){
+        .hash = hash, .node = node, .children = children, .temp = -1};
+    if (shareable)
+        cse->table[i] = id;
+    cse->node_class[ord] = id;
+    return id;
+}
+
+/* Number the tree in pre-order and give every node its class. */
+static bool cse_classify(ExprCse *cse, const ExprNode *expr) {
+    ExprCseFrame inline_frames[EXPRLIB_STACK_INLINE];
+    ExprCseFrame *frames = inline_frames;
+    int frame_cap = EXPRLIB_STACK_INLINE, frame_count = 0;
+    bool ok = false;
+
+    if (!cse_enter(cse, &frames, inline_frames, &frame_count, &frame_cap,
+                   expr))
+        goto out;
+    while (frame_count > 0) {
+        ExprCseFrame *f = &frames[frame_count - 1];
+        if (f->next < node_child_count(f->node)) {
+            const ExprNode *child = node_child(f->node, f->next++);
+            if (!cse_enter(cse, &frames, inline_frames, &frame_count,
+                           &frame_cap, child))
+                goto out;
+            continue;
+        }
+        int id = cse_class_of(cse, f->node, f->ord, f->children);
+        frame_count--;
+        if (frame_count > 0) {
+            ExprCseFrame *parent = &frames[frame_count - 1];
+            cse->child_classes[parent->children + parent->next - 1] = id;
+        }
+    }
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    return ok;
+}
+
+static void cse_free(ExprCse *cse) {
+    free(cse->nodes);
+    free(cse->node_class);
+    free(cse->node_size);
+    free(cse->classes);
+    free(cse->child_classes);
+    free(cse->table);
+}
+
+/* Classify count trees as one forest, so classes are shared between them. */
+static bool cse_build(ExprCse *cse, const ExprNode *const *exprs, int count) {
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        int nodes = count_nodes(exprs[i]);
+        if (nodes < 0)
+            return false;
+        n += nodes;
+    }
+    if (n == 0)
+        n = 1;
+    size_t capacity = 16;
+    while (capacity < (size_t)n * 2)
+        capacity *= 2;
+
+    *cse = (ExprCse){.table_mask = capacity - 1};
+    cse->nodes = malloc(sizeof(*cse->nodes) * n);
+    cse->node_class = malloc(sizeof(int) * n);
+    cse->node_size = malloc(sizeof(int) * n);
+    cse->classes = malloc(sizeof(ExprCseClass) * n);
+    cse->child_classes = malloc(sizeof(int) * n);
+    cse->table = malloc(sizeof(int) * capacity);
+    if (!cse->nodes || !cse->node_class || !cse->node_size || !cse->classes ||
+        !cse->child_classes || !cse->table) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        cse_free(cse);
+        return false;
+    }
+    memset(cse->table, 0xff, sizeof(int) * capacity);
+
+    for (int i = 0; i < count; ++i) {
+        if (!cse_classify(cse, exprs[i])) {
+            cse_free(cse);
+            return false;
+        }
+    }
+
+    /* count uses the way the emitter will walk the tree */
+    for (int ord = 0; ord < cse->node_count;) {
+        ExprCseClass *cls = &cse->classes[cse->node_class[ord]];
+        ord += cls->uses++ == 0 ? 1 : cse->node_size[ord];
+    }
+    return true;
+}
+
+typedef struct {
+    ExprCompiled *program;
+    int code_cap;
+    int const_cap;
+    int function_cap;
+    int depth;
+    const ExprContext *context;
+    ExprCse cse;
+    int ordinal;    /* pre-order number of the next node to compile */
+    unsigned flags; /* EXPRLIB_COMPILE_* */
+} ExprCompiler;
+
+static bool grow_array(void **array, int *capacity, int needed,
+                       size_t elem_size) {
+    if (needed <= *capacity)
+        return true;
+    int new_cap = *capacity ? *capacity * 2 : 16;
+    while (new_cap < needed)
+        new_cap *= 2;
+    void *tmp = realloc(*array, elem_size * new_cap);
+    if (!tmp) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    *array = tmp;
+    *capacity = new_cap;
+    return true;
+}
+
+static bool compiler_emit(ExprCompiler *c, ExprOpcode op, int arg, int argc,
+                          int stack_effect) {
+    ExprCompiled *p = c->program;
+    if (!grow_array((void **)&p->code, &c->code_cap, p->code_len + 1,
+                    sizeof(ExprInstr)))
+        return false;
+    p->code[p->code_len].op = (uint16_t)op;
+    p->code[p->code_len].argc = (uint16_t)argc;
+    p->code[p->code_len].arg = arg;
+    p->code_len++;
+    c->depth += stack_effect;
+    if (c->depth > p->max_stack)
+        p->max_stack = c->depth;
+    return true;
+}
+
+static int compiler_add_constant(ExprCompiler *c, double value) {
+    ExprCompiled *p = c->program;
+    if (!grow_array((void **)&p->constants, &c->const_cap, p->const_count + 1,
+                    sizeof(double)))
+        return -1;
+    p->constants[p->const_count] = value;
+    return p->const_count++;
+}
+
+static int compiler_add_function(ExprCompiler *c, ExprLibFnPtr fn,
+                                 ExprLibVecFnPtr vec_fn) {
+    ExprCompiled *p = c->program;
+    for (int i = 0; i < p->function_count; ++i) {
+        if (p->functions[i] == fn && p->vec_functions[i] == vec_fn)
+            return i;
+    }
+    int cap = c->function_cap;
+    if (!grow_array((void **)&p->functions, &cap, p->function_count + 1,
+                    sizeof(ExprLibFnPtr)))
+        return -1;
+    if (!grow_array((void **)&p->vec_functions, &c->function_cap,
+                    p->function_count + 1, sizeof(ExprLibVecFnPtr)))
+        return -1;
+    p->functions[p->function_count] = fn;
+    p->vec_functions[p->function_count] = vec_fn;
+    return p->function_count++;
+}
+
+/* Constant exponents
+ *
+ * Unless EXPRLIB_COMPILE_EXACT_POW is given, x^c and pow(x, c) with a
+ * constant c are strength-reduced:
+ * - integer |c| <= EXPRLIB_POW_MAX_EXPONENT becomes a chain of multiplies
+ *   (exponentiation by squaring, with x kept in a temp);
+ * - a half-integer exponent n + 1/2 becomes sqrt(x) * |x|^n, where sqrt
+ *   supplies pow's NaN, zero and infinity results for negative x;
+ * - c = 1/3 becomes cbrt;
+ * - a negative c takes the reciprocal of the result.
+ * The replacements keep pow's results for negative bases, zeros and
+ * infinities, except where the intermediate power of a negative c overflows.
+ * Each multiply and the final reciprocal add up to half an ulp, so results
+ * stay within a few ulps of libm pow. cbrt is the true cube root, while pow
+ * raises to the nearest double to 1/3, so for x far from 1 the two drift
+ * further apart.
+ */
+
+#define EXPRLIB_POW_MAX_EXPONENT 8
+
+/* pow(x, 0.5) and pow(x, 1/3) without calling pow */
+static inline double pow_half(double x) {
+    return x == -INFINITY ? INFINITY : sqrt(x + 0.0);
+}
+
+static inline double pow_third(double x) {
+    if (x < 0.0)
+        return x == -INFINITY ? INFINITY : NAN;
+    return cbrt(x + 0.0);
+}
+
+static bool pow_reducible(const ExprCompiler *c, const ExprNode *exponent) {
+    if ((c->flags & EXPRLIB_COMPILE_EXACT_POW) ||
+        exponent->type != EXPR_NODE_NUMBER)
+        return false;
+    double e = fabs(exponent->data.number);
+    if (e == 1.0 / 3.0)
+        return true;
+    return e > 0.0 && e <= EXPRLIB_POW_MAX_EXPONENT && e * 2 == floor(e * 2);
+}
+
+/* base^exponent with base already on the stack */
+static bool compile_pow_constant(ExprCompiler *c, const ExprNode *exponent) {
+    c->ordinal++; /* the exponent itself is never emitted */
+
+    double e = fabs(exponent->data.number);
+    bool ok = true;
+    if (e == 1.0 / 3.0) {
+        ok = compiler_emit(c, EXPR_OP_CBRT, 0, 0, 0);
+    } else {
+        unsigned n = (unsigned)e;
+        bool half = e != n;
+        if (n == 0) {
+            ok = compiler_emit(c, EXPR_OP_SQRT, 0, 0, 0);
+        } else {
+            int temp = -1;
+            if (half || (n & (n - 1))) {
+                temp = c->program->temp_count++;
+                ok = compiler_emit(c, EXPR_OP_STORE, temp, 0, 0);
+            }
+            if (ok && half) {
+                /* leave sqrt(x) below and continue with |x| */
+                ok = compiler_emit(c, EXPR_OP_SQRT, 0, 0, 0) &&
+                     compiler_emit(c, EXPR_OP_LOAD, temp, 0, 1) &&
+                     compiler_emit(c, EXPR_OP_ABS, 0, 0, 0) &&
+                     compiler_emit(c, EXPR_OP_STORE, temp, 0, 0);
+            }
+
+            int bit = 31;
+            while (!(n >> bit & 1u))
+                bit--;
+            while (ok && --bit >= 0) {
+                ok = compiler_emit(c, EXPR_OP_DUP, 0, 0, 1) &&
+                     compiler_emit(c, EXPR_OP_MUL, 0, 0, -1);
+                if (ok && (n >> bit & 1u))
+                    ok = compiler_emit(c, EXPR_OP_LOAD, temp, 0, 1) &&
+                         compiler_emit(c, EXPR_OP_MUL, 0, 0, -1);
+            }
+            if (ok && half)
+                ok = compiler_emit(c, EXPR_OP_MUL, 0, 0, -1);
+        }
+    }
+    if (ok && exponent->data.number < 0.0)
+        ok = compiler_emit(c, EXPR_OP_RECIP, 0, 0, 0);
+    return ok;
+}
+
+/* The opcode a built-in compiles to, or EXPR_OP_CALL. abs() and pow() have
+ * the same meaning as ABS and POW. */
+static ExprOpcode builtin_opcode(ExprLibFnPtr fn, int argc) {
+    if (argc == 1) {
+        if (fn == fn_sin)
+            return EXPR_OP_SIN;
+        if (fn == fn_cos)
+            return EXPR_OP_COS;
+        if (fn == fn_exp)
+            return EXPR_OP_EXP;
+        if (fn == fn_log)
+            return EXPR_OP_LN;
+        if (fn == fn_sqrt)
+            return EXPR_OP_FSQRT;
+        if (fn == fn_abs)
+            return EXPR_OP_ABS;
+        if (fn == fn_floor)
+            return EXPR_OP_FLOOR;
+    }
+    if (argc == 2 && fn == fn_pow)
+        return EXPR_OP_POW;
+    if (argc >= 1 && fn == fn_min)
+        return EXPR_OP_MIN;
+    if (argc >= 1 && fn == fn_max)
+        return EXPR_OP_MAX;
+    return EXPR_OP_CALL;
+}
+
+/* The built-in a call opcode stands for, the inverse of builtin_opcode. */
+static ExprLibFnPtr builtin_function(ExprOpcode op) {
+    switch (op) {
+    case EXPR_OP_SIN:
+        return fn_sin;
+    case EXPR_OP_COS:
+        return fn_cos;
+    case EXPR_OP_EXP:
+        return fn_exp;
+    case EXPR_OP_LN:
+        return fn_log;
+    case EXPR_OP_FSQRT:
+        return fn_sqrt;
+    case EXPR_OP_ABS:
+        return fn_abs;
+    case EXPR_OP_FLOOR:
+        return fn_floor;
+    case EXPR_OP_POW:
+        return fn_pow;
+    case EXPR_OP_MIN:
+        return fn_min;
+    case EXPR_OP_MAX:
+        return fn_max;
+    default:
+        return NULL;
+    }
+}
+
+/* Compilation walks the tree like evaluation does, emitting each node once
+ * its children are on the stack. A frame records what its node becomes.
+ *
+ * A call to one of the common built-ins skips the function table: no
+ * argument array, no error check, and the JIT and batch runs can inline it.
+ * min and max fold their arguments pairwise, the same order as fn_min. The
+ * instruction that completes the call keeps its argc, which nothing but the
+ * profiler reads: ABS and POW also come from operators, with argc 0. */
+typedef struct {
+    const ExprNode *node;
+    int next;      /* children compiled so far */
+    int count;     /* children to compile */
+    int shared;    /* class to keep in a temp, or -1 */
+    ExprOpcode op; /* CALL/MEMO, a built-in's opcode or the operator's */
+    bool pow;      /* count is 1: the base of a reduced constant power */
+} ExprCompileFrame;
+
+static bool compile_operator(ExprCompileFrame *f, char op) {
+    switch (op) {
+    case '+':
+        f->op = EXPR_OP_ADD;
+        return true;
+    case '-':
+        f->op = EXPR_OP_SUB;
+        return true;
+    case '*':
+        f->op = EXPR_OP_MUL;
+        return true;
+    case '/':
+        f->op = EXPR_OP_DIV;
+        return true;
+    case '^':
+        f->op = EXPR_OP_POW;
+        return true;
+    default:
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return false;
+    }
+}
+
+/* Start on node: a shared subexpression seen before is a LOAD and a leaf is
+ * emitted right away, anything else gets a frame. */
+static bool compile_enter(ExprCompiler *c, ExprCompileFrame **frames,
+                          ExprCompileFrame *inline_frames, int *count,
+                          int *cap, const ExprNode *node) {
+    if (!node) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    ExprCse *cse = &c->cse;
+    int ord = c->ordinal;
+    int id = cse->node_class[ord];
+    ExprCseClass *cls = &cse->classes[id];
+    bool shared = cls->uses > 1 && (node->type == EXPR_NODE_OPERATOR ||
+                                    node->type == EXPR_NODE_FUNCTION_CALL);
+
+    if (shared && cls->temp >= 0) {
+        c->ordinal += cse->node_size[ord];
+        return compiler_emit(c, EXPR_OP_LOAD, cls->temp, 0, 1);
+    }
+    c->ordinal++;
+
+    ExprCompileFrame f = {.node = node, .shared = shared ? id : -1};
+    switch (node->type) {
+    case EXPR_NODE_NUMBER: {
+        int idx = compiler_add_constant(c, node->data.number);
+        return idx >= 0 && compiler_emit(c, EXPR_OP_CONST, idx, 0, 1);
+    }
+
+    case EXPR_NODE_VARIABLE: {
+        int index = node->data.variable.index;
+        int var_count = c->context ? c->context->var_count : 0;
+        if (index < 0 || index >= var_count) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+            return false;
+        }
+        if (index + 1 > c->program->var_count)
+            c->program->var_count = index + 1;
+        return compiler_emit(c, EXPR_OP_VAR, index, 0, 1);
+    }
+
+    case EXPR_NODE_OPERATOR:
+        f.pow = node->data.op_node.op == '^' &&
+                pow_reducible(c, node->data.op_node.right);
+        f.count = f.pow ? 1 : 2;
+        if (!f.pow && !compile_operator(&f, node->data.op_node.op))
+            return false;
+        break;
+
+    case EXPR_NODE_FUNCTION_CALL: {
+        int argc = node->data.fn_call.argc;
+        if (!node->data.fn_call.fn) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_FUNCTION_NOT_FOUND;
+            return false;
+        }
+        if (argc > UINT16_MAX) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
+            return false;
+        }
+        f.pow = node->data.fn_call.fn == fn_pow && argc == 2 &&
+                pow_reducible(c, node->data.fn_call.args[1]);
+        f.count = f.pow ? 1 : argc;
+        f.op = builtin_opcode(node->data.fn_call.fn, argc);
+        if (f.op == EXPR_OP_CALL &&
+            (node->data.fn_call.fn_flags & EXPRLIB_FN_MEMOIZE))
+            f.op = EXPR_OP_MEMO;
+        break;
+    }
+
+    default:
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return false;
+    }
+
+    if (*count == *cap &&
+        !stack_grow((void **)frames, inline_frames, cap, sizeof(**frames)))
+        return false;
+    (*frames)[(*count)++] = f;
+    return true;
+}
+
+/* Emit a frame's node, all of its children being on the stack. */
+static bool compile_leave(ExprCompiler *c, const ExprCompileFrame *f) {
+    const ExprNode *node = f->node;
+    bool ok;
+    if (f->pow) {
+        ok = compile_pow_constant(c, node->type == EXPR_NODE_OPERATOR
+                                         ? node->data.op_node.right
+                                         : node->data.fn_call.args[1]);
+    } else if (node->type == EXPR_NODE_OPERATOR) {
+        ok = compiler_emit(c, f->op, 0, 0, -1);
+    } else if (f->op == EXPR_OP_CALL || f->op == EXPR_OP_MEMO) {
+        int argc = node->data.fn_call.argc;
+        int idx = compiler_add_function(c, node->data.fn_call.fn,
+                                        node->data.fn_call.vec_fn);
+        ok = idx >= 0 && compiler_emit(c, f->op, idx, argc, 1 - argc);
+    } else if (f->op == EXPR_OP_MIN || f->op == EXPR_OP_MAX) {
+        ok = true; /* folded as the arguments went */
+    } else {
+        int argc = node->data.fn_call.argc;
+        ok = compiler_emit(c, f->op, 0, argc, argc == 2 ? -1 : 0);
+    }
+    if (ok && f->shared >= 0) {
+        ExprCseClass *cls = &c->cse.classes[f->shared];
+        cls->temp = c->program->temp_count++;
+        ok = compiler_emit(c, EXPR_OP_STORE, cls->temp, 0, 0);
+    }
+    return ok;
+}
+
+static bool compile_node(ExprCompiler *c, const ExprNode *expr) {
+    ExprCompileFrame inline_frames[EXPRLIB_STACK_INLINE];
+    ExprCompileFrame *frames = inline_frames;
+    int frame_cap = EXPRLIB_STACK_INLINE, frame_count = 0;
+    bool ok = false;
+
+    if (!compile_enter(c, &frames, inline_frames, &frame_count, &frame_cap,
+                       expr))
+        goto out;
+    while (frame_count > 0) {
+        ExprCompileFrame *f = &frames[frame_count - 1];
+        bool fold = f->op == EXPR_OP_MIN || f->op == EXPR_OP_MAX;
+        /* back from argument next - 1: fold it into the ones before */
+        if (fold && f->next > 1 &&
+            !compiler_emit(c, f->op, 0,
+                           f->next == f->count ? f->count : 0, -1))
+            goto out;
+        if (f->next < f->count) {
+            const ExprNode *child = node_child(f->node, f->next++);
+            if (!compile_enter(c, &frames, inline_frames, &frame_count,
+                               &frame_cap, child))
+                goto out;
+            continue;
+        }
+        if (!compile_leave(c, f))
+            goto out;
+        frame_count--;
+    }
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    return ok;
+}
+
+ExprCompiled *exprlib_retain_compiled(ExprCompiled *program) {
+    if (program)
+        atomic_fetch_add_explicit(&program->refs, 1, memory_order_relaxed);
+    return program;
+}
+
+void exprlib_free_compiled(ExprCompiled *program) {
+    if (!program || atomic_fetch_sub_explicit(&program->refs, 1,
+                                              memory_order_acq_rel) != 1)
+        return;
+    if (!program->borrowed) {
+        free(program->code);
+        free(program->constants);
+        free(program->functions);
+        free(program->vec_functions);
+    }
+    free(program);
+}
+
+ExprCompiled *exprlib_compile_ex(const ExprNode *expr,
+                                 const ExprContext *context, unsigned flags) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    ExprCompiled *program = calloc(1, sizeof(*program));
+    if (!program) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    atomic_init(&program->refs, 1);
+
+    ExprCompiler compiler = {
+        .program = program, .context = context, .flags = flags};
+    if (!cse_build(&compiler.cse, &expr, 1)) {
+        exprlib_free_compiled(program);
+        return NULL;
+    }
+    bool ok = compile_node(&compiler, expr);
+    cse_free(&compiler.cse);
+    if (!ok) {
+        exprlib_free_compiled(program);
+        return NULL;
+    }
+    return program;
+}
+
+ExprCompiled *exprlib_compile(const ExprNode *expr,
+                              const ExprContext *context) {
+    return exprlib_compile_ex(expr, context, 0);
+}
+
+/* Stack and temp slots a VM run or a JIT frame may take from the C stack;
+ * bigger programs (a very deep tree) run with them on the heap. */
+#define EXPRLIB_FRAME_SLOTS 8192
+
+/* Runs the program once. OUTPUT instructions pop into outputs; a program
+ * without them returns the value it leaves on the stack. */
+static double vm_exec(const ExprCompiled *program, const ExprContext *context,
+                      double *outputs, double *stack, double *temps) {
+    const ExprLibVariable *vars = context ? context->variables : NULL;
+    const double *constants = program->constants;
+    double *sp = stack; /* points one past the top of the stack */
+    ExprProfile *profile = EXPRLIB_PROFILING ? g_profile : NULL;
+
+    const ExprInstr *ip = program->code;
+    const ExprInstr *end = ip + program->code_len;
+    for (; ip < end; ++ip) {
+        uint64_t start = 0;
+        if (profile) {
+            profile_add(&profile->sites, (uintptr_t)ip, EXPR_SYMBOL_NONE, 0);
+            if (ip->argc || ip->op == EXPR_OP_CALL || ip->op == EXPR_OP_MEMO)
+                start = profile_now();
+        }
+        switch ((ExprOpcode)ip->op) {
+        case EXPR_OP_CONST:
+            *sp++ = constants[ip->arg];
+            break;
+        case EXPR_OP_VAR:
+            *sp++ = *vars[ip->arg].value;
+            break;
+        case EXPR_OP_ADD:
+            sp--;
+            sp[-1] += sp[0];
+            break;
+        case EXPR_OP_SUB:
+            sp--;
+            sp[-1] -= sp[0];
+            break;
+        case EXPR_OP_MUL:
+            sp--;
+            sp[-1] *= sp[0];
+            break;
+        case EXPR_OP_DIV:
+            sp--;
+            if (sp[0] == 0.0) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
+                return 0.0;
+            }
+            sp[-1] /= sp[0];
+            break;
+        case EXPR_OP_POW:
+            sp--;
+            sp[-1] = pow(sp[-1], sp[0]);
+            break;
+        case EXPR_OP_CALL:
+        case EXPR_OP_MEMO: {
+            sp -= ip->argc;
+            ExprLibFnPtr fn = program->functions[ip->arg];
+            *sp = ip->op == EXPR_OP_MEMO ? memo_call(sp, ip->argc, fn)
+                                         : fn(sp, ip->argc);
+            if (profile)
+                profile_call(profile, fn, EXPR_SYMBOL_NONE, start);
+            sp++;
+            if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+                return 0.0;
+            continue;
+        }
+        case EXPR_OP_STORE:
+            temps[ip->arg] = sp[-1];
+            break;
+        case EXPR_OP_LOAD:
+            *sp++ = temps[ip->arg];
+            break;
+        case EXPR_OP_DUP:
+            *sp = sp[-1];
+            sp++;
+            break;
+        case EXPR_OP_RECIP:
+            sp[-1] = 1.0 / sp[-1];
+            break;
+        case EXPR_OP_SQRT:
+            sp[-1] = pow_half(sp[-1]);
+            break;
+        case EXPR_OP_CBRT:
+            sp[-1] = pow_third(sp[-1]);
+            break;
+        case EXPR_OP_ABS:
+            sp[-1] = fabs(sp[-1]);
+            break;
+        case EXPR_OP_OUTPUT:
+            outputs[ip->arg] = *--sp;
+            break;
+        case EXPR_OP_SIN:
+            sp[-1] = sin(sp[-1]);
+            break;
+        case EXPR_OP_COS:
+            sp[-1] = cos(sp[-1]);
+            break;
+        case EXPR_OP_EXP:
+            sp[-1] = exp(sp[-1]);
+            break;
+        case EXPR_OP_LN:
+            sp[-1] = log(sp[-1]);
+            break;
+        case EXPR_OP_FSQRT:
+            sp[-1] = sqrt(sp[-1]);
+            break;
+        case EXPR_OP_FLOOR:
+            sp[-1] = floor(sp[-1]);
+            break;
+        case EXPR_OP_MIN:
+            sp--;
+            if (sp[0] < sp[-1])
+                sp[-1] = sp[0];
+            break;
+        case EXPR_OP_MAX:
+            sp--;
+            if (sp[0] > sp[-1])
+                sp[-1] = sp[0];
+            break;
+        }
+        /* the built-in opcodes with an argc complete a call */
+        if (profile && ip->argc) {
+            ExprLibFnPtr fn = builtin_function((ExprOpcode)ip->op);
+            if (fn)
+                profile_call(profile, fn, EXPR_SYMBOL_NONE, start);
+        }
+    }
+    return sp > stack ? sp[-1] : 0.0;
+}
+
+static double vm_run(const ExprCompiled *program, const ExprContext *context,
+                     double *outputs) {
+    size_t slots = (size_t)program->max_stack + program->temp_count + 1;
+    if (slots <= EXPRLIB_FRAME_SLOTS) {
+        double *stack = alloca(sizeof(double) * slots);
+        return vm_exec(program, context, outputs, stack,
+                       stack + program->max_stack);
+    }
+    double *stack = malloc(sizeof(double) * slots);
+    if (!stack) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return 0.0;
+    }
+    double result =
+        vm_exec(program, context, outputs, stack, stack + program->max_stack);
+    free(stack);
+    return result;
+}
+
+double exprlib_run(const ExprCompiled *program, const ExprContext *context) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return 0.0;
+    }
+    if (program->var_count > (context ? context->var_count : 0)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+        return 0.0;
+    }
+    return vm_run(program, context, NULL);
+}
+
+/* Batch evaluation
+ *
+ * The program is executed over blocks of EXPRLIB_BATCH_BLOCK rows at a time.
+ * Every stack slot owns a scratch block; a slot either points at its scratch
+ * block or directly into a caller column, so variables are never copied.
+ * Each instruction then becomes a plain loop over the block that the compiler
+ * can vectorize, and instruction dispatch is paid once per block instead of
+ * once per row.
+ */
+
+#define EXPRLIB_BATCH_BLOCK 256
+
+static void batch_fill(double *out, double value, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = value;
+}
+
+static void batch_add(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] + b[i];
+}
+
+static void batch_sub(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] - b[i];
+}
+
+static void batch_mul(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] * b[i];
+}
+
+/* Returns false if any divisor is zero. */
+static bool batch_div(double *out, const double *a, const double *b, size_t n) {
+    int zero = 0;
+    for (size_t i = 0; i < n; ++i) {
+        zero |= b[i] == 0.0;
+        out[i] = a[i] / b[i];
+    }
+    return !zero;
+}
+
+static void batch_pow(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = pow(a[i], b[i]);
+}
+
+static void batch_recip(double *out, const double *a, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = 1.0 / a[i];
+}
+
+static void batch_pow_half(double *out, const double *a, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = pow_half(a[i]);
+}
+
+static void batch_pow_third(double *out, const double *a, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = pow_third(a[i]);
+}
+
+static void batch_abs(double *out, const double *a, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = fabs(a[i]);
+}
+
+static void batch_min(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = b[i] < a[i] ? b[i] : a[i];
+}
+
+static void batch_max(double *out, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = b[i] > a[i] ? b[i] : a[i];
+}
+
+/* The unary built-in opcodes, through the same kernels as their CALL. */
+static void batch_builtin(double *out, ExprOpcode op, const double *a,
+                          size_t n) {
+    ExprLibVecFnPtr vec_fn = NULL;
+    double (*fn)(double) = NULL;
+    switch (op) {
+    case EXPR_OP_SIN:
+        vec_fn = VFN_SIN;
+        fn = sin;
+        break;
+    case EXPR_OP_COS:
+        vec_fn = VFN_COS;
+        fn = cos;
+        break;
+    case EXPR_OP_EXP:
+        vec_fn = VFN_EXP;
+        fn = exp;
+        break;
+    case EXPR_OP_LN:
+        vec_fn = VFN_LOG;
+        fn = log;
+        break;
+    case EXPR_OP_FSQRT:
+        vec_fn = vfn_sqrt;
+        break;
+    default:
+        vec_fn = VFN_FLOOR;
+        fn = floor;
+        break;
+    }
+    if (vec_fn) {
+        vec_fn(&a, 1, n, out);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        out[i] = fn(a[i]);
+}
+
+static void batch_call(double *out, ExprLibFnPtr fn, const double *const *args,
+                       int argc, size_t n, bool memo) {
+    double *argv = alloca(sizeof(double) * (argc ? argc : 1));
+    for (size_t i = 0; i < n; ++i) {
+        for (int k = 0; k < argc; ++k)
+            argv[k] = args[k][i];
+        out[i] = memo ? memo_call(argv, argc, fn) : fn(argv, argc);
+    }
+}
+
+/* Run rows [begin, end) block by block. scratch holds max_stack + temp_count
+ * blocks and slots max_stack pointers; both are owned by the caller so that a
+ * worker can reuse them across every range it processes. The result goes to
+ * out, or for a multi-output program, output i to outs[i]. */
+static bool batch_run_rows(const ExprCompiled *program,
+                           const ExprContext *context,
+                           const double *const *columns, size_t begin,
+                           size_t end, double *out, double *const *outs,
+                           double *scratch, const double **slots) {
+    const ExprLibVariable *vars = context ? context->variables : NULL;
+    double *temps = scratch + (size_t)program->max_stack * EXPRLIB_BATCH_BLOCK;
+    bool ok = true;
+
+    for (size_t base = begin; base < end && ok; base += EXPRLIB_BATCH_BLOCK) {
+        size_t len = end - base < EXPRLIB_BATCH_BLOCK ? end - base
+                                                       : EXPRLIB_BATCH_BLOCK;
+        int sp = 0; /* number of live slots */
+
+        const ExprInstr *ip = program->code;
+        const ExprInstr *code_end = ip + program->code_len;
+        for (; ip < code_end && ok; ++ip) {
+            double *dst;
+            switch ((ExprOpcode)ip->op) {
+            case EXPR_OP_CONST:
+                dst = scratch + (size_t)sp * EXPRLIB_BATCH_BLOCK;
+                batch_fill(dst, program->constants[ip->arg], len);
+                slots[sp++] = dst;
+                break;
+            case EXPR_OP_VAR:
+                if (columns && columns[ip->arg]) {
+                    slots[sp++] = columns[ip->arg] + base;
+                } else {
+                    dst = scratch + (size_t)sp * EXPRLIB_BATCH_BLOCK;
+                    batch_fill(dst, *vars[ip->arg].value, len);
+                    slots[sp++] = dst;
+                }
+                break;
+            case EXPR_OP_ADD:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_add(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_SUB:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_sub(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_MUL:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_mul(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_DIV:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                if (!batch_div(dst, slots[sp - 2], slots[sp - 1], len)) {
+                    EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
+                    ok = false;
+                }
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_POW:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_pow(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_CALL:
+            case EXPR_OP_MEMO: {
+                int argc = ip->argc;
+                sp -= argc;
+                dst = scratch + (size_t)sp * EXPRLIB_BATCH_BLOCK;
+                ExprLibVecFnPtr vec_fn = program->vec_functions[ip->arg];
+                if (vec_fn)
+                    vec_fn(slots + sp, argc, len, dst);
+                else
+                    batch_call(dst, program->functions[ip->arg], slots + sp,
+                               argc, len, ip->op == EXPR_OP_MEMO);
+                slots[sp++] = dst;
+                if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+                    ok = false;
+                break;
+            }
+            case EXPR_OP_STORE:
+                dst = temps + (size_t)ip->arg * EXPRLIB_BATCH_BLOCK;
+                memcpy(dst, slots[sp - 1], sizeof(double) * len);
+                break;
+            case EXPR_OP_LOAD:
+                slots[sp++] = temps + (size_t)ip->arg * EXPRLIB_BATCH_BLOCK;
+                break;
+            case EXPR_OP_DUP:
+                /* a slot's block is only written once every slot above it
+                 * has been popped, so the copy can share the pointer */
+                slots[sp] = slots[sp - 1];
+                sp++;
+                break;
+            case EXPR_OP_RECIP:
+                dst = scratch + (size_t)(sp - 1) * EXPRLIB_BATCH_BLOCK;
+                batch_recip(dst, slots[sp - 1], len);
+                slots[sp - 1] = dst;
+                break;
+            case EXPR_OP_SQRT:
+                dst = scratch + (size_t)(sp - 1) * EXPRLIB_BATCH_BLOCK;
+                batch_pow_half(dst, slots[sp - 1], len);
+                slots[sp - 1] = dst;
+                break;
+            case EXPR_OP_CBRT:
+                dst = scratch + (size_t)(sp - 1) * EXPRLIB_BATCH_BLOCK;
+                batch_pow_third(dst, slots[sp - 1], len);
+                slots[sp - 1] = dst;
+                break;
+            case EXPR_OP_ABS:
+                dst = scratch + (size_t)(sp - 1) * EXPRLIB_BATCH_BLOCK;
+                batch_abs(dst, slots[sp - 1], len);
+                slots[sp - 1] = dst;
+                break;
+            case EXPR_OP_OUTPUT:
+                memcpy(outs[ip->arg] + base, slots[--sp],
+                       sizeof(double) * len);
+                break;
+            case EXPR_OP_SIN:
+            case EXPR_OP_COS:
+            case EXPR_OP_EXP:
+            case EXPR_OP_LN:
+            case EXPR_OP_FSQRT:
+            case EXPR_OP_FLOOR:
+                dst = scratch + (size_t)(sp - 1) * EXPRLIB_BATCH_BLOCK;
+                batch_builtin(dst, (ExprOpcode)ip->op, slots[sp - 1], len);
+                slots[sp - 1] = dst;
+                break;
+            case EXPR_OP_MIN:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_min(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            case EXPR_OP_MAX:
+                dst = scratch + (size_t)(sp - 2) * EXPRLIB_BATCH_BLOCK;
+                batch_max(dst, slots[sp - 2], slots[sp - 1], len);
+                slots[--sp - 1] = dst;
+                break;
+            }
+        }
+
+        if (ok && out)
+            memcpy(out + base, slots[0], sizeof(double) * len);
+    }
+
+    return ok;
+}
+
+static bool batch_check(const ExprCompiled *program, const ExprContext *context,
+                        double *out) {
+    if (!program || !out) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    if (program->var_count > (context ? context->var_count : 0)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+        return false;
+    }
+    return true;
+}
+
+/* scratch holds one block per stack slot followed by one per temp */
+static bool batch_alloc(const ExprCompiled *program, double **scratch,
+                        const double ***slots) {
+    int depth = program->max_stack;
+    *scratch = malloc(sizeof(double) * EXPRLIB_BATCH_BLOCK *
+                      (depth + program->temp_count));
+    *slots = malloc(sizeof(double *) * depth);
+    if (!*scratch || !*slots) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        free(*scratch);
+        free(*slots);
+        return false;
+    }
+    return true;
+}
+
+bool exprlib_run_batch(const ExprCompiled *program, const ExprContext *context,
+                       const double *const *columns, size_t n, double *out) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!batch_check(program, context, out))
+        return false;
+
+    double *scratch;
+    const double **slots;
+    if (!batch_alloc(program, &scratch, &slots))
+        return false;
+
+    bool ok = batch_run_rows(program, context, columns, 0, n, out, NULL,
+                             scratch, slots);
+
+    free(scratch);
+    free(slots);
+    return ok;
+}
+
+bool exprlib_evaluate_batch(const ExprNode *expr, const ExprContext *context,
+                            const double *const *columns, size_t n,
+                            double *out) {
+    ExprCompiled *program = exprlib_compile(expr, context);
+    if (!program)
+        return false;
+    bool ok = exprlib_run_batch(program, context, columns, n, out);
+    exprlib_free_compiled(program);
+    return ok;
+}
+
+/* Thread pool and parallel batch evaluation
+ *
+ * A pool runs one job at a time: the submitting thread bumps the generation,
+ * wakes every worker and then runs the job itself, so a pool created with N
+ * threads keeps N - 1 workers plus the caller busy. The batch job splits the
+ * rows into chunks of whole blocks that threads claim from a shared atomic
+ * cursor, so a thread that lands on cheap rows simply comes back for more
+ * while one stuck on expensive rows (factorial, pow, ...) keeps its chunk.
+ */
+
+struct ExprThreadPool {
+    pthread_t *threads;
+    int thread_count; /* workers, not counting the submitting thread */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_mutex_t submit; /* serializes jobs from different callers */
+    unsigned long generation;
+    int active; /* workers still running the current job */
+    bool shutdown;
+    void (*job)(void *);
+    void *job_arg;
+};
+
+static void *pool_worker(void *arg) {
+    ExprThreadPool *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        void (*job)(void *) = pool->job;
+        void *job_arg = pool->job_arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(job_arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_run(ExprThreadPool *pool, void (*job)(void *), void *arg) {
+    pthread_mutex_lock(&pool->submit);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->job_arg = arg;
+    pool->active = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(arg);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->submit);
+}
+
+ExprThreadPool *exprlib_pool_create(int threads) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    ExprThreadPool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if (threads > 1) {
+        pool->threads = malloc(sizeof(pthread_t) * (threads - 1));
+        if (!pool->threads) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            exprlib_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < threads - 1; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            exprlib_pool_destroy(pool);
+            return NULL;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+void exprlib_pool_destroy(ExprThreadPool *pool) {
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/* Aim for this many chunks per thread so uneven rows even out */
+#define EXPRLIB_CHUNKS_PER_THREAD 8
+
+typedef struct {
+    const ExprCompiled *program;
+    const ExprContext *context;
+    const double *const *columns;
+    double *out;
+    double *const *outs; /* multi-output programs instead of out */
+    size_t n;
+    size_t chunk;
+    atomic_size_t next;  /* first row not yet claimed */
+    atomic_int error;    /* first failure, EXPRLIB_SUCCESS while none */
+} ExprBatchJob;
+
+static void batch_fail(ExprBatchJob *job, ExprLibError error) {
+    int expected = EXPRLIB_SUCCESS;
+    atomic_compare_exchange_strong(&job->error, &expected, (int)error);
+}
+
+static void batch_job(void *arg) {
+    ExprBatchJob *job = arg;
+    double *scratch;
+    const double **slots;
+
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!batch_alloc(job->program, &scratch, &slots)) {
+        batch_fail(job, EXPRLIB_ERROR);
+        return;
+    }
+
+    while (atomic_load_explicit(&job->error, memory_order_relaxed) ==
+           EXPRLIB_SUCCESS) {
+        size_t begin = atomic_fetch_add_explicit(&job->next, job->chunk,
+                                                 memory_order_relaxed);
+        if (begin >= job->n)
+            break;
+        size_t end = job->n - begin < job->chunk ? job->n : begin + job->chunk;
+        if (!batch_run_rows(job->program, job->context, job->columns, begin,
+                            end, job->out, job->outs, scratch, slots)) {
+            batch_fail(job, EXPRLIB_ERROR);
+            break;
+        }
+    }
+
+    free(scratch);
+    free(slots);
+}
+
+/* Splits [0, n) over the pool; the program and outputs are checked. */
+static bool batch_parallel(const ExprCompiled *program,
+                           const ExprContext *context,
+                           const double *const *columns, size_t n,
+                           double *out, double *const *outs,
+                           ExprThreadPool *pool) {
+    size_t threads = (size_t)pool->thread_count + 1;
+    size_t blocks = (n + EXPRLIB_BATCH_BLOCK - 1) / EXPRLIB_BATCH_BLOCK;
+    size_t chunk_blocks = blocks / (threads * EXPRLIB_CHUNKS_PER_THREAD);
+
+    ExprBatchJob job = {
+        .program = program,
+        .context = context,
+        .columns = columns,
+        .out = out,
+        .outs = outs,
+        .n = n,
+        .chunk = (chunk_blocks ? chunk_blocks : 1) * EXPRLIB_BATCH_BLOCK,
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.error, EXPRLIB_SUCCESS);
+
+    pool_run(pool, batch_job, &job);
+
+    EXPRLIB_ERROR = (ExprLibError)atomic_load(&job.error);
+    return EXPRLIB_ERROR == EXPRLIB_SUCCESS;
+}
+
+bool exprlib_run_batch_parallel(const ExprCompiled *program,
+                                const ExprContext *context,
+                                const double *const *columns, size_t n,
+                                double *out, ExprThreadPool *pool) {
+    if (!pool || pool->thread_count == 0 || n <= EXPRLIB_BATCH_BLOCK)
+        return exprlib_run_batch(program, context, columns, n, out);
+
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!batch_check(program, context, out))
+        return false;
+    return batch_parallel(program, context, columns, n, out, NULL, pool);
+}
+
+bool exprlib_evaluate_batch_parallel(const ExprNode *expr,
+                                     const ExprContext *context,
+                                     const double *const *columns, size_t n,
+                                     double *out, ExprThreadPool *pool) {
+    ExprCompiled *program = exprlib_compile(expr, context);
+    if (!program)
+        return false;
+    bool ok =
+        exprlib_run_batch_parallel(program, context, columns, n, out, pool);
+    exprlib_free_compiled(program);
+    return ok;
+}
+
+/* Multi-output programs
+ *
+ * The trees are compiled one after another into a single bytecode program,
+ * each followed by an OUTPUT instruction that pops its value into the output
+ * array. CSE classifies all of them as one forest, so a subexpression that
+ * appears in several trees is stored to a temp by the first and loaded by the
+ * rest. The stack is empty between trees, so max_stack stays that of the
+ * deepest tree rather than growing with the number of outputs.
+ */
+
+struct ExprProgram {
+    ExprCompiled *compiled;
+    int output_count;
+};
+
+ExprProgram *exprlib_program_compile(const ExprNode *const *exprs, int count,
+                                     const ExprContext *context,
+                                     unsigned flags) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!exprs) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    if (count <= 0) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+    ExprProgram *program = calloc(1, sizeof(*program));
+    ExprCompiled *compiled = calloc(1, sizeof(*compiled));
+    if (!program || !compiled) {
+        free(program);
+        free(compiled);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    atomic_init(&compiled->refs, 1);
+    program->compiled = compiled;
+    program->output_count = count;
+
+    ExprCompiler compiler = {
+        .program = compiled, .context = context, .flags = flags};
+    if (!cse_build(&compiler.cse, exprs, count)) {
+        exprlib_program_free(program);
+        return NULL;
+    }
+    bool ok = true;
+    for (int i = 0; ok && i < count; ++i) {
+        ok = compile_node(&compiler, exprs[i]) &&
+             compiler_emit(&compiler, EXPR_OP_OUTPUT, i, 0, -1);
+    }
+    cse_free(&compiler.cse);
+    if (!ok) {
+        exprlib_program_free(program);
+        return NULL;
+    }
+    return program;
+}
+
+int exprlib_program_outputs(const ExprProgram *program) {
+    return program ? program->output_count : 0;
+}
+
+bool exprlib_program_run(const ExprProgram *program,
+                         const ExprContext *context, double *out) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program || !out) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    if (program->compiled->var_count > (context ? context->var_count : 0)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+        return false;
+    }
+    vm_run(program->compiled, context, out);
+    return EXPRLIB_ERROR == EXPRLIB_SUCCESS;
+}
+
+static bool program_batch_check(const ExprProgram *program,
+                                const ExprContext *context,
+                                double *const *outs) {
+    if (!program || !outs) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    for (int i = 0; i < program->output_count; ++i) {
+        if (!outs[i]) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+            return false;
+        }
+    }
+    if (program->compiled->var_count > (context ? context->var_count : 0)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+        return false;
+    }
+    return true;
+}
+
+bool exprlib_program_run_batch(const ExprProgram *program,
+                               const ExprContext *context,
+                               const double *const *columns, size_t n,
+                               double *const *outs) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program_batch_check(program, context, outs))
+        return false;
+
+    const ExprCompiled *compiled = program->compiled;
+    double *scratch;
+    const double **slots;
+    if (!batch_alloc(compiled, &scratch, &slots))
+        return false;
+    bool ok = batch_run_rows(compiled, context, columns, 0, n, NULL, outs,
+                             scratch, slots);
+    free(scratch);
+    free(slots);
+    return ok;
+}
+
+bool exprlib_program_run_batch_parallel(const ExprProgram *program,
+                                        const ExprContext *context,
+                                        const double *const *columns,
+                                        size_t n, double *const *outs,
+                                        ExprThreadPool *pool) {
+    if (!pool || pool->thread_count == 0 || n <= EXPRLIB_BATCH_BLOCK)
+        return exprlib_program_run_batch(program, context, columns, n, outs);
+
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program_batch_check(program, context, outs))
+        return false;
+    return batch_parallel(program->compiled, context, columns, n, NULL, outs,
+                          pool);
+}
+
+void exprlib_program_free(ExprProgram *program) {
+    if (!program)
+        return;
+    exprlib_free_compiled(program->compiled);
+    free(program);
+}
+
+/* Native code generation
+ *
+ * exprlib_jit_compile translates a compiled program into a function that
+ * takes the variable values in context order. The x86-64 backend keeps the
+ * evaluation stack in registers: slot i lives in xmm<i> for the first
+ * EXPRLIB_JIT_SLOT_REGS slots and in a frame home [rbp + 8i] above that, with
+ * xmm14/xmm15 as scratch. Constants, variables and temps are pushed lazily as
+ * memory operands, so `x * 2` becomes a single mulsd against the constant
+ * pool. The pool sits at the start of the mapping and is addressed
+ * RIP-relative. Every xmm register is caller-saved, so a call first spills
+ * the live slots to their homes, which also makes the arguments of an
+ * ExprLibFnPtr call a contiguous array that is passed in place.
+ *
+ * rbx holds the variable array, rbp the frame and r12 a pointer to the
+ * calling thread's EXPRLIB_ERROR, fetched once on entry when the program can
+ * fail. The code is written to a plain buffer, copied to a fresh mapping and
+ * only then made executable, so no page is ever writable and executable at
+ * the same time. Any other host, or one that refuses executable mappings,
+ * runs the program on the interpreter instead. Other backends can be added
+ * behind EXPRLIB_JIT_NATIVE by implementing jit_translate.
+ */
+
+#if !defined(EXPRLIB_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define EXPRLIB_JIT_NATIVE 1
+#else
+#define EXPRLIB_JIT_NATIVE 0
+#endif
+
+struct ExprJit {
+    const ExprCompiled *program; /* interpreter fallback */
+    ExprJitFn fn;                /* NULL when running on the interpreter */
+    void *code;
+    size_t code_size;
+};
+
+#if EXPRLIB_JIT_NATIVE
+
+#define EXPRLIB_JIT_SLOT_REGS 14
+#define JIT_XMM_SCRATCH 14
+#define JIT_XMM_SCRATCH2 15
+
+typedef enum {
+    JIT_LOC_REG,   /* xmm<index> */
+    JIT_LOC_FRAME, /* [rbp + index] */
+    JIT_LOC_VAR,   /* [rbx + index] */
+    JIT_LOC_CONST  /* [rip -> pool + index] */
+} ExprJitLocKind;
+
+typedef struct {
+    ExprJitLocKind kind;
+    int32_t index;
+} ExprJitLoc;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+    const ExprCompiled *program;
+    ExprJitLoc *stack;
+    int depth;
+    size_t pool_one, pool_zero, pool_minus_inf, pool_inf, pool_abs_mask;
+    size_t pool_constants;
+    size_t *fail_jumps; /* rel32 fields to patch with the failure path */
+    int fail_count;
+    int fail_cap;
+    size_t *divzero_jumps;
+    int divzero_count;
+    int divzero_cap;
+} ExprJitAsm;
+
+static void jit_reserve(ExprJitAsm *a, size_t n) {
+    if (a->failed || a->len + n <= a->cap)
+        return;
+    size_t cap = a->cap ? a->cap * 2 : 1024;
+    while (cap < a->len + n)
+        cap *= 2;
+    uint8_t *tmp = realloc(a->buf, cap);
+    if (!tmp) {
+        a->failed = true;
+        return;
+    }
+    a->buf = tmp;
+    a->cap = cap;
+}
+
+static void jit_bytes(ExprJitAsm *a, const void *bytes, size_t n) {
+    jit_reserve(a, n);
+    if (a->failed)
+        return;
+    memcpy(a->buf + a->len, bytes, n);
+    a->len += n;
+}
+
+static void jit_u8(ExprJitAsm *a, uint8_t v) { jit_bytes(a, &v, 1); }
+
+static void jit_u32(ExprJitAsm *a, uint32_t v) { jit_bytes(a, &v, 4); }
+
+static void jit_u64(ExprJitAsm *a, uint64_t v) { jit_bytes(a, &v, 8); }
+
+static void jit_patch32(ExprJitAsm *a, size_t at, int32_t v) {
+    if (!a->failed)
+        memcpy(a->buf + at, &v, 4);
+}
+
+static void jit_align(ExprJitAsm *a, size_t align) {
+    while (!a->failed && a->len % align)
+        jit_u8(a, 0xCC);
+}
+
+static size_t jit_pool_double(ExprJitAsm *a, double v) {
+    size_t at = a->len;
+    jit_bytes(a, &v, sizeof(v));
+    return at;
+}
+
+static bool jit_same_loc(ExprJitLoc x, ExprJitLoc y) {
+    return x.kind == y.kind && x.index == y.index;
+}
+
+/* prefix [REX] 0F opcode modrm, with reg an xmm register and rm a location */
+static void jit_sse(ExprJitAsm *a, uint8_t prefix, uint8_t opcode, int reg,
+                    ExprJitLoc rm) {
+    uint8_t rex = 0x40;
+    if (reg >= 8)
+        rex |= 0x4; /* REX.R */
+    if (rm.kind == JIT_LOC_REG && rm.index >= 8)
+        rex |= 0x1; /* REX.B */
+    if (prefix)
+        jit_u8(a, prefix);
+    if (rex != 0x40)
+        jit_u8(a, rex);
+    jit_u8(a, 0x0F);
+    jit_u8(a, opcode);
+
+    uint8_t r = (uint8_t)((reg & 7) << 3);
+    switch (rm.kind) {
+    case JIT_LOC_REG:
+        jit_u8(a, 0xC0 | r | (rm.index & 7));
+        break;
+    case JIT_LOC_FRAME:
+    case JIT_LOC_VAR: {
+        uint8_t base = rm.kind == JIT_LOC_FRAME ? 5 : 3; /* rbp : rbx */
+        if (rm.index >= -128 && rm.index <= 127) {
+            jit_u8(a, 0x40 | r | base);
+            jit_u8(a, (uint8_t)rm.index);
+        } else {
+            jit_u8(a, 0x80 | r | base);
+            jit_u32(a, (uint32_t)rm.index);
+        }
+        break;
+    }
+    case JIT_LOC_CONST:
+        /* the displacement ends the instruction */
+        jit_u8(a, 0x05 | r);
+        jit_u32(a, (uint32_t)(rm.index - (int32_t)(a->len + 4)));
+        break;
+    }
+}
+
+static ExprJitLoc jit_reg(int reg) { return (ExprJitLoc){JIT_LOC_REG, reg}; }
+
+static ExprJitLoc jit_const(size_t at) {
+    return (ExprJitLoc){JIT_LOC_CONST, (int32_t)at};
+}
+
+static ExprJitLoc jit_home(int slot) {
+    return (ExprJitLoc){JIT_LOC_FRAME, slot * 8};
+}
+
+static ExprJitLoc jit_temp_loc(const ExprJitAsm *a, int temp) {
+    return jit_home(a->program->max_stack + temp);
+}
+
+static void jit_load(ExprJitAsm *a, int reg, ExprJitLoc src) {
+    if (src.kind == JIT_LOC_REG) {
+        if (src.index != reg)
+            jit_sse(a, 0x66, 0x28, reg, src); /* movapd */
+    } else {
+        jit_sse(a, 0xF2, 0x10, reg, src); /* movsd xmm, m64 */
+    }
+}
+
+static void jit_store(ExprJitAsm *a, ExprJitLoc dst, int reg) {
+    jit_sse(a, 0xF2, 0x11, reg, dst); /* movsd m64, xmm */
+}
+
+/* Register to compute slot i into; finish with jit_slot_done. */
+static int jit_slot_begin(ExprJitAsm *a, int slot) {
+    int reg = slot < EXPRLIB_JIT_SLOT_REGS ? slot : JIT_XMM_SCRATCH;
+    jit_load(a, reg, a->stack[slot]);
+    return reg;
+}
+
+static void jit_slot_done(ExprJitAsm *a, int slot, int reg) {
+    if (slot < EXPRLIB_JIT_SLOT_REGS) {
+        a->stack[slot] = jit_reg(slot);
+    } else {
+        jit_store(a, jit_home(slot), reg);
+        a->stack[slot] = jit_home(slot);
+    }
+}
+
+/* Save the register slots below `below` before a call clobbers them. */
+static void jit_spill(ExprJitAsm *a, int below) {
+    for (int i = 0; i < below; ++i) {
+        if (a->stack[i].kind == JIT_LOC_REG) {
+            jit_store(a, jit_home(i), i);
+            a->stack[i] = jit_home(i);
+        }
+    }
+}
+
+static void jit_push(ExprJitAsm *a, ExprJitLoc loc) {
+    a->stack[a->depth++] = loc;
+}
+
+static void jit_call(ExprJitAsm *a, uint64_t target) {
+    jit_u8(a, 0x48); /* movabs rax, target */
+    jit_u8(a, 0xB8);
+    jit_u64(a, target);
+    jit_u8(a, 0xFF); /* call rax */
+    jit_u8(a, 0xD0);
+}
+
+/* Result of a call (in xmm0) becomes slot i. */
+static void jit_call_result(ExprJitAsm *a, int slot) {
+    if (slot < EXPRLIB_JIT_SLOT_REGS) {
+        jit_load(a, slot, jit_reg(0));
+        a->stack[slot] = jit_reg(slot);
+    } else {
+        jit_store(a, jit_home(slot), 0);
+        a->stack[slot] = jit_home(slot);
+    }
+}
+
+static void jit_jump_list(ExprJitAsm *a, size_t **list, int *count, int *cap,
+                          uint8_t cc) {
+    if (!grow_array((void **)list, cap, *count + 1, sizeof(size_t))) {
+        a->failed = true;
+        return;
+    }
+    jit_u8(a, 0x0F); /* jcc rel32 */
+    jit_u8(a, cc);
+    (*list)[(*count)++] = a->len;
+    jit_u32(a, 0);
+}
+
+static void jit_patch_list(ExprJitAsm *a, const size_t *list, int count) {
+    for (int i = 0; i < count; ++i)
+        jit_patch32(a, list[i], (int32_t)(a->len - (list[i] + 4)));
+}
+
+/* Short forward branch; returns the rel8 field to patch with jit_land. */
+static size_t jit_jcc8(ExprJitAsm *a, uint8_t cc) {
+    jit_u8(a, cc);
+    jit_u8(a, 0);
+    return a->len - 1;
+}
+
+static void jit_land(ExprJitAsm *a, size_t at) {
+    if (!a->failed)
+        a->buf[at] = (uint8_t)(a->len - (at + 1));
+}
+
+static ExprLibError *jit_error_enter(void) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    return &EXPRLIB_ERROR;
+}
+
+static double jit_pow_third(double x) { return pow_third(x); }
+
+static bool jit_can_fail(const ExprCompiled *program) {
+    for (int i = 0; i < program->code_len; ++i) {
+        const ExprInstr *ins = &program->code[i];
+        if (ins->op == EXPR_OP_CALL || ins->op == EXPR_OP_MEMO)
+            return true;
+        if (ins->op == EXPR_OP_DIV &&
+            (i == 0 || ins[-1].op != EXPR_OP_CONST ||
+             program->constants[ins[-1].arg] == 0.0))
+            return true;
+    }
+    return false;
+}
+
+static void jit_binary(ExprJitAsm *a, uint8_t opcode) {
+    int lhs = a->depth - 2;
+    int reg = jit_slot_begin(a, lhs);
+    jit_sse(a, 0xF2, opcode, reg, a->stack[lhs + 1]);
+    jit_slot_done(a, lhs, reg);
+    a->depth--;
+}
+
+static void jit_divide(ExprJitAsm *a) {
+    ExprJitLoc divisor = a->stack[a->depth - 1];
+    double value = 0.0;
+    if (divisor.kind == JIT_LOC_CONST && !a->failed)
+        memcpy(&value, a->buf + divisor.index, sizeof(value));
+    if (value == 0.0) {
+        ExprJitLoc zero = jit_reg(JIT_XMM_SCRATCH2);
+        jit_sse(a, 0x66, 0x57, zero.index, zero);    /* xorpd */
+        jit_sse(a, 0x66, 0x2E, zero.index, divisor); /* ucomisd */
+        size_t unordered = jit_jcc8(a, 0x7A);        /* jp: NaN divides */
+        jit_jump_list(a, &a->divzero_jumps, &a->divzero_count,
+                      &a->divzero_cap, 0x84); /* je */
+        jit_land(a, unordered);
+    }
+    jit_binary(a, 0x5E); /* divsd */
+}
+
+static void jit_pow(ExprJitAsm *a) {
+    int lhs = a->depth - 2;
+    jit_spill(a, lhs);
+    jit_load(a, 0, a->stack[lhs]);
+    jit_load(a, 1, a->stack[lhs + 1]);
+    jit_call(a, (uint64_t)(uintptr_t)pow);
+    jit_call_result(a, lhs);
+    a->depth--;
+}
+
+/* top = fn(top), a libm function that can't fail */
+static void jit_math(ExprJitAsm *a, double (*fn)(double)) {
+    int top = a->depth - 1;
+    jit_spill(a, top);
+    jit_load(a, 0, a->stack[top]);
+    jit_call(a, (uint64_t)(uintptr_t)fn);
+    jit_call_result(a, top);
+}
+
+/* minsd/maxsd b, a picks b only if b < a (b > a), else a, NaNs included:
+ * the same as fn_min and fn_max */
+static void jit_min_max(ExprJitAsm *a, uint8_t opcode) {
+    int lhs = a->depth - 2;
+    int reg = lhs < EXPRLIB_JIT_SLOT_REGS ? lhs : JIT_XMM_SCRATCH;
+    jit_load(a, JIT_XMM_SCRATCH2, a->stack[lhs + 1]);
+    jit_sse(a, 0xF2, opcode, JIT_XMM_SCRATCH2, a->stack[lhs]);
+    jit_load(a, reg, jit_reg(JIT_XMM_SCRATCH2));
+    jit_slot_done(a, lhs, reg);
+    a->depth--;
+}
+
+static void jit_function(ExprJitAsm *a, const ExprInstr *ins) {
+    int first = a->depth - ins->argc;
+    jit_spill(a, first);
+    for (int i = first; i < a->depth; ++i) {
+        ExprJitLoc loc = a->stack[i];
+        if (jit_same_loc(loc, jit_home(i)))
+            continue;
+        int reg = i;
+        if (loc.kind != JIT_LOC_REG) {
+            reg = JIT_XMM_SCRATCH2;
+            jit_load(a, reg, loc);
+        }
+        jit_store(a, jit_home(i), reg);
+        a->stack[i] = jit_home(i);
+    }
+    int32_t args = first * 8;
+    jit_bytes(a, (const uint8_t[]){0x48, 0x8D, 0xBD}, 3); /* lea rdi,[rbp+d] */
+    jit_u32(a, (uint32_t)args);
+    jit_u8(a, 0xBE); /* mov esi, argc */
+    jit_u32(a, ins->argc);
+    uint64_t fn = (uint64_t)(uintptr_t)a->program->functions[ins->arg];
+    if (ins->op == EXPR_OP_MEMO) {
+        jit_u8(a, 0x48); /* movabs rdx, fn */
+        jit_u8(a, 0xBA);
+        jit_u64(a, fn);
+        fn = (uint64_t)(uintptr_t)memo_call;
+    }
+    jit_call(a, fn);
+    jit_call_result(a, first);
+    a->depth = first + 1;
+
+    jit_bytes(a, (const uint8_t[]){0x41, 0x83, 0x3C, 0x24, 0x00},
+              5); /* cmp dword [r12], 0 */
+    jit_jump_list(a, &a->fail_jumps, &a->fail_count, &a->fail_cap,
+                  0x85); /* jne */
+}
+
+/* top = pow(top, 0.5): sqrt(x + 0.0), except pow(-inf, 0.5) = +inf */
+static void jit_sqrt(ExprJitAsm *a) {
+    int top = a->depth - 1;
+    int reg = jit_slot_begin(a, top);
+    jit_sse(a, 0xF2, 0x58, reg, jit_const(a->pool_zero));      /* addsd */
+    jit_sse(a, 0x66, 0x2E, reg, jit_const(a->pool_minus_inf)); /* ucomisd */
+    jit_sse(a, 0xF2, 0x51, reg, jit_reg(reg));                 /* sqrtsd */
+    size_t not_equal = jit_jcc8(a, 0x75);                      /* jne */
+    size_t unordered = jit_jcc8(a, 0x7A);                      /* jp */
+    jit_load(a, reg, jit_const(a->pool_inf));
+    jit_land(a, not_equal);
+    jit_land(a, unordered);
+    jit_slot_done(a, top, reg);
+}
+
+static void jit_instruction(ExprJitAsm *a, const ExprInstr *ins,
+                            const ExprInstr *next) {
+    switch ((ExprOpcode)ins->op) {
+    case EXPR_OP_CONST:
+        jit_push(a, jit_const(a->pool_constants + 8 * (size_t)ins->arg));
+        break;
+    case EXPR_OP_VAR:
+        jit_push(a, (ExprJitLoc){JIT_LOC_VAR, ins->arg * 8});
+        break;
+    case EXPR_OP_ADD:
+        jit_binary(a, 0x58);
+        break;
+    case EXPR_OP_SUB:
+        jit_binary(a, 0x5C);
+        break;
+    case EXPR_OP_MUL:
+        jit_binary(a, 0x59);
+        break;
+    case EXPR_OP_DIV:
+        jit_divide(a);
+        break;
+    case EXPR_OP_POW:
+        jit_pow(a);
+        break;
+    case EXPR_OP_CALL:
+    case EXPR_OP_MEMO:
+        jit_function(a, ins);
+        break;
+    case EXPR_OP_STORE: {
+        ExprJitLoc temp = jit_temp_loc(a, ins->arg);
+        int top = a->depth - 1;
+        /* slots still reading the old value of the temp take a copy */
+        for (int i = 0; i < top; ++i) {
+            if (jit_same_loc(a->stack[i], temp))
+                jit_slot_done(a, i, jit_slot_begin(a, i));
+        }
+        int reg = jit_slot_begin(a, top);
+        jit_store(a, temp, reg);
+        jit_slot_done(a, top, reg);
+        break;
+    }
+    case EXPR_OP_LOAD:
+        jit_push(a, jit_temp_loc(a, ins->arg));
+        break;
+    case EXPR_OP_DUP: {
+        int top = a->depth - 1;
+        if (next && next->op == EXPR_OP_MUL) {
+            /* DUP MUL squares the top in place; the MUL is skipped */
+            int reg = jit_slot_begin(a, top);
+            jit_sse(a, 0xF2, 0x59, reg, jit_reg(reg));
+            jit_slot_done(a, top, reg);
+            break;
+        }
+        ExprJitLoc loc = a->stack[top];
+        if (loc.kind == JIT_LOC_REG) {
+            jit_push(a, loc);
+            jit_slot_done(a, top + 1, jit_slot_begin(a, top + 1));
+        } else {
+            /* memory is not written while the copy is live */
+            jit_push(a, loc);
+        }
+        break;
+    }
+    case EXPR_OP_RECIP: {
+        int top = a->depth - 1;
+        ExprJitLoc x = a->stack[top];
+        int reg = top < EXPRLIB_JIT_SLOT_REGS ? top : JIT_XMM_SCRATCH;
+        if (x.kind == JIT_LOC_REG) {
+            jit_load(a, JIT_XMM_SCRATCH2, jit_const(a->pool_one));
+            jit_sse(a, 0xF2, 0x5E, JIT_XMM_SCRATCH2, x);
+            jit_load(a, reg, jit_reg(JIT_XMM_SCRATCH2));
+        } else {
+            jit_load(a, reg, jit_const(a->pool_one));
+            jit_sse(a, 0xF2, 0x5E, reg, x);
+        }
+        jit_slot_done(a, top, reg);
+        break;
+    }
+    case EXPR_OP_SQRT:
+        jit_sqrt(a);
+        break;
+    case EXPR_OP_CBRT:
+        jit_math(a, jit_pow_third);
+        break;
+    case EXPR_OP_ABS: {
+        int top = a->depth - 1;
+        int reg = jit_slot_begin(a, top);
+        jit_sse(a, 0x66, 0x54, reg, jit_const(a->pool_abs_mask)); /* andpd */
+        jit_slot_done(a, top, reg);
+        break;
+    }
+    case EXPR_OP_OUTPUT:
+        /* multi-output programs are never handed to the JIT */
+        a->failed = true;
+        break;
+    case EXPR_OP_SIN:
+        jit_math(a, sin);
+        break;
+    case EXPR_OP_COS:
+        jit_math(a, cos);
+        break;
+    case EXPR_OP_EXP:
+        jit_math(a, exp);
+        break;
+    case EXPR_OP_LN:
+        jit_math(a, log);
+        break;
+    case EXPR_OP_FSQRT: {
+        int top = a->depth - 1;
+        int reg = jit_slot_begin(a, top);
+        jit_sse(a, 0xF2, 0x51, reg, jit_reg(reg)); /* sqrtsd */
+        jit_slot_done(a, top, reg);
+        break;
+    }
+    case EXPR_OP_FLOOR:
+        jit_math(a, floor);
+        break;
+    case EXPR_OP_MIN:
+        jit_min_max(a, 0x5D); /* minsd */
+        break;
+    case EXPR_OP_MAX:
+        jit_min_max(a, 0x5F); /* maxsd */
+        break;
+    }
+}
+
+/* Returns the offset of the entry point in a->buf. */
+static size_t jit_translate(ExprJitAsm *a) {
+    const ExprCompiled *p = a->program;
+
+    /* pool: the abs mask first, andpd reads 16 aligned bytes */
+    uint64_t mask[2] = {0x7FFFFFFFFFFFFFFFull, 0x7FFFFFFFFFFFFFFFull};
+    a->pool_abs_mask = a->len;
+    jit_bytes(a, mask, sizeof(mask));
+    a->pool_one = jit_pool_double(a, 1.0);
+    a->pool_zero = jit_pool_double(a, 0.0);
+    a->pool_minus_inf = jit_pool_double(a, -INFINITY);
+    a->pool_inf = jit_pool_double(a, INFINITY);
+    a->pool_constants = a->len;
+    for (int i = 0; i < p->const_count; ++i)
+        jit_pool_double(a, p->constants[i]);
+    jit_align(a, 16);
+
+    size_t entry = a->len;
+    int32_t frame = (int32_t)(((size_t)(p->max_stack + p->temp_count) * 8 +
+                               15) & ~(size_t)15);
+    bool can_fail = jit_can_fail(p);
+
+    /* push rbx; push rbp; push r12 leaves rsp 16-byte aligned */
+    jit_bytes(a, (const uint8_t[]){0x53, 0x55, 0x41, 0x54}, 4);
+    jit_bytes(a, (const uint8_t[]){0x48, 0x81, 0xEC}, 3); /* sub rsp, frame */
+    jit_u32(a, (uint32_t)frame);
+    jit_bytes(a, (const uint8_t[]){0x48, 0x89, 0xE5}, 3); /* mov rbp, rsp */
+    jit_bytes(a, (const uint8_t[]){0x48, 0x89, 0xFB}, 3); /* mov rbx, rdi */
+    if (can_fail) {
+        jit_call(a, (uint64_t)(uintptr_t)jit_error_enter);
+        jit_bytes(a, (const uint8_t[]){0x49, 0x89, 0xC4}, 3); /* mov r12,rax */
+    }
+
+    const ExprInstr *end = p->code + p->code_len;
+    for (const ExprInstr *ins = p->code; ins < end && !a->failed; ++ins) {
+        const ExprInstr *next = ins + 1 < end ? ins + 1 : NULL;
+        jit_instruction(a, ins, next);
+        if (ins->op == EXPR_OP_DUP && next && next->op == EXPR_OP_MUL)
+            ++ins;
+    }
+    jit_load(a, 0, a->stack[0]);
+
+    size_t epilogue = a->len;
+    jit_bytes(a, (const uint8_t[]){0x48, 0x81, 0xC4}, 3); /* add rsp, frame */
+    jit_u32(a, (uint32_t)frame);
+    /* pop r12; pop rbp; pop rbx; ret */
+    jit_bytes(a, (const uint8_t[]){0x41, 0x5C, 0x5D, 0x5B, 0xC3}, 5);
+
+    if (a->divzero_count) {
+        jit_patch_list(a, a->divzero_jumps, a->divzero_count);
+        jit_bytes(a, (const uint8_t[]){0x41, 0xC7, 0x04, 0x24},
+                  4); /* mov dword [r12], DIVISION_BY_ZERO */
+        jit_u32(a, EXPRLIB_ERROR_DIVISION_BY_ZERO);
+    }
+    if (a->fail_count || a->divzero_count) {
+        jit_patch_list(a, a->fail_jumps, a->fail_count);
+        ExprJitLoc zero = jit_reg(0);
+        jit_sse(a, 0x66, 0x57, 0, zero); /* xorpd xmm0, xmm0 */
+        jit_u8(a, 0xE9);                 /* jmp epilogue */
+        jit_u32(a, (uint32_t)(int32_t)(epilogue - (a->len + 4)));
+    }
+    return entry;
+}
+
+static void jit_map(ExprJit *jit, const ExprJitAsm *a, size_t entry) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (a->len + (size_t)page - 1) & ~((size_t)page - 1);
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return;
+    memcpy(code, a->buf, a->len);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        return;
+    }
+    jit->code = code;
+    jit->code_size = size;
+    /* object to function pointer: fine on every POSIX host */
+    void *fn = (uint8_t *)code + entry;
+    memcpy(&jit->fn, &fn, sizeof(fn));
+}
+
+#endif /* EXPRLIB_JIT_NATIVE */
+
+ExprJit *exprlib_jit_compile(const ExprCompiled *program) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    ExprJit *jit = calloc(1, sizeof(*jit));
+    if (!jit) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    jit->program = program;
+
+#if EXPRLIB_JIT_NATIVE
+    /* too big a frame for the caller's stack: leave it to the VM */
+    if ((size_t)program->max_stack + program->temp_count > EXPRLIB_FRAME_SLOTS)
+        return jit;
+    ExprJitAsm a = {.program = program};
+    a.stack = malloc(sizeof(ExprJitLoc) * (program->max_stack + 1));
+    if (!a.stack) {
+        a.failed = true;
+    } else {
+        size_t entry = jit_translate(&a);
+        if (!a.failed)
+            jit_map(jit, &a, entry);
+    }
+    free(a.buf);
+    free(a.stack);
+    free(a.fail_jumps);
+    free(a.divzero_jumps);
+    if (a.failed) {
+        free(jit);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+#endif
+    return jit;
+}
+
+ExprJitFn exprlib_jit_function(const ExprJit *jit) {
+    return jit ? jit->fn : NULL;
+}
+
+double exprlib_jit_run(const ExprJit *jit, const double *vars) {
+    if (!jit) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return 0.0;
+    }
+    if (jit->fn) {
+        EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+        return jit->fn(vars);
+    }
+
+    int count = jit->program->var_count;
+    ExprLibVariable *bound = alloca(sizeof(*bound) * (count + 1));
+    for (int i = 0; i < count; ++i) {
+        bound[i].name = NULL;
+        bound[i].value = (double *)&vars[i];
+    }
+    ExprContext context = {.variables = bound, .var_count = count};
+    return exprlib_run(jit->program, &context);
+}
+
+void exprlib_jit_free(ExprJit *jit) {
+    if (!jit)
+        return;
+#if EXPRLIB_JIT_NATIVE
+    if (jit->code)
+        munmap(jit->code, jit->code_size);
+#endif
+    free(jit);
+}
+
+/* C code generation
+ *
+ * exprlib_emit_c writes the tree as a standalone C function in three-address
+ * form: every operator and call becomes one `const double tN = ...;`
+ * statement, numbers and variables are used in place. Built-ins are
+ * recognised by the function they were bound to and mapped to libm (or, for
+ * factorial/nCr/nPr, to small static helpers emitted once before the
+ * function). Any other function is called through its ExprLibFnPtr signature
+ * by name, with a prototype, so the user's implementation is linked in.
+ */
+
+#define EMIT_C_FACTORIAL 0x1u
+#define EMIT_C_NCR 0x2u
+#define EMIT_C_NPR 0x4u
+
+typedef struct {
+    FILE *out;
+    int next_temp;
+    unsigned helpers;     /* EMIT_C_* */
+    bool uses_vars;
+    ExprSymbol *externs; /* user functions already declared */
+    int extern_count;
+    int extern_cap;
+} ExprEmitter;
+
+static const struct {
+    ExprLibFnPtr fn;
+    const char *prefix; /* the argument goes between prefix and ")" */
+} g_emit_c_libm[] = {
+    {fn_sin, "sin("},          {fn_cos, "cos("},
+    {fn_tan, "tan("},          {fn_cot, "1.0 / tan("},
+    {fn_sec, "1.0 / cos("},    {fn_cosec, "1.0 / sin("},
+    {fn_asin, "asin("},        {fn_acos, "acos("},
+    {fn_atan, "atan("},        {fn_sqrt, "sqrt("},
+    {fn_cbrt, "cbrt("},        {fn_log, "log("},
+    {fn_log10, "log10("},      {fn_exp, "exp("},
+    {fn_abs, "fabs("},         {fn_floor, "floor("},
+    {fn_ceil, "ceil("},        {fn_round, "round("},
+};
+
+static bool emit_c_identifier(const char *name) {
+    if (!name || !(isalpha((unsigned char)*name) || *name == '_'))
+        return false;
+    for (; *name; ++name) {
+        if (!isalnum((unsigned char)*name) && *name != '_')
+            return false;
+    }
+    return true;
+}
+
+/* Round-trips every double and never reads as an int literal. */
+static void emit_c_number(FILE *out, double value) {
+    if (isnan(value)) {
+        fputs("NAN", out);
+    } else if (isinf(value)) {
+        fputs(value < 0 ? "(-INFINITY)" : "INFINITY", out);
+    } else {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.17g", value);
+        bool has_point = strpbrk(buf, ".e") != NULL;
+        fprintf(out, value < 0 || signbit(value) ? "(%s%s)" : "%s%s", buf,
+                has_point ? "" : ".0");
+    }
+}
+
+/* The helper or prototype a call needs, after its arguments'. */
+static bool emit_c_declare_call(ExprEmitter *e,
+                                const ExprNodeFunctionCall *call) {
+    if (call->fn == factorial) {
+        e->helpers |= EMIT_C_FACTORIAL;
+        return true;
+    }
+    if (call->fn == nCr || call->fn == nPr) {
+        e->helpers |=
+            EMIT_C_FACTORIAL | (call->fn == nCr ? EMIT_C_NCR : EMIT_C_NPR);
+        return true;
+    }
+    if ((call->fn == fn_min || call->fn == fn_max) && call->argc < 1) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    if (call->fn == fn_pow || call->fn == fn_min || call->fn == fn_max ||
+        call->fn == fn_deg2rad || call->fn == fn_rad2deg)
+        return true;
+    for (size_t i = 0; i < sizeof(g_emit_c_libm) / sizeof(*g_emit_c_libm);
+         ++i) {
+        if (g_emit_c_libm[i].fn == call->fn)
+            return true;
+    }
+
+    if (!emit_c_identifier(call->name)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    for (int i = 0; i < e->extern_count; ++i) {
+        if (e->externs[i] == call->symbol)
+            return true;
+    }
+    if (!grow_array((void **)&e->externs, &e->extern_cap, e->extern_count + 1,
+                    sizeof(*e->externs)))
+        return false;
+    e->externs[e->extern_count++] = call->symbol;
+    fprintf(e->out, "double %s(const double *args, int argc);\n", call->name);
+    return true;
+}
+
+/* Prototypes and helpers the function body will refer to. */
+static bool emit_c_declare(ExprEmitter *e, const ExprNode *expr) {
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    int frame_cap = EXPRLIB_STACK_INLINE, frame_count = 0;
+    bool ok = false;
+
+    if (!frame_push(&frames, inline_frames, &frame_count, &frame_cap, expr))
+        goto out;
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        const ExprNode *n = f->node;
+        if (n->type == EXPR_NODE_VARIABLE)
+            e->uses_vars = true;
+        if (f->next < node_child_count(n)) {
+            const ExprNode *child = node_child(n, f->next++);
+            if (child && !frame_push(&frames, inline_frames, &frame_count,
+                                     &frame_cap, child))
+                goto out;
+            continue;
+        }
+        if (n->type == EXPR_NODE_FUNCTION_CALL &&
+            !emit_c_declare_call(e, &n->data.fn_call))
+            goto out;
+        frame_count--;
+    }
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    return ok;
+}
+
+static void emit_c_helpers(ExprEmitter *e, const char *fn_name) {
+    FILE *out = e->out;
+    if (e->helpers & EMIT_C_FACTORIAL) {
+        fprintf(out,
+                "static double %s_factorial(double x) {\n"
+                "    if (!(x >= 0))\n"
+                "        return NAN;\n"
+                "    double result = 1.0;\n"
+                "    for (double i = 1.0; i <= x && result < INFINITY; i++)\n"
+                "        result *= i;\n"
+                "    return result;\n"
+                "}\n\n",
+                fn_name);
+    }
+    if (e->helpers & EMIT_C_NCR) {
+        fprintf(out,
+                "static double %s_nCr(double n, double r) {\n"
+                "    if (!(n >= 0) || !(r >= 0) || r > n)\n"
+                "        return NAN;\n"
+                "    return %s_factorial(n) /\n"
+                "           (%s_factorial(r) * %s_factorial(n - r));\n"
+                "}\n\n",
+                fn_name, fn_name, fn_name, fn_name);
+    }
+    if (e->helpers & EMIT_C_NPR) {
+        fprintf(out,
+                "static double %s_nPr(double n, double r) {\n"
+                "    if (!(n >= 0) || !(r >= 0) || r > n)\n"
+                "        return NAN;\n"
+                "    return %s_factorial(n) / %s_factorial(n - r);\n"
+                "}\n\n",
+                fn_name, fn_name, fn_name);
+    }
+}
+
+/* An operand is a temp (>= 0) or, for -1, the leaf itself. */
+static void emit_c_operand(ExprEmitter *e, const ExprNode *n, int temp) {
+    if (temp >= 0)
+        fprintf(e->out, "t%d", temp);
+    else if (n->type == EXPR_NODE_NUMBER)
+        emit_c_number(e->out, n->data.number);
+    else
+        fprintf(e->out, "vars[%d] /* %s */", n->data.variable.index,
+                n->data.variable.name);
+}
+
+/* Each node's temp, given its children's (see emit_c_operand). */
+static int emit_c_operator(ExprEmitter *e, const ExprNodeOperator *op,
+                           const int *args) {
+    if (!strchr("+-*/^", op->op)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
+        return -1;
+    }
+    int temp = e->next_temp++;
+    fprintf(e->out, "    const double t%d = %s", temp,
+            op->op == '^' ? "pow(" : "");
+    emit_c_operand(e, op->left, args[0]);
+    if (op->op == '^')
+        fputs(", ", e->out);
+    else
+        fprintf(e->out, " %c ", op->op);
+    emit_c_operand(e, op->right, args[1]);
+    fputs(op->op == '^' ? ");\n" : ";\n", e->out);
+    return temp;
+}
+
+static int emit_c_call(ExprEmitter *e, const ExprNodeFunctionCall *call,
+                       const char *fn_name, const int *args) {
+    FILE *out = e->out;
+    int temp = e->next_temp++;
+    if (call->fn == fn_min || call->fn == fn_max) {
+        /* same comparisons as fn_min/fn_max, so NaN behaves alike */
+        fprintf(out, "    double t%d = ", temp);
+        emit_c_operand(e, call->args[0], args[0]);
+        fputs(";\n", out);
+        for (int i = 1; i < call->argc; ++i) {
+            fprintf(out, "    if (");
+            emit_c_operand(e, call->args[i], args[i]);
+            fprintf(out, " %c t%d)\n        t%d = ",
+                    call->fn == fn_min ? '<' : '>', temp, temp);
+            emit_c_operand(e, call->args[i], args[i]);
+            fputs(";\n", out);
+        }
+    } else {
+        fprintf(out, "    const double t%d = ", temp);
+        const char *prefix = NULL;
+        for (size_t i = 0; i < sizeof(g_emit_c_libm) / sizeof(*g_emit_c_libm);
+             ++i) {
+            if (g_emit_c_libm[i].fn == call->fn)
+                prefix = g_emit_c_libm[i].prefix;
+        }
+        if (prefix || call->fn == fn_pow || call->fn == factorial ||
+            call->fn == nCr || call->fn == nPr) {
+            if (prefix)
+                fputs(prefix, out);
+            else if (call->fn == fn_pow)
+                fputs("pow(", out);
+            else
+                fprintf(out, "%s_%s(", fn_name,
+                        call->fn == factorial ? "factorial"
+                        : call->fn == nCr   ? "nCr"
+                                            : "nPr");
+            for (int i = 0; i < call->argc; ++i) {
+                if (i)
+                    fputs(", ", out);
+                emit_c_operand(e, call->args[i], args[i]);
+            }
+            fputs(")", out);
+        } else if (call->fn == fn_deg2rad || call->fn == fn_rad2deg) {
+            emit_c_operand(e, call->args[0], args[0]);
+            fputs(" * ", out);
+            emit_c_number(out, call->fn == fn_deg2rad ? M_PI / 180.0
+                                                      : 180.0 / M_PI);
+        } else if (call->argc == 0) {
+            fprintf(out, "%s((const double *)0, 0)", call->name);
+        } else {
+            fprintf(out, "%s((const double[]){", call->name);
+            for (int i = 0; i < call->argc; ++i) {
+                if (i)
+                    fputs(", ", out);
+                emit_c_operand(e, call->args[i], args[i]);
+            }
+            fprintf(out, "}, %d)", call->argc);
+        }
+        fputs(";\n", out);
+    }
+    return temp;
+}
+
+static bool emit_c_node(ExprEmitter *e, const ExprNode *expr,
+                        const char *fn_name, int *result) {
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    int inline_temps[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    int *temps = inline_temps;
+    int frame_cap = EXPRLIB_STACK_INLINE, temp_cap = EXPRLIB_STACK_INLINE;
+    int frame_count = 0, temp_count = 0;
+    bool ok = false;
+
+    if (!frame_push(&frames, inline_frames, &frame_count, &frame_cap, expr))
+        goto out;
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        const ExprNode *n = f->node;
+        int children = node_child_count(n);
+        if (f->next < children) {
+            const ExprNode *child = node_child(n, f->next++);
+            if (!child) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+                goto out;
+            }
+            if (!frame_push(&frames, inline_frames, &frame_count, &frame_cap,
+                            child))
+                goto out;
+            continue;
+        }
+
+        int temp = -1;
+        temp_count -= children;
+        switch (n->type) {
+        case EXPR_NODE_NUMBER:
+            break;
+        case EXPR_NODE_VARIABLE:
+            if (n->data.variable.index < 0) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+                goto out;
+            }
+            break;
+        case EXPR_NODE_OPERATOR:
+            temp = emit_c_operator(e, &n->data.op_node, temps + temp_count);
+            if (temp < 0)
+                goto out;
+            break;
+        case EXPR_NODE_FUNCTION_CALL:
+            temp = emit_c_call(e, &n->data.fn_call, fn_name,
+                               temps + temp_count);
+            break;
+        default:
+            EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+            goto out;
+        }
+        if (temp_count == temp_cap &&
+            !stack_grow((void **)&temps, inline_temps, &temp_cap,
+                        sizeof(*temps)))
+            goto out;
+        temps[temp_count++] = temp;
+        frame_count--;
+    }
+    *result = temps[0];
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    stack_release(temps, inline_temps);
+    return ok;
+}
+
+bool exprlib_emit_c(const ExprNode *expr, FILE *out, const char *fn_name) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!expr || !out || !fn_name) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    if (!emit_c_identifier(fn_name)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+
+    ExprEmitter e = {.out = out};
+    fputs("#include <math.h>\n\n", out);
+    bool ok = emit_c_declare(&e, expr);
+    if (ok) {
+        if (e.extern_count)
+            fputc('\n', out);
+        emit_c_helpers(&e, fn_name);
+        fprintf(out, "double %s(const double *vars) {\n", fn_name);
+        if (!e.uses_vars)
+            fputs("    (void)vars;\n", out);
+        int result;
+        ok = emit_c_node(&e, expr, fn_name, &result);
+        if (ok) {
+            fputs("    return ", out);
+            emit_c_operand(&e, expr, result);
+            fputs(";\n}\n", out);
+        }
+    }
+    free(e.externs);
+    if (ok && ferror(out)) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        ok = false;
+    }
+    return ok;
+}
+
+/* Parse cache
+ *
+ * An ExprCache maps an expression string and a variable layout (the names of
+ * the context's variables, in order) to a compiled program. Entries sit in a
+ * chained hash table and on a doubly linked LRU list: a hit moves the entry
+ * to the front, and inserting into a full cache evicts from the back.
+ * Programs are reference counted. The cache holds one reference and every
+ * lookup hands out another, so a program evicted while in use stays valid
+ * until its last user calls exprlib_free_compiled. An entry built against an
+ * older registry snapshot is recompiled on its next lookup. Misses parse and
+ * compile outside the lock, so one slow formula doesn't stall the others.
+ */
+
+#define EXPRLIB_CACHE_DEFAULT_CAPACITY 256
+
+typedef struct ExprCacheEntry {
+    struct ExprCacheEntry *hash_next;
+    struct ExprCacheEntry *lru_prev; /* towards the most recently used */
+    struct ExprCacheEntry *lru_next;
+    uint64_t hash;
+    char *key; /* the expression, then every variable name, NUL-terminated */
+    int var_count;
+    unsigned long version; /* g_registry_version the program was built with */
+    ExprCompiled *program;
+} ExprCacheEntry;
+
+struct ExprCache {
+    pthread_mutex_t lock;
+    ExprCacheEntry **buckets;
+    size_t bucket_mask;
+    ExprCacheEntry *lru_head; /* most recently used */
+    ExprCacheEntry *lru_tail;
+    size_t capacity;
+    ExprCacheStats stats;
+};
+
+static const char *cache_var_name(const ExprContext *context, int i) {
+    const char *name = context->variables[i].name;
+    return name ? name : "";
+}
+
+/* FNV-1a over the key bytes, terminators included */
+static uint64_t cache_hash_bytes(uint64_t h, const char *s) {
+    do {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ull;
+    } while (*s++);
+    return h;
+}
+
+static uint64_t cache_hash(const char *expression, const ExprContext *context) {
+    uint64_t h = cache_hash_bytes(14695981039346656037ull, expression);
+    int vars = context ? context->var_count : 0;
+    for (int i = 0; i < vars; ++i)
+        h = cache_hash_bytes(h, cache_var_name(context, i));
+    return h;
+}
+
+static bool cache_matches(const ExprCacheEntry *e, uint64_t hash,
+                          const char *expression, const ExprContext *context) {
+    int vars = context ? context->var_count : 0;
+    if (e->hash != hash || e->var_count != vars)
+        return false;
+    const char *key = e->key;
+    if (strcmp(key, expression) != 0)
+        return false;
+    key += strlen(key) + 1;
+    for (int i = 0; i < vars; ++i) {
+        const char *name = cache_var_name(context, i);
+        if (strcmp(key, name) != 0)
+            return false;
+        key += strlen(key) + 1;
+    }
+    return true;
+}
+
+static char *cache_make_key(const char *expression,
+                            const ExprContext *context) {
+    int vars = context ? context->var_count : 0;
+    size_t len = strlen(expression) + 1;
+    for (int i = 0; i < vars; ++i)
+        len += strlen(cache_var_name(context, i)) + 1;
+    char *key = malloc(len);
+    if (!key)
+        return NULL;
+    char *p = key;
+    size_t n = strlen(expression) + 1;
+    memcpy(p, expression, n);
+    p += n;
+    for (int i = 0; i < vars; ++i) {
+        const char *name = cache_var_name(context, i);
+        n = strlen(name) + 1;
+        memcpy(p, name, n);
+        p += n;
+    }
+    return key;
+}
+
+static ExprCacheEntry **cache_bucket(ExprCache *cache, uint64_t hash) {
+    return &cache->buckets[hash & cache->bucket_mask];
+}
+
+static ExprCacheEntry *cache_find(ExprCache *cache, uint64_t hash,
+                                  const char *expression,
+                                  const ExprContext *context) {
+    for (ExprCacheEntry *e = *cache_bucket(cache, hash); e; e = e->hash_next) {
+        if (cache_matches(e, hash, expression, context))
+            return e;
+    }
+    return NULL;
+}
+
+static void cache_lru_unlink(ExprCache *cache, ExprCacheEntry *e) {
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+}
+
+static void cache_lru_push(ExprCache *cache, ExprCacheEntry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+static void cache_entry_free(ExprCacheEntry *e) {
+    exprlib_free_compiled(e->program);
+    free(e->key);
+    free(e);
+}
+
+static void cache_evict(ExprCache *cache, ExprCacheEntry *e) {
+    ExprCacheEntry **link = cache_bucket(cache, e->hash);
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+    cache_lru_unlink(cache, e);
+    cache->stats.entries--;
+    cache_entry_free(e);
+}
+
+ExprCache *exprlib_cache_create(size_t capacity) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (capacity == 0)
+        capacity = EXPRLIB_CACHE_DEFAULT_CAPACITY;
+    ExprCache *cache = calloc(1, sizeof(*cache));
+    size_t buckets = 16;
+    while (buckets < capacity)
+        buckets *= 2;
+    if (cache)
+        cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+    if (!cache || !cache->buckets) {
+        free(cache);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache->buckets);
+        free(cache);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return NULL;
+    }
+    cache->bucket_mask = buckets - 1;
+    cache->capacity = capacity;
+    return cache;
+}
+
+void exprlib_cache_destroy(ExprCache *cache) {
+    if (!cache)
+        return;
+    for (ExprCacheEntry *e = cache->lru_head; e;) {
+        ExprCacheEntry *next = e->lru_next;
+        cache_entry_free(e);
+        e = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+ExprCompiled *exprlib_cache_get(ExprCache *cache, const char *expression,
+                                const ExprContext *context) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!cache || !expression) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+
+    uint64_t hash = cache_hash(expression, context);
+    unsigned long version = atomic_load(&g_registry_version);
+
+    pthread_mutex_lock(&cache->lock);
+    ExprCacheEntry *e = cache_find(cache, hash, expression, context);
+    if (e && e->version == version) {
+        cache->stats.hits++;
+        cache_lru_unlink(cache, e);
+        cache_lru_push(cache, e);
+        ExprCompiled *program = exprlib_retain_compiled(e->program);
+        pthread_mutex_unlock(&cache->lock);
+        return program;
+    }
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    ExprNode *ast = exprlib_parse((string)expression, context);
+    if (!ast)
+        return NULL;
+    ExprCompiled *program = exprlib_compile(ast, context);
+    exprlib_free(ast);
+    if (!program)
+        return NULL;
+
+    ExprCacheEntry *fresh = calloc(1, sizeof(*fresh));
+    char *key = fresh ? cache_make_key(expression, context) : NULL;
+    if (!key) {
+        /* still usable, just not cached */
+        free(fresh);
+        return program;
+    }
+    fresh->hash = hash;
+    fresh->key = key;
+    fresh->var_count = context ? context->var_count : 0;
+    fresh->version = version;
+    fresh->program = exprlib_retain_compiled(program);
+
+    pthread_mutex_lock(&cache->lock);
+    /* another thread may have filled the slot while we were compiling */
+    e = cache_find(cache, hash, expression, context);
+    if (e && (long)(e->version - version) >= 0) {
+        ExprCompiled *shared = exprlib_retain_compiled(e->program);
+        cache_lru_unlink(cache, e);
+        cache_lru_push(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+        cache_entry_free(fresh);
+        exprlib_free_compiled(program);
+        return shared;
+    }
+    if (e)
+        cache_evict(cache, e);
+    else if (cache->stats.entries == cache->capacity) {
+        cache->stats.evictions++;
+        cache_evict(cache, cache->lru_tail);
+    }
+    ExprCacheEntry **bucket = cache_bucket(cache, hash);
+    fresh->hash_next = *bucket;
+    *bucket = fresh;
+    cache_lru_push(cache, fresh);
+    cache->stats.entries++;
+    pthread_mutex_unlock(&cache->lock);
+    return program;
+}
+
+void exprlib_cache_stats(ExprCache *cache, ExprCacheStats *stats) {
+    if (!cache || !stats) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Live expressions
+ *
+ * An ExprLive is a tree flattened into post-order, so children always come
+ * before their parent, with the last value of every node cached next to it.
+ * Each node knows its parent and each variable knows the leaves that read it.
+ * Marking a variable dirty walks from those leaves towards the root and
+ * queues every node on the way, stopping at the first one already queued.
+ * Evaluation sorts the queue, which restores post-order, and recomputes just
+ * those nodes from their children's cached values. Calls to functions not
+ * marked EXPRLIB_FN_PURE are queued on every evaluation, since their result
+ * may change without any input changing. After an error, the nodes that
+ * weren't recomputed stay queued for the next evaluation.
+ */
+
+typedef struct {
+    ExprNodeType type;
+    char op;    /* EXPR_NODE_OPERATOR */
+    bool dirty; /* queued for recomputation */
+    bool memo;  /* EXPR_NODE_FUNCTION_CALL with EXPRLIB_FN_MEMOIZE */
+    int parent; /* -1 for the root */
+    int first;  /* children: live->args[first .. first + argc) */
+    int argc;
+    union {
+        double number;   /* EXPR_NODE_NUMBER */
+        int var;         /* EXPR_NODE_VARIABLE */
+        ExprLibFnPtr fn; /* EXPR_NODE_FUNCTION_CALL */
+    } as;
+    double value;
+} ExprLiveNode;
+
+struct ExprLive {
+    const ExprContext *context;
+    ExprLiveNode *nodes;
+    int node_count;
+    int *args;      /* child indices, grouped by parent */
+    int *uses;      /* leaf indices, grouped by variable */
+    int *use_start; /* variable i reads uses[use_start[i] .. use_start[i+1]) */
+    int *impure;    /* calls recomputed on every evaluation */
+    int impure_count;
+    int *pending; /* queued node indices */
+    int pending_count;
+    double *argv; /* scratch for call arguments */
+};
+
+static void live_mark(ExprLive *live, int index) {
+    while (index >= 0 && !live->nodes[index].dirty) {
+        live->nodes[index].dirty = true;
+        live->pending[live->pending_count++] = index;
+        index = live->nodes[index].parent;
+    }
+}
+
+static int live_compare_index(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Appends the tree below expr to live->nodes in post-order. A finished node
+ * finds its children's indices on top of `done`. */
+static bool live_flatten(ExprLive *live, const ExprNode *expr, int *node_cap,
+                         int *arg_cap, int *arg_count, int *impure_cap,
+                         int *max_argc) {
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    int inline_done[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    int *done = inline_done;
+    int frame_cap = EXPRLIB_STACK_INLINE, done_cap = EXPRLIB_STACK_INLINE;
+    int frame_count = 0, done_count = 0;
+    bool ok = false;
+
+    frames[frame_count++] = (ExprEvalFrame){expr, 0};
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        const ExprNode *n = f->node;
+        int argc = n->type == EXPR_NODE_OPERATOR        ? 2
+                   : n->type == EXPR_NODE_FUNCTION_CALL ? n->data.fn_call.argc
+                                                        : 0;
+        if (f->next < argc) {
+            const ExprNode *child = n->type == EXPR_NODE_OPERATOR
+                                        ? (f->next ? n->data.op_node.right
+                                                   : n->data.op_node.left)
+                                        : n->data.fn_call.args[f->next];
+            f->next++;
+            if (!child) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+                goto out;
+            }
+            if (frame_count == frame_cap &&
+                !stack_grow((void **)&frames, inline_frames, &frame_cap,
+                            sizeof(*frames)))
+                goto out;
+            frames[frame_count++] = (ExprEvalFrame){child, 0};
+            continue;
+        }
+
+        if (!grow_array((void **)&live->nodes, node_cap, live->node_count + 1,
+                        sizeof(*live->nodes)) ||
+            !grow_array((void **)&live->args, arg_cap, *arg_count + argc,
+                        sizeof(*live->args)))
+            goto out;
+        int index = live->node_count++;
+        ExprLiveNode *node = &live->nodes[index];
+        *node = (ExprLiveNode){.type = n->type,
+                               .parent = -1,
+                               .first = *arg_count,
+                               .argc = argc};
+        switch (n->type) {
+        case EXPR_NODE_NUMBER:
+            node->as.number = n->data.number;
+            break;
+        case EXPR_NODE_VARIABLE:
+            node->as.var = n->data.variable.index;
+            if (!live->context || node->as.var < 0 ||
+                node->as.var >= live->context->var_count) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+                goto out;
+            }
+            break;
+        case EXPR_NODE_OPERATOR:
+            node->op = n->data.op_node.op;
+            break;
+        case EXPR_NODE_FUNCTION_CALL:
+            node->as.fn = n->data.fn_call.fn;
+            node->memo = n->data.fn_call.fn_flags & EXPRLIB_FN_MEMOIZE;
+            if (argc > *max_argc)
+                *max_argc = argc;
+            if (n->data.fn_call.fn_flags & EXPRLIB_FN_PURE)
+                break;
+            if (!grow_array((void **)&live->impure, impure_cap,
+                            live->impure_count + 1, sizeof(*live->impure)))
+                goto out;
+            live->impure[live->impure_count++] = index;
+            break;
+        }
+        done_count -= argc;
+        for (int i = 0; i < argc; ++i) {
+            live->args[(*arg_count)++] = done[done_count + i];
+            live->nodes[done[done_count + i]].parent = index;
+        }
+        if (done_count == done_cap &&
+            !stack_grow((void **)&done, inline_done, &done_cap, sizeof(*done)))
+            goto out;
+        done[done_count++] = index;
+        frame_count--;
+    }
+    ok = true;
+
+out:
+    stack_release(frames, inline_frames);
+    stack_release(done, inline_done);
+    return ok;
+}
+
+ExprLive *exprlib_live_create(const ExprNode *expr,
+                              const ExprContext *context) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!expr) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    ExprLive *live = calloc(1, sizeof(*live));
+    if (!live) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    live->context = context;
+
+    int node_cap = 0, arg_cap = 0, arg_count = 0, impure_cap = 0;
+    int max_argc = 0;
+    if (!live_flatten(live, expr, &node_cap, &arg_cap, &arg_count,
+                      &impure_cap, &max_argc))
+        goto fail;
+
+    int vars = context ? context->var_count : 0;
+    int n = live->node_count;
+    live->use_start = calloc((size_t)vars + 1, sizeof(int));
+    live->uses = malloc(sizeof(int) * n);
+    live->pending = malloc(sizeof(int) * n);
+    live->argv = malloc(sizeof(double) * (max_argc + 1));
+    if (!live->use_start || !live->uses || !live->pending || !live->argv) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        goto fail;
+    }
+
+    /* group the leaves by variable: count, prefix sums, place, shift back */
+    for (int i = 0; i < n; ++i) {
+        if (live->nodes[i].type == EXPR_NODE_VARIABLE)
+            live->use_start[live->nodes[i].as.var + 1]++;
+    }
+    for (int v = 0; v < vars; ++v)
+        live->use_start[v + 1] += live->use_start[v];
+    for (int i = 0; i < n; ++i) {
+        if (live->nodes[i].type == EXPR_NODE_VARIABLE)
+            live->uses[live->use_start[live->nodes[i].as.var]++] = i;
+    }
+    for (int v = vars; v > 0; --v)
+        live->use_start[v] = live->use_start[v - 1];
+    live->use_start[0] = 0;
+
+    /* nothing is cached yet: queue every node, already in post-order */
+    for (int i = 0; i < n; ++i) {
+        live->nodes[i].dirty = true;
+        live->pending[i] = i;
+    }
+    live->pending_count = n;
+    return live;
+
+fail:
+    exprlib_live_free(live);
+    return NULL;
+}
+
+bool exprlib_live_mark_dirty(ExprLive *live, int var_index) {
+    if (!live) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+    int vars = live->context ? live->context->var_count : 0;
+    if (var_index < 0 || var_index >= vars) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    for (int i = live->use_start[var_index]; i < live->use_start[var_index + 1];
+         ++i)
+        live_mark(live, live->uses[i]);
+    return true;
+}
+
+static double live_compute(ExprLive *live, const ExprLiveNode *node) {
+    const int *args = live->args + node->first;
+    switch (node->type) {
+    case EXPR_NODE_NUMBER:
+        return node->as.number;
+    case EXPR_NODE_VARIABLE:
+        return *live->context->variables[node->as.var].value;
+    case EXPR_NODE_OPERATOR:
+        return evaluate_operator(node->op, live->nodes[args[0]].value,
+                                 live->nodes[args[1]].value);
+    case EXPR_NODE_FUNCTION_CALL:
+        for (int i = 0; i < node->argc; ++i)
+            live->argv[i] = live->nodes[args[i]].value;
+        return node->memo ? memo_call(live->argv, node->argc, node->as.fn)
+                          : node->as.fn(live->argv, node->argc);
+    }
+    EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+    return 0.0;
+}
+
+double exprlib_live_evaluate(ExprLive *live) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!live) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return 0.0;
+    }
+    for (int i = 0; i < live->impure_count; ++i)
+        live_mark(live, live->impure[i]);
+    if (live->pending_count > 1)
+        qsort(live->pending, live->pending_count, sizeof(*live->pending),
+              live_compare_index);
+
+    for (int k = 0; k < live->pending_count; ++k) {
+        ExprLiveNode *node = &live->nodes[live->pending[k]];
+        double value = live_compute(live, node);
+        if (EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
+            /* keep the rest queued, still in order */
+            live->pending_count -= k;
+            memmove(live->pending, live->pending + k,
+                    sizeof(*live->pending) * live->pending_count);
             return 0.0;
+        }
+        node->value = value;
+        node->dirty = false;
+    }
+    live->pending_count = 0;
+    return live->nodes[live->node_count - 1].value;
+}
+
+void exprlib_live_free(ExprLive *live) {
+    if (!live)
+        return;
+    free(live->nodes);
+    free(live->args);
+    free(live->uses);
+    free(live->use_start);
+    free(live->impure);
+    free(live->pending);
+    free(live->argv);
+    free(live);
+}
+
+/* Flat trees
+ *
+ * An ExprFlat holds a whole tree in one allocation. Nodes are numbered in
+ * post-order and addressed by 32-bit index instead of by pointer: node i is
+ * the opcode ops[i] and the operand operands[i], the index of its constant,
+ * variable or call. Children come right before their parent, so evaluation
+ * is a single pass over the two arrays with a stack of values, and the last
+ * child of node i is node i - 1. Names are kept as symbols, and repeated
+ * occurrences of a variable or call share one entry. A node takes 5 bytes,
+ * plus 8 for a number, where an ExprNode takes 56 in a separate allocation.
+ */
+
+#define EXPRLIB_FLAT_MAX (1u << 30) /* nodes and entries */
+
+typedef enum {
+    EXPR_FLAT_NUMBER,   /* constants[operand] */
+    EXPR_FLAT_VARIABLE, /* vars[operand] */
+    EXPR_FLAT_ADD,
+    EXPR_FLAT_SUB,
+    EXPR_FLAT_MUL,
+    EXPR_FLAT_DIV,
+    EXPR_FLAT_POW,
+    EXPR_FLAT_CALL /* calls[operand], over the argc subtrees before it */
+} ExprFlatOp;
+
+typedef struct {
+    int index; /* slot in ExprContext.variables */
+    ExprSymbol symbol;
+} ExprFlatVar;
+
+typedef struct {
+    ExprLibFnPtr fn;
+    ExprLibVecFnPtr vec_fn;
+    unsigned fn_flags;
+    int arity;
+    int argc;
+    ExprSymbol symbol;
+} ExprFlatCall;
+
+struct ExprFlat {
+    size_t size; /* bytes, this header included */
+    uint32_t node_count;
+    uint32_t max_depth; /* values on the stack while evaluating */
+    const double *constants;
+    const ExprFlatCall *calls;
+    const ExprFlatVar *vars;
+    const uint32_t *operands;
+    const uint8_t *ops;
+};
+
+/* Variables and calls are shared through one hash table. */
+enum { FLAT_KEY_VAR, FLAT_KEY_CALL };
+
+typedef struct {
+    uint32_t entry; /* (value << 1 | FLAT_KEY_*) + 1, 0 = empty */
+    uint32_t hash;
+} ExprFlatKey;
+
+typedef struct {
+    uint8_t *ops;
+    uint32_t *operands;
+    int node_count;
+    int op_cap;
+    int operand_cap;
+    int depth;
+    int max_depth;
+    double *constants;
+    int const_count;
+    int const_cap;
+    ExprFlatVar *vars;
+    int var_count;
+    int var_cap;
+    ExprFlatCall *calls;
+    int call_count;
+    int call_cap;
+    ExprFlatKey *keys;
+    size_t key_mask;
+    size_t key_count;
+} ExprFlatBuilder;
+
+static void flat_builder_free(ExprFlatBuilder *b) {
+    free(b->ops);
+    free(b->operands);
+    free(b->constants);
+    free(b->vars);
+    free(b->calls);
+    free(b->keys);
+}
+
+/* Keeps the table at most half full. */
+static bool flat_keys_reserve(ExprFlatBuilder *b) {
+    size_t capacity = b->keys ? b->key_mask + 1 : 0;
+    if ((b->key_count + 1) * 2 <= capacity)
+        return true;
+    size_t next = capacity ? capacity * 2 : 64;
+    ExprFlatKey *keys = calloc(next, sizeof(*keys));
+    if (!keys) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        if (!b->keys[i].entry)
+            continue;
+        size_t j = b->keys[i].hash & (next - 1);
+        while (keys[j].entry)
+            j = (j + 1) & (next - 1);
+        keys[j] = b->keys[i];
+    }
+    free(b->keys);
+    b->keys = keys;
+    b->key_mask = next - 1;
+    return true;
+}
+
+/* The entry value of key slot i if it holds a key of this kind and hash. */
+static bool flat_key_at(const ExprFlatBuilder *b, size_t i, unsigned kind,
+                        uint32_t hash, uint32_t *value) {
+    uint32_t entry = b->keys[i].entry - 1;
+    if (b->keys[i].hash != hash || (entry & 1u) != kind)
+        return false;
+    *value = entry >> 1;
+    return true;
+}
+
+static bool flat_key_add(ExprFlatBuilder *b, size_t i, unsigned kind,
+                         uint32_t hash, uint32_t value) {
+    if (value >= EXPRLIB_FLAT_MAX) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    b->keys[i] = (ExprFlatKey){(value << 1 | kind) + 1, hash};
+    b->key_count++;
+    return true;
+}
+
+static bool flat_var(ExprFlatBuilder *b, const ExprNodeVariable *v,
+                     uint32_t *slot) {
+    ExprFlatVar var = {.index = v->index, .symbol = v->symbol};
+    if (!flat_keys_reserve(b))
+        return false;
+    uint32_t hash = (uint32_t)cse_mix(
+        cse_mix(FLAT_KEY_VAR, (uint64_t)(unsigned)var.index), var.symbol);
+    size_t i = hash & b->key_mask;
+    for (; b->keys[i].entry; i = (i + 1) & b->key_mask) {
+        if (flat_key_at(b, i, FLAT_KEY_VAR, hash, slot) &&
+            b->vars[*slot].index == var.index &&
+            b->vars[*slot].symbol == var.symbol)
+            return true;
+    }
+    if (!grow_array((void **)&b->vars, &b->var_cap, b->var_count + 1,
+                    sizeof(*b->vars)))
+        return false;
+    *slot = (uint32_t)b->var_count;
+    b->vars[b->var_count++] = var;
+    return flat_key_add(b, i, FLAT_KEY_VAR, hash, *slot);
+}
+
+static bool flat_call(ExprFlatBuilder *b, const ExprNodeFunctionCall *c,
+                      uint32_t *slot) {
+    ExprFlatCall call = {.fn = c->fn,
+                         .vec_fn = c->vec_fn,
+                         .fn_flags = c->fn_flags,
+                         .arity = c->arity,
+                         .argc = c->argc,
+                         .symbol = c->symbol};
+    if (!flat_keys_reserve(b))
+        return false;
+    uint64_t h = cse_mix(FLAT_KEY_CALL, (uint64_t)(uintptr_t)call.fn);
+    h = cse_mix(h, (uint64_t)(uintptr_t)call.vec_fn);
+    h = cse_mix(h, (uint64_t)call.fn_flags << 32 | (unsigned)call.arity);
+    uint32_t hash = (uint32_t)cse_mix(
+        h, (uint64_t)(unsigned)call.argc << 32 | call.symbol);
+    size_t i = hash & b->key_mask;
+    for (; b->keys[i].entry; i = (i + 1) & b->key_mask) {
+        if (!flat_key_at(b, i, FLAT_KEY_CALL, hash, slot))
+            continue;
+        const ExprFlatCall *other = &b->calls[*slot];
+        if (other->fn == call.fn && other->vec_fn == call.vec_fn &&
+            other->fn_flags == call.fn_flags && other->arity == call.arity &&
+            other->argc == call.argc && other->symbol == call.symbol)
+            return true;
+    }
+    if (!grow_array((void **)&b->calls, &b->call_cap, b->call_count + 1,
+                    sizeof(*b->calls)))
+        return false;
+    *slot = (uint32_t)b->call_count;
+    b->calls[b->call_count++] = call;
+    return flat_key_add(b, i, FLAT_KEY_CALL, hash, *slot);
+}
+
+/* Appends node n, whose children are already in place. */
+static bool flat_emit(ExprFlatBuilder *b, const ExprNode *n) {
+    ExprFlatOp op;
+    uint32_t operand = 0;
+    int effect = 1; /* on the depth of the value stack */
 
-        switch (node->data.op_node.op) {
+    switch (n->type) {
+    case EXPR_NODE_NUMBER:
+        if (!grow_array((void **)&b->constants, &b->const_cap,
+                        b->const_count + 1, sizeof(double)))
+            return false;
+        op = EXPR_FLAT_NUMBER;
+        operand = (uint32_t)b->const_count;
+        b->constants[b->const_count++] = n->data.number;
+        break;
+    case EXPR_NODE_VARIABLE:
+        op = EXPR_FLAT_VARIABLE;
+        if (!flat_var(b, &n->data.variable, &operand))
+            return false;
+        break;
+    case EXPR_NODE_OPERATOR:
+        switch (n->data.op_node.op) {
         case '+':
-            return left_val + right_val;
+            op = EXPR_FLAT_ADD;
+            break;
         case '-':
-            return left_val - right_val;
+            op = EXPR_FLAT_SUB;
+            break;
         case '*':
-            return left_val * right_val;
+            op = EXPR_FLAT_MUL;
+            break;
         case '/':
-            if (right_val == 0.0) {
-                EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
-                return 0.0;
-            }
-            return left_val / right_val;
+            op = EXPR_FLAT_DIV;
+            break;
         case '^':
-            return pow(left_val, right_val);
+            op = EXPR_FLAT_POW;
+            break;
         default:
             EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
-            return 0.0;
+            return false;
+        }
+        effect = -1;
+        break;
+    case EXPR_NODE_FUNCTION_CALL:
+        if (!n->data.fn_call.fn) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_FUNCTION_NOT_FOUND;
+            return false;
         }
+        op = EXPR_FLAT_CALL;
+        if (!flat_call(b, &n->data.fn_call, &operand))
+            return false;
+        effect = 1 - n->data.fn_call.argc;
+        break;
+    default:
+        EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
+        return false;
     }
 
-    case EXPR_NODE_FUNCTION_CALL: {
-        const ExprLibFunction *fn = find_function(node->data.fn_call.name);
+    if ((uint32_t)b->node_count >= EXPRLIB_FLAT_MAX) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return false;
+    }
+    if (!grow_array((void **)&b->ops, &b->op_cap, b->node_count + 1,
+                    sizeof(*b->ops)) ||
+        !grow_array((void **)&b->operands, &b->operand_cap,
+                    b->node_count + 1, sizeof(*b->operands)))
+        return false;
+    b->ops[b->node_count] = (uint8_t)op;
+    b->operands[b->node_count] = operand;
+    b->node_count++;
+    b->depth += effect;
+    if (b->depth > b->max_depth)
+        b->max_depth = b->depth;
+    return true;
+}
 
-        if (!fn) {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
-            return 0.0;
+/* Walks expr in post-order like evaluate_node, emitting each finished node. */
+static bool flat_build(ExprFlatBuilder *b, const ExprNode *expr) {
+    ExprEvalFrame inline_frames[EXPRLIB_STACK_INLINE];
+    ExprEvalFrame *frames = inline_frames;
+    int frame_cap = EXPRLIB_STACK_INLINE, frame_count = 0;
+    bool ok = false;
+
+    frames[frame_count++] = (ExprEvalFrame){expr, 0};
+    while (frame_count > 0) {
+        ExprEvalFrame *f = &frames[frame_count - 1];
+        const ExprNode *n = f->node;
+        int argc = n->type == EXPR_NODE_OPERATOR        ? 2
+                   : n->type == EXPR_NODE_FUNCTION_CALL ? n->data.fn_call.argc
+                                                        : 0;
+        if (f->next < argc) {
+            const ExprNode *child = n->type == EXPR_NODE_OPERATOR
+                                        ? (f->next ? n->data.op_node.right
+                                                   : n->data.op_node.left)
+                                        : n->data.fn_call.args[f->next];
+            f->next++;
+            if (!child) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+                goto out;
+            }
+            if (frame_count == frame_cap &&
+                !stack_grow((void **)&frames, inline_frames, &frame_cap,
+                            sizeof(*frames)))
+                goto out;
+            frames[frame_count++] = (ExprEvalFrame){child, 0};
+            continue;
         }
+        if (!flat_emit(b, n))
+            goto out;
+        frame_count--;
+    }
+    ok = true;
 
-        int argc = node->data.fn_call.argc;
-        if (fn->arity != -1 && fn->arity != argc) {
-            EXPRLIB_ERROR = EXPRLIB_ERROR_SYNTAX;
-            printf("SYNTAX ERROR: Function '%s' expects %d arguments, got %d\n",
-                   fn->name, fn->arity, argc);
-            return 0.0;
+out:
+    stack_release(frames, inline_frames);
+    return ok;
+}
+
+/* Packs the builder's arrays into one block, most strictly aligned first. */
+static ExprFlat *flat_pack(const ExprFlatBuilder *b) {
+    size_t n = (size_t)b->node_count;
+    size_t constants = sizeof(ExprFlat);
+    size_t calls = constants + sizeof(double) * b->const_count;
+    size_t vars = calls + sizeof(ExprFlatCall) * b->call_count;
+    size_t operands = vars + sizeof(ExprFlatVar) * b->var_count;
+    size_t ops = operands + sizeof(uint32_t) * n;
+    size_t size = ops + n;
+
+    char *block = malloc(size);
+    if (!block) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    ExprFlat *flat = (ExprFlat *)block;
+    *flat = (ExprFlat){
+        .size = size,
+        .node_count = (uint32_t)n,
+        .max_depth = (uint32_t)b->max_depth,
+        .constants = (const double *)(block + constants),
+        .calls = (const ExprFlatCall *)(block + calls),
+        .vars = (const ExprFlatVar *)(block + vars),
+        .operands = (const uint32_t *)(block + operands),
+        .ops = (const uint8_t *)(block + ops),
+    };
+    if (b->const_count)
+        memcpy(block + constants, b->constants,
+               sizeof(double) * b->const_count);
+    if (b->call_count)
+        memcpy(block + calls, b->calls, sizeof(ExprFlatCall) * b->call_count);
+    if (b->var_count)
+        memcpy(block + vars, b->vars, sizeof(ExprFlatVar) * b->var_count);
+    memcpy(block + operands, b->operands, sizeof(uint32_t) * n);
+    memcpy(block + ops, b->ops, n);
+    return flat;
+}
+
+ExprFlat *exprlib_flat_create(const ExprNode *expr) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!expr) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    ExprFlatBuilder b = {0};
+    ExprFlat *flat = flat_build(&b, expr) ? flat_pack(&b) : NULL;
+    flat_builder_free(&b);
+    return flat;
+}
+
+ExprFlat *exprlib_flat_parse(const string expression,
+                             const ExprContext *context,
+                             ExprLibDiagnostic *diag) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    ExprArena *arena = exprlib_arena_create(0);
+    if (!arena)
+        return NULL;
+    ExprNode *ast = parse_source(expression, context, arena, diag);
+    ExprFlat *flat = ast ? exprlib_flat_create(ast) : NULL;
+    exprlib_arena_destroy(arena);
+    return flat;
+}
+
+size_t exprlib_flat_size(const ExprFlat *flat) {
+    return flat ? flat->size : 0;
+}
+
+void exprlib_flat_free(ExprFlat *flat) { free(flat); }
+
+double exprlib_flat_evaluate(const ExprFlat *flat, const ExprContext *context) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!flat) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return 0.0;
+    }
+
+    double inline_values[EXPRLIB_STACK_INLINE];
+    double *values = flat->max_depth <= EXPRLIB_STACK_INLINE
+                         ? inline_values
+                         : malloc(sizeof(double) * flat->max_depth);
+    if (!values) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return 0.0;
+    }
+    int var_count = context ? context->var_count : 0;
+    double *sp = values; /* one past the top */
+    double result = 0.0;
+
+    for (uint32_t i = 0; i < flat->node_count; ++i) {
+        uint32_t arg = flat->operands[i];
+        switch ((ExprFlatOp)flat->ops[i]) {
+        case EXPR_FLAT_NUMBER:
+            *sp++ = flat->constants[arg];
+            break;
+        case EXPR_FLAT_VARIABLE: {
+            int index = flat->vars[arg].index;
+            if (index < 0 || index >= var_count) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_UNDEFINED_VARIABLE;
+                goto done;
+            }
+            *sp++ = *context->variables[index].value;
+            break;
         }
+        case EXPR_FLAT_ADD:
+            sp--;
+            sp[-1] += sp[0];
+            break;
+        case EXPR_FLAT_SUB:
+            sp--;
+            sp[-1] -= sp[0];
+            break;
+        case EXPR_FLAT_MUL:
+            sp--;
+            sp[-1] *= sp[0];
+            break;
+        case EXPR_FLAT_DIV:
+            sp--;
+            if (sp[0] == 0.0) {
+                EXPRLIB_ERROR = EXPRLIB_ERROR_DIVISION_BY_ZERO;
+                goto done;
+            }
+            sp[-1] /= sp[0];
+            break;
+        case EXPR_FLAT_POW:
+            sp--;
+            sp[-1] = pow(sp[-1], sp[0]);
+            break;
+        case EXPR_FLAT_CALL: {
+            const ExprFlatCall *call = &flat->calls[arg];
+            sp -= call->argc;
+            *sp = call_function(call->fn, call->fn_flags, sp, call->argc);
+            sp++;
+            if (EXPRLIB_ERROR != EXPRLIB_SUCCESS)
+                goto done;
+            break;
+        }
+        }
+    }
+    result = values[0];
+
+done:
+    if (values != inline_values)
+        free(values);
+    return EXPRLIB_ERROR == EXPRLIB_SUCCESS ? result : 0.0;
+}
+
+static int flat_argc(const ExprFlat *flat, uint32_t i) {
+    switch ((ExprFlatOp)flat->ops[i]) {
+    case EXPR_FLAT_NUMBER:
+    case EXPR_FLAT_VARIABLE:
+        return 0;
+    case EXPR_FLAT_CALL:
+        return flat->calls[flat->operands[i]].argc;
+    default:
+        return 2;
+    }
+}
+
+static const char g_flat_operators[] = {
+    [EXPR_FLAT_ADD] = '+', [EXPR_FLAT_SUB] = '-', [EXPR_FLAT_MUL] = '*',
+    [EXPR_FLAT_DIV] = '/', [EXPR_FLAT_POW] = '^',
+};
+
+ExprNode *exprlib_flat_expand(const ExprFlat *flat) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!flat) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
 
-        double *argv = alloca(sizeof(double) * argc);
-        for (int i = 0; i < argc; ++i)
-            argv[i] = evaluate_node(node->data.fn_call.args[i], context);
+    /* the nodes built so far that have no parent yet */
+    ExprNode *inline_done[EXPRLIB_STACK_INLINE];
+    ExprNode **done = inline_done;
+    int done_cap = EXPRLIB_STACK_INLINE, done_count = 0;
+    ExprNode *result = NULL;
 
-        return fn->fn(argv, argc);
+    for (uint32_t i = 0; i < flat->node_count; ++i) {
+        uint32_t arg = flat->operands[i];
+        int argc = flat_argc(flat, i);
+        ExprNode *node = NULL;
+        switch ((ExprFlatOp)flat->ops[i]) {
+        case EXPR_FLAT_NUMBER:
+            node = new_number_node(NULL, flat->constants[arg]);
+            break;
+        case EXPR_FLAT_VARIABLE:
+            node = new_variable_node(NULL, flat->vars[arg].symbol,
+                                     flat->vars[arg].index);
+            break;
+        case EXPR_FLAT_CALL: {
+            const ExprFlatCall *call = &flat->calls[arg];
+            ExprNode **args = NULL;
+            if (argc) {
+                args = malloc(sizeof(*args) * argc);
+                if (!args) {
+                    EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+                    goto fail;
+                }
+                memcpy(args, done + done_count - argc, sizeof(*args) * argc);
+            }
+            node = new_function_node(NULL, call->symbol, call->fn,
+                                     call->vec_fn, call->fn_flags, call->arity,
+                                     args, argc);
+            if (!node)
+                free(args);
+            break;
+        }
+        default:
+            node = new_operator_node(NULL, g_flat_operators[flat->ops[i]],
+                                     done[done_count - 2],
+                                     done[done_count - 1]);
+            break;
+        }
+        if (!node)
+            goto fail;
+        done_count -= argc;
+        if (done_count == done_cap &&
+            !stack_grow((void **)&done, inline_done, &done_cap,
+                        sizeof(*done))) {
+            exprlib_free(node);
+            goto fail;
+        }
+        done[done_count++] = node;
     }
+    result = done[0];
+    done_count = 0;
+
+fail:
+    for (int i = 0; i < done_count; ++i)
+        exprlib_free(done[i]);
+    stack_release(done, inline_done);
+    return result;
+}
 
+/* Same output as print_expr_tree. start[i] is the first node of the subtree
+ * rooted at i, so the child before child c is the node at start[c] - 1. */
+static void print_flat_node(const ExprFlat *flat, const uint32_t *start,
+                            uint32_t i, int indent) {
+    print_indent(indent);
+    uint32_t arg = flat->operands[i];
+    switch ((ExprFlatOp)flat->ops[i]) {
+    case EXPR_FLAT_NUMBER:
+        printf("NUMBER: %g\n", flat->constants[arg]);
+        break;
+    case EXPR_FLAT_VARIABLE:
+        printf("VARIABLE: %s\n", symbol_name(flat->vars[arg].symbol));
+        break;
+    case EXPR_FLAT_CALL: {
+        const ExprFlatCall *call = &flat->calls[arg];
+        printf("FUNCTION CALL: %s (argc=%d)\n", symbol_name(call->symbol),
+               call->argc);
+        uint32_t *args = malloc(sizeof(*args) * (call->argc + 1));
+        if (!args)
+            break;
+        uint32_t child = i - 1;
+        for (int k = call->argc - 1; k >= 0; --k) {
+            args[k] = child;
+            child = start[child] - 1;
+        }
+        for (int k = 0; k < call->argc; ++k) {
+            print_indent(indent + 2);
+            printf("ARG %d:\n", k);
+            print_flat_node(flat, start, args[k], indent + 4);
+        }
+        free(args);
+        break;
+    }
     default:
+        printf("OPERATOR: '%c'\n", g_flat_operators[flat->ops[i]]);
+        print_indent(indent);
+        printf("LHS:\n");
+        print_flat_node(flat, start, start[i - 1] - 1, indent + 2);
+        print_indent(indent);
+        printf("RHS:\n");
+        print_flat_node(flat, start, i - 1, indent + 2);
+        break;
+    }
+}
+
+void print_flat_expr(const ExprFlat *flat) {
+    if (!flat) {
+        printf("(null)\n");
+        return;
+    }
+    uint32_t *start = malloc(sizeof(*start) * flat->node_count);
+    if (!start) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return;
+    }
+    for (uint32_t i = 0; i < flat->node_count; ++i) {
+        uint32_t first = i;
+        for (int k = flat_argc(flat, i); k > 0; --k)
+            first = start[first - 1];
+        start[i] = first;
+    }
+    print_flat_node(flat, start, flat->node_count - 1, 0);
+    free(start);
+}
+
+/* Serialized programs
+ *
+ * exprlib_save writes a compiled program as a self-contained blob:
+ *
+ *   ExprBlobHeader | constants (double) | code (ExprInstr) | function names
+ *
+ * padded to a multiple of 8 bytes, so blobs can simply be concatenated into
+ * one file. Everything is stored in host byte order and layout; byte_order
+ * detects a file written on the other endianness. The blob has no pointers:
+ * functions are stored by their registered name and bound again on load.
+ * Constants and code are read in place, so a loaded program points straight
+ * into the caller's buffer or an ExprBundle mapping, and loading costs one
+ * allocation for the program and its function table. The opcode numbering
+ * is part of the format: new opcodes go at the end of ExprOpcode, and
+ * EXPRLIB_BLOB_VERSION is bumped whenever an existing one changes meaning.
+ * Every blob is validated before use (bounds, operand ranges and stack depth
+ * of each instruction), so a corrupt file is rejected rather than run.
+ */
+
+#define EXPRLIB_BLOB_MAGIC "EXPB"
+#define EXPRLIB_BLOB_VERSION 1
+#define EXPRLIB_BLOB_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[4];
+    uint32_t byte_order;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t size; /* whole blob, including header and padding */
+    uint32_t code_len;
+    uint32_t const_count;
+    uint32_t function_count;
+    uint32_t names_size; /* one NUL-terminated name per function */
+    uint32_t max_stack;
+    uint32_t temp_count;
+    uint32_t var_count;
+    uint32_t reserved;
+} ExprBlobHeader;
+
+_Static_assert(sizeof(ExprBlobHeader) % 8 == 0, "constants must stay aligned");
+_Static_assert(sizeof(ExprInstr) == 8, "ExprInstr is stored as is");
+
+/* Checks the stack effect and operand of every instruction. */
+static bool program_validate(const ExprCompiled *p) {
+    int depth = 0;
+    for (int i = 0; i < p->code_len; ++i) {
+        const ExprInstr *ins = &p->code[i];
+        int need = 0, effect = 0, arg = ins->arg, limit = -1;
+        switch ((ExprOpcode)ins->op) {
+        case EXPR_OP_CONST:
+            effect = 1;
+            limit = p->const_count;
+            break;
+        case EXPR_OP_VAR:
+            effect = 1;
+            limit = p->var_count;
+            break;
+        case EXPR_OP_ADD:
+        case EXPR_OP_SUB:
+        case EXPR_OP_MUL:
+        case EXPR_OP_DIV:
+        case EXPR_OP_POW:
+            need = 2;
+            effect = -1;
+            break;
+        case EXPR_OP_CALL:
+        case EXPR_OP_MEMO:
+            need = ins->argc;
+            effect = 1 - ins->argc;
+            limit = p->function_count;
+            break;
+        case EXPR_OP_STORE:
+            need = 1;
+            limit = p->temp_count;
+            break;
+        case EXPR_OP_LOAD:
+            effect = 1;
+            limit = p->temp_count;
+            break;
+        case EXPR_OP_DUP:
+            need = 1;
+            effect = 1;
+            break;
+        case EXPR_OP_RECIP:
+        case EXPR_OP_SQRT:
+        case EXPR_OP_CBRT:
+        case EXPR_OP_ABS:
+        case EXPR_OP_SIN:
+        case EXPR_OP_COS:
+        case EXPR_OP_EXP:
+        case EXPR_OP_LN:
+        case EXPR_OP_FSQRT:
+        case EXPR_OP_FLOOR:
+            need = 1;
+            break;
+        case EXPR_OP_MIN:
+        case EXPR_OP_MAX:
+            need = 2;
+            effect = -1;
+            break;
+        default:
+            return false;
+        }
+        if (limit >= 0 && (arg < 0 || arg >= limit))
+            return false;
+        if (depth < need)
+            return false;
+        depth += effect;
+        if (depth > p->max_stack)
+            return false;
+    }
+    /* both bound the VM's stack allocation */
+    return depth == 1 && p->max_stack <= p->code_len &&
+           p->temp_count <= p->code_len;
+}
+
+/* Name a program's function i was registered under. */
+static const char *blob_function_name(const ExprLibRegistry *r,
+                                      const ExprCompiled *p, int i) {
+    const ExprLibFunctionTable *t = &r->functions;
+    for (size_t s = 0; s < t->capacity; ++s) {
+        const ExprLibFunction *f = &t->slots[s];
+        if (f->name && f->fn == p->functions[i] &&
+            f->vec_fn == p->vec_functions[i])
+            return f->name;
+    }
+    return NULL;
+}
+
+bool exprlib_save(const ExprCompiled *program, FILE *out) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!program || !out) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return false;
+    }
+
+    unsigned long epoch;
+    const ExprLibRegistry *r = registry_read_begin(&epoch);
+    const char **names = NULL;
+    if (program->function_count) {
+        names = malloc(sizeof(*names) * program->function_count);
+        if (!names) {
+            registry_read_end(epoch);
+            EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+            return false;
+        }
+    }
+    size_t names_size = 0;
+    for (int i = 0; i < program->function_count; ++i) {
+        names[i] = blob_function_name(r, program, i);
+        if (!names[i]) {
+            registry_read_end(epoch);
+            free(names);
+            EXPRLIB_ERROR = EXPRLIB_ERROR_FUNCTION_NOT_FOUND;
+            return false;
+        }
+        names_size += strlen(names[i]) + 1;
+    }
+
+    size_t size = sizeof(ExprBlobHeader) +
+                  sizeof(double) * program->const_count +
+                  sizeof(ExprInstr) * program->code_len + names_size;
+    size_t padded = (size + 7) & ~(size_t)7;
+    if (padded > UINT32_MAX) {
+        registry_read_end(epoch);
+        free(names);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    ExprBlobHeader h = {
+        .byte_order = EXPRLIB_BLOB_BYTE_ORDER,
+        .version = EXPRLIB_BLOB_VERSION,
+        .header_size = sizeof(ExprBlobHeader),
+        .size = (uint32_t)padded,
+        .code_len = (uint32_t)program->code_len,
+        .const_count = (uint32_t)program->const_count,
+        .function_count = (uint32_t)program->function_count,
+        .names_size = (uint32_t)names_size,
+        .max_stack = (uint32_t)program->max_stack,
+        .temp_count = (uint32_t)program->temp_count,
+        .var_count = (uint32_t)program->var_count,
+    };
+    memcpy(h.magic, EXPRLIB_BLOB_MAGIC, sizeof(h.magic));
+    fwrite(&h, sizeof(h), 1, out);
+    if (program->const_count)
+        fwrite(program->constants, sizeof(double), program->const_count, out);
+    fwrite(program->code, sizeof(ExprInstr), program->code_len, out);
+    for (int i = 0; i < program->function_count; ++i)
+        fwrite(names[i], 1, strlen(names[i]) + 1, out);
+    static const char zeros[8];
+    fwrite(zeros, 1, padded - size, out);
+    registry_read_end(epoch);
+    free(names);
+
+    if (ferror(out)) {
         EXPRLIB_ERROR = EXPRLIB_ERROR_UNKNOWN;
-        return 0.0;
+        return false;
     }
+    return true;
 }
 
-double exprlib_evaluate(const ExprNode *expr, const ExprContext *context) {
+ExprCompiled *exprlib_load(const void *data, size_t size, size_t *used) {
     EXPRLIB_ERROR = EXPRLIB_SUCCESS;
-    return evaluate_node(expr, context);
+    if (!data) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    ExprBlobHeader h;
+    if (size < sizeof(h) || (uintptr_t)data % _Alignof(double) != 0) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+    memcpy(&h, data, sizeof(h));
+    uint64_t body = sizeof(h) + (uint64_t)h.const_count * sizeof(double) +
+                    (uint64_t)h.code_len * sizeof(ExprInstr) + h.names_size;
+    if (memcmp(h.magic, EXPRLIB_BLOB_MAGIC, 4) != 0 ||
+        h.byte_order != EXPRLIB_BLOB_BYTE_ORDER ||
+        h.version != EXPRLIB_BLOB_VERSION || h.header_size != sizeof(h) ||
+        h.size % 8 != 0 || h.size > size || body > h.size ||
+        h.code_len > INT32_MAX || h.function_count > h.names_size ||
+        h.max_stack > INT32_MAX || h.temp_count > INT32_MAX ||
+        h.var_count > INT32_MAX) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+
+    const char *bytes = data;
+    size_t table = sizeof(ExprLibFnPtr) + sizeof(ExprLibVecFnPtr);
+    ExprCompiled *p = calloc(1, sizeof(*p) + table * h.function_count);
+    if (!p) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+    atomic_init(&p->refs, 1);
+    p->borrowed = true;
+    p->constants = (double *)(bytes + sizeof(h));
+    p->const_count = (int)h.const_count;
+    p->code = (ExprInstr *)(bytes + sizeof(h) + sizeof(double) * h.const_count);
+    p->code_len = (int)h.code_len;
+    p->functions = (ExprLibFnPtr *)(p + 1);
+    p->vec_functions = (ExprLibVecFnPtr *)(p->functions + h.function_count);
+    p->function_count = (int)h.function_count;
+    p->max_stack = (int)h.max_stack;
+    p->temp_count = (int)h.temp_count;
+    p->var_count = (int)h.var_count;
+    if (!program_validate(p)) {
+        free(p);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+
+    /* bind the names against the current registry */
+    const char *name = (const char *)(p->code + p->code_len);
+    const char *names_end = name + h.names_size;
+    unsigned long epoch;
+    const ExprLibRegistry *r = registry_read_begin(&epoch);
+    for (int i = 0; i < p->function_count; ++i) {
+        size_t len = strnlen(name, (size_t)(names_end - name));
+        if (name + len == names_end) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+            break;
+        }
+        const ExprLibFunction *f = lookup_function(r, symbol_find(name, len));
+        if (!f) {
+            EXPRLIB_ERROR = EXPRLIB_ERROR_FUNCTION_NOT_FOUND;
+            break;
+        }
+        for (int k = 0; k < p->code_len; ++k) {
+            const ExprInstr *ins = &p->code[k];
+            bool call = ins->op == EXPR_OP_CALL || ins->op == EXPR_OP_MEMO;
+            if (call && ins->arg == i && f->arity >= 0 &&
+                ins->argc != f->arity)
+                EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        }
+        p->functions[i] = f->fn;
+        p->vec_functions[i] = f->vec_fn;
+        name += len + 1;
+    }
+    registry_read_end(epoch);
+    if (EXPRLIB_ERROR != EXPRLIB_SUCCESS) {
+        free(p);
+        return NULL;
+    }
+    if (used)
+        *used = h.size;
+    return p;
+}
+
+/* Bundles: a read-only mapping of concatenated blobs */
+
+struct ExprBundle {
+    void *map;
+    size_t map_size;
+    ExprCompiled **programs;
+    size_t count;
+};
+
+void exprlib_bundle_close(ExprBundle *bundle) {
+    if (!bundle)
+        return;
+    for (size_t i = 0; i < bundle->count; ++i)
+        exprlib_free_compiled(bundle->programs[i]);
+    free(bundle->programs);
+    if (bundle->map)
+        munmap(bundle->map, bundle->map_size);
+    free(bundle);
+}
+
+ExprBundle *exprlib_bundle_open(const char *path) {
+    EXPRLIB_ERROR = EXPRLIB_SUCCESS;
+    if (!path) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_NULL;
+        return NULL;
+    }
+    ExprBundle *bundle = calloc(1, sizeof(*bundle));
+    if (!bundle) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        free(bundle);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        bundle->map_size = (size_t)st.st_size;
+        bundle->map =
+            mmap(NULL, bundle->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bundle->map == MAP_FAILED)
+            bundle->map = NULL;
+    }
+    close(fd);
+    if (st.st_size > 0 && !bundle->map) {
+        free(bundle);
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+
+    size_t offset = 0, cap = 0;
+    while (offset < bundle->map_size) {
+        if (bundle->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            ExprCompiled **tmp =
+                realloc(bundle->programs, sizeof(*tmp) * cap);
+            if (!tmp) {
+                exprlib_bundle_close(bundle);
+                EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+                return NULL;
+            }
+            bundle->programs = tmp;
+        }
+        size_t used;
+        ExprCompiled *p = exprlib_load((const char *)bundle->map + offset,
+                                       bundle->map_size - offset, &used);
+        if (!p) {
+            ExprLibError error = EXPRLIB_ERROR;
+            exprlib_bundle_close(bundle);
+            EXPRLIB_ERROR = error;
+            return NULL;
+        }
+        bundle->programs[bundle->count++] = p;
+        offset += used;
+    }
+    return bundle;
+}
+
+size_t exprlib_bundle_count(const ExprBundle *bundle) {
+    return bundle ? bundle->count : 0;
+}
+
+const ExprCompiled *exprlib_bundle_get(const ExprBundle *bundle,
+                                       size_t index) {
+    if (!bundle || index >= bundle->count) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+    return bundle->programs[index];
+}
+
+static const char *opcode_name(ExprOpcode op) {
+    switch (op) {
+    case EXPR_OP_CONST:
+        return "CONST";
+    case EXPR_OP_VAR:
+        return "VAR";
+    case EXPR_OP_ADD:
+        return "ADD";
+    case EXPR_OP_SUB:
+        return "SUB";
+    case EXPR_OP_MUL:
+        return "MUL";
+    case EXPR_OP_DIV:
+        return "DIV";
+    case EXPR_OP_POW:
+        return "POW";
+    case EXPR_OP_CALL:
+        return "CALL";
+    case EXPR_OP_MEMO:
+        return "MEMO";
+    case EXPR_OP_STORE:
+        return "STORE";
+    case EXPR_OP_LOAD:
+        return "LOAD";
+    case EXPR_OP_DUP:
+        return "DUP";
+    case EXPR_OP_RECIP:
+        return "RECIP";
+    case EXPR_OP_SQRT:
+        return "SQRT";
+    case EXPR_OP_CBRT:
+        return "CBRT";
+    case EXPR_OP_ABS:
+        return "ABS";
+    case EXPR_OP_OUTPUT:
+        return "OUTPUT";
+    case EXPR_OP_SIN:
+        return "SIN";
+    case EXPR_OP_COS:
+        return "COS";
+    case EXPR_OP_EXP:
+        return "EXP";
+    case EXPR_OP_LN:
+        return "LN";
+    case EXPR_OP_FSQRT:
+        return "FSQRT";
+    case EXPR_OP_FLOOR:
+        return "FLOOR";
+    case EXPR_OP_MIN:
+        return "MIN";
+    case EXPR_OP_MAX:
+        return "MAX";
+    }
+    return "?";
+}
+
+ExprProfileCounter exprlib_profile_instruction(const ExprProfile *profile,
+                                               const ExprCompiled *program,
+                                               int index) {
+    if (!profile || !program || index < 0 || index >= program->code_len)
+        return (ExprProfileCounter){0, 0};
+    const ExprProfileSlot *slot =
+        profile_find(&profile->sites, (uintptr_t)&program->code[index]);
+    return slot ? (ExprProfileCounter){slot->count, slot->ns}
+                : (ExprProfileCounter){0, 0};
+}
+
+static void print_program(const ExprCompiled *program,
+                          const ExprProfile *profile) {
+    if (!program) {
+        printf("(null)\n");
+        return;
+    }
+    printf("PROGRAM: %d instructions, %d constants, max stack %d, %d temps\n",
+           program->code_len, program->const_count, program->max_stack,
+           program->temp_count);
+    for (int i = 0; i < program->code_len; ++i) {
+        const ExprInstr *ins = &program->code[i];
+        printf("  %4d  ", i);
+        if (profile)
+            printf("%10llu  ",
+                   exprlib_profile_instruction(profile, program, i).count);
+        printf("%-6s", opcode_name((ExprOpcode)ins->op));
+        switch ((ExprOpcode)ins->op) {
+        case EXPR_OP_CONST:
+            printf(" %g", program->constants[ins->arg]);
+            break;
+        case EXPR_OP_VAR:
+            printf(" #%d", ins->arg);
+            break;
+        case EXPR_OP_CALL:
+        case EXPR_OP_MEMO:
+            printf(" fn#%d argc=%d", ins->arg, ins->argc);
+            break;
+        case EXPR_OP_STORE:
+        case EXPR_OP_LOAD:
+            printf(" t%d", ins->arg);
+            break;
+        default:
+            break;
+        }
+        putchar('\n');
+    }
+}
+
+void print_compiled_expr(const ExprCompiled *program) {
+    print_program(program, NULL);
+}
+
+void print_compiled_profile(const ExprCompiled *program,
+                            const ExprProfile *profile) {
+    print_program(program, profile);
 }
 
 void exprlib_init(void) {
-    g_functions = NULL;
-    g_function_count = 0;
-    exprlib_register_builtins();
+    pthread_once(&g_factorials_once, factorials_fill);
+    ExprLibRegistry *next = calloc(1, sizeof(*next));
+    if (!next) {
+        EXPRLIB_ERROR = EXPRLIB_ERROR_MALLOC_FAILED;
+        return;
+    }
+    exprlib_register_builtins(next);
+
+    pthread_mutex_lock(&g_registry_lock);
+    registry_publish(next);
+    pthread_mutex_unlock(&g_registry_lock);
 }
\ No newline at end of file
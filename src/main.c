@@ -1,7 +1,595 @@
 #include "exprlib.h"
 
-int main() {
-    exprlib_init();
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* expr [options] [name=]formula...
+ *
+ * Streams rows of variables through one or more formulas and writes a row
+ * of results for each. Input is a CSV file whose header names the columns,
+ * or with -b raw rows of doubles. The rows are cut into chunks that go
+ * around a ring of PIPELINE_DEPTH buffers: a reader thread parses chunk
+ * i + 1 while the main thread evaluates chunk i with the batch engine and a
+ * writer thread formats chunk i - 1, so memory stays bounded whatever the
+ * size of the input. Without formulas, runs the built-in demo.
+ */
+
+#define PIPELINE_DEPTH 4
+#define DEFAULT_CHUNK_ROWS 65536
+#define IO_BUFFER (1u << 20)
+#define NUMBER_MAX 32 /* longest "%.17g" plus a separator */
+
+typedef enum { CHUNK_FREE, CHUNK_READ, CHUNK_EVALUATED } ChunkState;
+
+typedef struct {
+    double *columns; /* column c at columns + c * rows_cap */
+    double *outputs; /* output k at outputs + k * rows_cap */
+    size_t rows;
+    size_t first_row; /* of the whole input, from 0 */
+    bool last;
+    ChunkState state;
+} Chunk;
+
+/* Complete lines out of chunked reads */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start, end; /* unread bytes are buf[start, end) */
+    bool eof;
+    size_t line; /* lines returned so far */
+} LineReader;
+
+typedef struct {
+    int in, out;
+    bool binary;
+    int digits; /* of CSV output, 0 for round trip */
+    int column_count;
+    int output_count;
+    char **output_names;
+    size_t rows_cap;
+    LineReader lines;
+
+    const ExprProgram *program;
+    ExprContext *context;
+    ExprThreadPool *pool;
+
+    Chunk chunks[PIPELINE_DEPTH];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool stop;
+    bool read_done, evaluate_done; /* nothing more will reach that state */
+    char error[256];
+} Pipeline;
+
+static void pipeline_fail(Pipeline *p, const char *fmt, ...) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->stop) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(p->error, sizeof(p->error), fmt, ap);
+        va_end(ap);
+        p->stop = true;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* The next chunk for a stage, or NULL once none is coming. The reader stops
+ * as soon as the pipeline has failed; the later stages still take every
+ * chunk passed on before, so the rows ahead of an error are written. */
+static Chunk *chunk_wait(Pipeline *p, size_t i, ChunkState state) {
+    Chunk *chunk = &p->chunks[i % PIPELINE_DEPTH];
+    const bool *done = state == CHUNK_FREE   ? &p->stop
+                       : state == CHUNK_READ ? &p->read_done
+                                             : &p->evaluate_done;
+    pthread_mutex_lock(&p->lock);
+    while (!*done && chunk->state != state)
+        pthread_cond_wait(&p->changed, &p->lock);
+    if (state == CHUNK_FREE ? p->stop : chunk->state != state)
+        chunk = NULL;
+    pthread_mutex_unlock(&p->lock);
+    return chunk;
+}
+
+static void stage_done(Pipeline *p, bool *done) {
+    pthread_mutex_lock(&p->lock);
+    *done = true;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void chunk_pass(Pipeline *p, Chunk *chunk, ChunkState state) {
+    pthread_mutex_lock(&p->lock);
+    chunk->state = state;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Input */
+
+/* Fills buf up to size bytes; returns the bytes read, short only at the end
+ * of the input, or -1. */
+static ssize_t read_full(int fd, void *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = read(fd, (char *)buf + done, size - done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        done += (size_t)got;
+    }
+    return (ssize_t)done;
+}
+
+/* The next line without its newline, NULL at the end of the input or with
+ * errno set on a read error. The line is followed by '\n' in the buffer, so
+ * a number is never read past it. */
+static char *line_next(LineReader *r, size_t *len) {
+    for (;;) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line, '\n', r->end - r->start);
+        if (nl) {
+            *len = (size_t)(nl - line);
+            r->start = (size_t)(nl + 1 - r->buf);
+            r->line++;
+            return line;
+        }
+        if (r->start > 0) {
+            memmove(r->buf, line, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->end == r->cap) {
+            char *grown = realloc(r->buf, r->cap * 2);
+            if (!grown)
+                return NULL;
+            r->buf = grown;
+            r->cap *= 2;
+        }
+        if (r->eof) {
+            if (r->end == 0) {
+                errno = 0;
+                return NULL;
+            }
+            r->buf[r->end++] = '\n'; /* last line without a newline */
+            continue;
+        }
+        ssize_t got = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return NULL;
+        if (got == 0)
+            r->eof = true;
+        r->end += (size_t)got;
+    }
+}
+
+static bool blank_line(const char *line, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+            return false;
+    }
+    return true;
+}
+
+/* Splits a header or -c list into names: trimmed, quotes dropped. */
+static char **split_names(const char *list, size_t len, int *count) {
+    int n = 1;
+    for (size_t i = 0; i < len; ++i)
+        n += list[i] == ',';
+    char **names = calloc((size_t)n, sizeof(*names));
+    if (!names)
+        return NULL;
+    const char *field = list, *end = list + len;
+    for (int i = 0; i < n; ++i) {
+        const char *stop = memchr(field, ',', (size_t)(end - field));
+        if (!stop)
+            stop = end;
+        const char *a = field, *b = stop;
+        while (a < b && (*a == ' ' || *a == '\t'))
+            a++;
+        while (b > a && (b[-1] == ' ' || b[-1] == '\t' || b[-1] == '\r'))
+            b--;
+        if (b - a >= 2 && *a == '"' && b[-1] == '"') {
+            a++;
+            b--;
+        }
+        names[i] = strndup(a, (size_t)(b - a));
+        if (!names[i]) {
+            while (i-- > 0)
+                free(names[i]);
+            free(names);
+            return NULL;
+        }
+        field = stop + 1;
+    }
+    *count = n;
+    return names;
+}
+
+/* A field: a signed literal through the library's correctly rounded
+ * scanner, anything else (nan, inf, hex) through strtod. */
+static double read_number(const char *s, const char **after) {
+    const char *digits = s + (*s == '-' || *s == '+');
+    bool hex = digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X');
+    bool found = false;
+    double v = 0.0;
+    if (!hex && ((*digits >= '0' && *digits <= '9') || *digits == '.'))
+        v = parse_number(&digits, &found);
+    if (found) {
+        *after = digits;
+        return *s == '-' ? -v : v;
+    }
+    char *end;
+    v = strtod(s, &end);
+    *after = end;
+    return v;
+}
+
+/* Reads one CSV row into column slot `row` of the chunk. */
+static bool csv_row(Pipeline *p, Chunk *chunk, size_t row, const char *line,
+                    size_t len) {
+    const char *s = line, *end = line + len;
+    for (int c = 0; c < p->column_count; ++c) {
+        /* the number readers would skip the newline of an empty field */
+        while (s < end && (*s == ' ' || *s == '\t'))
+            s++;
+        const char *after = s;
+        double v = s < end ? read_number(s, &after) : 0.0;
+        if (s == end || after == s) {
+            pipeline_fail(p, "line %zu: column %d is not a number",
+                          p->lines.line, c + 1);
+            return false;
+        }
+        s = after;
+        while (s < end && (*s == ' ' || *s == '\t' || *s == '\r'))
+            s++;
+        bool last = c == p->column_count - 1;
+        if (last ? s != end : (s == end || *s != ',')) {
+            pipeline_fail(p, "line %zu: expected %d columns", p->lines.line,
+                          p->column_count);
+            return false;
+        }
+        s++;
+        chunk->columns[(size_t)c * p->rows_cap + row] = v;
+    }
+    return true;
+}
+
+static bool csv_fill(Pipeline *p, Chunk *chunk) {
+    chunk->rows = 0;
+    while (chunk->rows < p->rows_cap) {
+        size_t len;
+        char *line = line_next(&p->lines, &len);
+        if (!line) {
+            if (errno) {
+                pipeline_fail(p, "read: %s", strerror(errno));
+                return false;
+            }
+            chunk->last = true;
+            break;
+        }
+        if (blank_line(line, len))
+            continue;
+        if (!csv_row(p, chunk, chunk->rows, line, len))
+            return false;
+        chunk->rows++;
+    }
+    return true;
+}
+
+/* Rows of column_count doubles, transposed into the chunk's columns */
+static bool binary_fill(Pipeline *p, Chunk *chunk, double *raw) {
+    size_t row_size = sizeof(double) * (size_t)p->column_count;
+    ssize_t got = read_full(p->in, raw, row_size * p->rows_cap);
+    if (got < 0) {
+        chunk->rows = 0;
+        pipeline_fail(p, "read: %s", strerror(errno));
+        return false;
+    }
+    chunk->rows = (size_t)got / row_size;
+    chunk->last = chunk->rows < p->rows_cap;
+    for (int c = 0; c < p->column_count; ++c) {
+        double *column = chunk->columns + (size_t)c * p->rows_cap;
+        for (size_t r = 0; r < chunk->rows; ++r)
+            column[r] = raw[r * (size_t)p->column_count + c];
+    }
+    if ((size_t)got % row_size) {
+        pipeline_fail(p, "input ends in the middle of row %zu",
+                      chunk->first_row + chunk->rows + 1);
+        return false;
+    }
+    return true;
+}
+
+static void *reader_main(void *arg) {
+    Pipeline *p = arg;
+    double *raw = NULL;
+    if (p->binary) {
+        raw = malloc(sizeof(double) * (size_t)p->column_count * p->rows_cap);
+        if (!raw) {
+            pipeline_fail(p, "out of memory");
+            return NULL;
+        }
+    }
+    size_t row = 0;
+    for (size_t i = 0;; ++i) {
+        Chunk *chunk = chunk_wait(p, i, CHUNK_FREE);
+        if (!chunk)
+            break;
+        chunk->first_row = row;
+        chunk->last = false;
+        /* a failed fill still hands on the rows before the error */
+        if (!(p->binary ? binary_fill(p, chunk, raw) : csv_fill(p, chunk)))
+            chunk->last = true;
+        row += chunk->rows;
+        bool last = chunk->last;
+        chunk_pass(p, chunk, CHUNK_READ);
+        if (last)
+            break;
+    }
+    free(raw);
+    stage_done(p, &p->read_done);
+    return NULL;
+}
+
+/* Output */
+
+static bool write_full(Pipeline *p, const void *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t put = write(p->out, (const char *)buf + done, size - done);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put < 0) {
+            pipeline_fail(p, "write: %s", strerror(errno));
+            return false;
+        }
+        done += (size_t)put;
+    }
+    return true;
+}
+
+/* With -p, that many significant digits; otherwise %.15g if it reads back
+ * as v, else %.17g, which always does */
+static size_t format_number(const Pipeline *p, char *dst, double v) {
+    if (p->digits > 0)
+        return (size_t)snprintf(dst, NUMBER_MAX, "%.*g", p->digits, v);
+    int n = snprintf(dst, NUMBER_MAX, "%.15g", v);
+    const char *after;
+    if (!isnan(v) && read_number(dst, &after) != v)
+        n = snprintf(dst, NUMBER_MAX, "%.17g", v);
+    return (size_t)n;
+}
+
+/* A formula used as a column name is quoted if it has to be. */
+static size_t format_name(char *dst, const char *name) {
+    size_t n = 0;
+    bool quote = strpbrk(name, ",\"\n") != NULL;
+    if (quote)
+        dst[n++] = '"';
+    for (const char *s = name; *s; ++s) {
+        if (*s == '"')
+            dst[n++] = '"';
+        dst[n++] = *s;
+    }
+    if (quote)
+        dst[n++] = '"';
+    return n;
+}
+
+static bool csv_header(Pipeline *p) {
+    size_t size = 1;
+    for (int k = 0; k < p->output_count; ++k)
+        size += 2 * strlen(p->output_names[k]) + 3;
+    char *text = malloc(size);
+    if (!text) {
+        pipeline_fail(p, "out of memory");
+        return false;
+    }
+    size_t n = 0;
+    for (int k = 0; k < p->output_count; ++k) {
+        if (k)
+            text[n++] = ',';
+        n += format_name(text + n, p->output_names[k]);
+    }
+    text[n++] = '\n';
+    bool ok = write_full(p, text, n);
+    free(text);
+    return ok;
+}
+
+static bool csv_write(Pipeline *p, const Chunk *chunk, char *text) {
+    size_t n = 0;
+    for (size_t r = 0; r < chunk->rows; ++r) {
+        for (int k = 0; k < p->output_count; ++k) {
+            n += format_number(p, text + n,
+                               chunk->outputs[(size_t)k * p->rows_cap + r]);
+            text[n++] = k + 1 < p->output_count ? ',' : '\n';
+        }
+        if (n > IO_BUFFER) {
+            if (!write_full(p, text, n))
+                return false;
+            n = 0;
+        }
+    }
+    return write_full(p, text, n);
+}
+
+static bool binary_write(Pipeline *p, const Chunk *chunk, double *raw) {
+    for (int k = 0; k < p->output_count; ++k) {
+        const double *output = chunk->outputs + (size_t)k * p->rows_cap;
+        for (size_t r = 0; r < chunk->rows; ++r)
+            raw[r * (size_t)p->output_count + k] = output[r];
+    }
+    return write_full(p, raw,
+                      sizeof(double) * (size_t)p->output_count * chunk->rows);
+}
+
+static void *writer_main(void *arg) {
+    Pipeline *p = arg;
+    /* CSV text is flushed past IO_BUFFER, so one row more always fits */
+    size_t size = p->binary ? sizeof(double) * (size_t)p->output_count *
+                                  p->rows_cap
+                            : IO_BUFFER + (size_t)p->output_count * NUMBER_MAX;
+    void *buf = malloc(size);
+    if (!buf) {
+        pipeline_fail(p, "out of memory");
+        return NULL;
+    }
+    if (p->binary || csv_header(p)) {
+        for (size_t i = 0;; ++i) {
+            Chunk *chunk = chunk_wait(p, i, CHUNK_EVALUATED);
+            if (!chunk)
+                break;
+            bool ok = p->binary ? binary_write(p, chunk, buf)
+                                : csv_write(p, chunk, buf);
+            bool last = chunk->last;
+            chunk_pass(p, chunk, CHUNK_FREE);
+            if (!ok || last)
+                break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Evaluation */
+
+/* The batch stops at the first failing row without saying which, and leaves
+ * the outputs unspecified; evaluate the chunk again one row at a time and
+ * cut it at the failing row, which ends the output. */
+static void report_row(Pipeline *p, Chunk *chunk) {
+    double *out = malloc(sizeof(double) * (size_t)p->output_count);
+    bool found = false;
+    if (!out) {
+        chunk->rows = 0;
+        pipeline_fail(p, "out of memory");
+    }
+    for (size_t r = 0; out && r < chunk->rows; ++r) {
+        for (int c = 0; c < p->column_count; ++c)
+            *p->context->variables[c].value =
+                chunk->columns[(size_t)c * p->rows_cap + r];
+        if (!exprlib_program_run(p->program, p->context, out)) {
+            pipeline_fail(p, "row %zu: %s", chunk->first_row + r + 1,
+                          EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR]);
+            chunk->rows = r;
+            found = true;
+            break;
+        }
+        for (int k = 0; k < p->output_count; ++k)
+            chunk->outputs[(size_t)k * p->rows_cap + r] = out[k];
+    }
+    if (out && !found)
+        pipeline_fail(p, "rows %zu-%zu: %s", chunk->first_row + 1,
+                      chunk->first_row + chunk->rows,
+                      EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR]);
+    free(out);
+    chunk->last = true;
+}
+
+static void evaluate_chunks(Pipeline *p) {
+    const double **columns = malloc(sizeof(*columns) * (size_t)p->column_count);
+    double **outs = malloc(sizeof(*outs) * (size_t)p->output_count);
+    if (!columns || !outs) {
+        pipeline_fail(p, "out of memory");
+        free(columns);
+        free(outs);
+        return;
+    }
+    for (size_t i = 0;; ++i) {
+        Chunk *chunk = chunk_wait(p, i, CHUNK_READ);
+        if (!chunk)
+            break;
+        for (int c = 0; c < p->column_count; ++c)
+            columns[c] = chunk->columns + (size_t)c * p->rows_cap;
+        for (int k = 0; k < p->output_count; ++k)
+            outs[k] = chunk->outputs + (size_t)k * p->rows_cap;
+        if (chunk->rows > 0 &&
+            !exprlib_program_run_batch_parallel(p->program, p->context,
+                                                columns, chunk->rows, outs,
+                                                p->pool))
+            report_row(p, chunk); /* cut at the failing row */
+        bool last = chunk->last;
+        chunk_pass(p, chunk, CHUNK_EVALUATED);
+        if (last)
+            break;
+    }
+    free(columns);
+    free(outs);
+}
+
+static bool pipeline_run(Pipeline *p) {
+    for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+        Chunk *chunk = &p->chunks[i];
+        chunk->columns =
+            malloc(sizeof(double) * (size_t)p->column_count * p->rows_cap);
+        chunk->outputs =
+            malloc(sizeof(double) * (size_t)p->output_count * p->rows_cap);
+        if (!chunk->columns || !chunk->outputs)
+            pipeline_fail(p, "out of memory");
+    }
+
+    pthread_t reader, writer;
+    bool reading = false, writing = false;
+    if (!p->stop) {
+        reading = pthread_create(&reader, NULL, reader_main, p) == 0;
+        writing = pthread_create(&writer, NULL, writer_main, p) == 0;
+        if (!reading || !writing)
+            pipeline_fail(p, "cannot start threads");
+        else
+            evaluate_chunks(p);
+        stage_done(p, &p->evaluate_done);
+    }
+    if (reading)
+        pthread_join(reader, NULL);
+    if (writing)
+        pthread_join(writer, NULL);
+
+    for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+        free(p->chunks[i].columns);
+        free(p->chunks[i].outputs);
+    }
+    return !p->stop;
+}
+
+/* Command line */
+
+static void usage(FILE *out) {
+    fprintf(out,
+            "usage: expr [options] [name=]formula...\n"
+            "\n"
+            "Evaluates each formula for every row of the input and writes one\n"
+            "row of results per input row.\n"
+            "\n"
+            "  -i FILE   read rows from FILE instead of standard input\n"
+            "  -o FILE   write results to FILE instead of standard output\n"
+            "  -c NAMES  comma-separated column names; the input then has no\n"
+            "            header line (required with -b)\n"
+            "  -b        binary: rows of doubles in host byte order, in and\n"
+            "            out, instead of CSV\n"
+            "  -p DIGITS significant digits of CSV output (default: as many\n"
+            "            as needed to read back the same double)\n"
+            "  -j N      evaluation threads, 0 for one per CPU (default)\n"
+            "  -r ROWS   rows per chunk (default %d)\n"
+            "  -h        show this help\n"
+            "\n"
+            "Without formulas, runs a short demo.\n",
+            DEFAULT_CHUNK_ROWS);
+}
+
+static int demo(void) {
     string expr = "e^x * sin(x)";
     double x_value = 5.0;
     ExprLibVariable vars[] = {{"x", &x_value}};
@@ -21,6 +609,189 @@ int main() {
     } else {
         printf("Result: %g\n", result);
     }
-    free_expr(parsed_expr);
+    exprlib_free(parsed_expr);
     return 0;
-}
\ No newline at end of file
+}
+
+/* "name=formula" names its output; otherwise the formula is its own name */
+static const char *split_formula(char *arg, char **name) {
+    char *eq = strchr(arg, '=');
+    *name = arg;
+    if (!eq || eq == arg)
+        return arg;
+    for (char *s = arg; s < eq; ++s) {
+        if (!(*s == '_' || (*s >= '0' && *s <= '9') ||
+              (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')))
+            return arg;
+    }
+    *eq = '\0';
+    return eq + 1;
+}
+
+static bool parse_count(const char *s, long min, long *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno || end == s || *end || v < min)
+        return false;
+    *out = v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    exprlib_init();
+
+    Pipeline p = {.in = 0, .out = 1, .rows_cap = DEFAULT_CHUNK_ROWS};
+    const char *input = NULL, *output = NULL, *names = NULL;
+    long threads = 0, rows = DEFAULT_CHUNK_ROWS, digits = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:c:bp:j:r:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            input = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            names = optarg;
+            break;
+        case 'b':
+            p.binary = true;
+            break;
+        case 'p':
+            if (!parse_count(optarg, 1, &digits) || digits > 17) {
+                fprintf(stderr, "expr: digits must be 1 to 17\n");
+                return 2;
+            }
+            break;
+        case 'j':
+            if (!parse_count(optarg, 0, &threads)) {
+                fprintf(stderr, "expr: bad thread count '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'r':
+            if (!parse_count(optarg, 1, &rows)) {
+                fprintf(stderr, "expr: bad chunk size '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (optind == argc)
+        return demo();
+    if (p.binary && !names) {
+        fprintf(stderr, "expr: -b needs the column names in -c\n");
+        return 2;
+    }
+    p.rows_cap = (size_t)rows;
+    p.digits = (int)digits;
+    p.output_count = argc - optind;
+
+    if (input && (p.in = open(input, O_RDONLY)) < 0) {
+        fprintf(stderr, "expr: %s: %s\n", input, strerror(errno));
+        return 1;
+    }
+    if (output && (p.out = open(output, O_WRONLY | O_CREAT | O_TRUNC,
+                                0666)) < 0) {
+        fprintf(stderr, "expr: %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    posix_fadvise(p.in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int status = 1;
+    char **columns = NULL;
+    ExprLibVariable *vars = NULL;
+    double *values = NULL;
+    ExprNode **trees = calloc((size_t)p.output_count, sizeof(*trees));
+    ExprProgram *program = NULL;
+    p.output_names = calloc((size_t)p.output_count, sizeof(*p.output_names));
+    p.lines = (LineReader){.fd = p.in, .cap = IO_BUFFER};
+    p.lines.buf = malloc(p.lines.cap);
+    if (!trees || !p.output_names || !p.lines.buf) {
+        fprintf(stderr, "expr: out of memory\n");
+        goto done;
+    }
+
+    if (names) {
+        columns = split_names(names, strlen(names), &p.column_count);
+    } else {
+        size_t len = 0;
+        char *header = line_next(&p.lines, &len);
+        if (!header) {
+            fprintf(stderr, "expr: %s\n",
+                    errno ? strerror(errno) : "input has no header line");
+            goto done;
+        }
+        columns = split_names(header, len, &p.column_count);
+    }
+    vars = malloc(sizeof(*vars) * (size_t)p.column_count);
+    values = calloc((size_t)p.column_count, sizeof(*values));
+    if (!columns || !vars || !values) {
+        fprintf(stderr, "expr: out of memory\n");
+        goto done;
+    }
+    for (int c = 0; c < p.column_count; ++c)
+        vars[c] = (ExprLibVariable){columns[c], &values[c]};
+    ExprContext context = {vars, p.column_count};
+
+    for (int k = 0; k < p.output_count; ++k) {
+        const char *formula = split_formula(argv[optind + k],
+                                            &p.output_names[k]);
+        ExprLibDiagnostic diag;
+        trees[k] = exprlib_parse_ex((string)formula, &context, NULL, &diag);
+        if (!trees[k]) {
+            fprintf(stderr, "expr: %s: %s at offset %zu\n", formula,
+                    diag.message, diag.offset);
+            goto done;
+        }
+    }
+    program = exprlib_program_compile((const ExprNode *const *)trees,
+                                      p.output_count, &context, 0);
+    if (!program) {
+        fprintf(stderr, "expr: cannot compile: %s\n",
+                EXPRLIB_ERROR_MESSAGES[EXPRLIB_ERROR]);
+        goto done;
+    }
+    if (threads != 1)
+        p.pool = exprlib_pool_create((int)threads);
+
+    p.program = program;
+    p.context = &context;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+    if (pipeline_run(&p))
+        status = 0;
+    else
+        fprintf(stderr, "expr: %s\n", p.error);
+    pthread_cond_destroy(&p.changed);
+    pthread_mutex_destroy(&p.lock);
+    exprlib_pool_destroy(p.pool);
+
+done:
+    exprlib_program_free(program);
+    for (int k = 0; trees && k < p.output_count; ++k)
+        exprlib_free(trees[k]);
+    free(trees);
+    for (int c = 0; columns && c < p.column_count; ++c)
+        free(columns[c]);
+    free(columns);
+    free(vars);
+    free(values);
+    free(p.output_names);
+    free(p.lines.buf);
+    if (output && close(p.out) != 0 && status == 0) {
+        fprintf(stderr, "expr: %s: %s\n", output, strerror(errno));
+        status = 1;
+    }
+    if (input)
+        close(p.in);
+    return status;
+}